@@ -0,0 +1,207 @@
+//
+//  ConvolutionArena.h
+//  RTConvolve
+//
+
+#ifndef ConvolutionArena_h
+#define ConvolutionArena_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "util/util.h"
+#include <stdint.h>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__) || defined(__APPLE__)
+ #include <sys/mman.h>
+#endif
+#if defined(__APPLE__)
+ #include <mach/vm_statistics.h>
+#endif
+
+/**
+ One block of memory from which the buffers and spectra of a convolution engine are
+ taken, instead of each of them being allocated on its own.
+
+ The arena is sized up front: every class that takes its state from an arena has a
+ static getArenaSize() that returns how much it will take for the same arguments as
+ its constructor, so that a whole engine can be sized from its partition plan before
+ anything is built. Allocations are carved off one after the other, each aligned to
+ a cache line and zeroed, and are all released at once when the arena is deleted.
+ Keeping an engine's state contiguous makes it quick to build, and leaves nothing
+ scattered across the heap when it is rebuilt.
+
+ Large arenas can optionally be backed by huge pages, so that the spectra of a long
+ impulse response are covered by a few TLB entries rather than thousands. This is
+ a hint: where huge pages are unavailable, the arena falls back to normal pages.
+
+ An arena is filled while the objects using it are constructed, from one thread,
+ and only read and written through the allocations afterwards.
+ */
+class ConvolutionArena
+{
+public:
+    enum { kAlignment = 64 };
+
+    /** Arenas at least this large are backed by huge pages if requested */
+    enum { kHugePageSize = 2 * 1024 * 1024 };
+
+    /**
+     @param capacity
+        The number of bytes available, as the sum of the getArenaSize() of the objects
+        to be built in it.
+     @param useHugePages
+        If true, and the arena is at least kHugePageSize bytes, try to back it with
+        huge pages.
+     */
+    explicit ConvolutionArena(size_t capacity, bool useHugePages = false)
+    : mCapacity(getAligned(capacity))
+    , mUsed(0)
+    , mData(nullptr)
+    , mMappedSize(0)
+    , mHugePages(false)
+    {
+        if (useHugePages && mCapacity >= (size_t)kHugePageSize)
+        {
+            mapHugePages();
+        }
+
+        if (mData == nullptr)
+        {
+            mStorage.calloc(mCapacity + kAlignment);
+            checkNull(mStorage);
+            mData = (char *)getAligned((uintptr_t)mStorage.getData());
+        }
+    }
+
+    ~ConvolutionArena()
+    {
+#if defined(__linux__) || defined(__APPLE__)
+        if (mMappedSize != 0)
+        {
+            munmap(mData, mMappedSize);
+        }
+#endif
+    }
+
+    /**
+     @returns
+        'count' zeroed elements of type T, aligned to a cache line.
+     @throws std::bad_alloc
+        If the arena was sized too small for them.
+     */
+    template <typename T>
+    T *allocate(size_t count)
+    {
+        const size_t size = getAllocationSize<T>(count);
+
+        if (size > mCapacity - mUsed)
+        {
+            throw std::bad_alloc();
+        }
+
+        T *data = (T *)(mData + mUsed);
+        mUsed += size;
+        return data;
+    }
+
+    /**
+     Make 'buffer' refer to 'numChannels' channels of 'numSamples' zeroed samples
+     taken from the arena, each starting on a cache line.
+     */
+    template <typename T>
+    void allocateBuffer(juce::AudioBuffer<T> &buffer, int numChannels, int numSamples)
+    {
+        T **channels = allocate<T *>(numChannels);
+
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            channels[channel] = allocate<T>(numSamples);
+        }
+
+        buffer.setDataToReferTo(channels, numChannels, numSamples);
+    }
+
+    /** @returns The number of bytes that allocate<T>('count') takes from an arena. */
+    template <typename T>
+    static size_t getAllocationSize(size_t count)
+    {
+        return getAligned(count * sizeof(T));
+    }
+
+    /** @returns The number of bytes that allocateBuffer() takes from an arena. */
+    template <typename T>
+    static size_t getBufferAllocationSize(int numChannels, int numSamples)
+    {
+        return getAllocationSize<T *>(numChannels) + (numChannels * getAllocationSize<T>(numSamples));
+    }
+
+    size_t getCapacity() const
+    {
+        return mCapacity;
+    }
+
+    size_t getNumBytesUsed() const
+    {
+        return mUsed;
+    }
+
+    /** @returns true if the arena is backed by huge pages. */
+    bool isUsingHugePages() const
+    {
+        return mHugePages;
+    }
+
+private:
+    size_t mCapacity;
+    size_t mUsed;
+    char *mData;
+    size_t mMappedSize;
+    bool mHugePages;
+    juce::HeapBlock<char> mStorage;
+
+    static size_t getAligned(size_t x)
+    {
+        return (x + kAlignment - 1) & ~(size_t)(kAlignment - 1);
+    }
+
+    /** Map the arena on huge pages, leaving mData null if the system has none to give */
+    void mapHugePages()
+    {
+#if defined(__linux__) || defined(__APPLE__)
+        const size_t size = (mCapacity + kHugePageSize - 1) & ~(size_t)(kHugePageSize - 1);
+        void *data = MAP_FAILED;
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+        /* Reserved huge pages, if the administrator set some aside */
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#elif defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+        mHugePages = (data != MAP_FAILED);
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        /* Otherwise transparent huge pages, if they are enabled on request */
+        if (data == MAP_FAILED)
+        {
+            data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (data != MAP_FAILED)
+            {
+                mHugePages = (madvise(data, size, MADV_HUGEPAGE) == 0);
+            }
+        }
+#endif
+
+        if (data != MAP_FAILED)
+        {
+            mData = (char *)data;
+            mMappedSize = size;
+        }
+#endif
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (ConvolutionArena)
+};
+
+#endif /* ConvolutionArena_h */
@@ -11,6 +11,12 @@
 
 #include "UniformPartitionConvolver.h"
 #include "TimeDistributedFFTConvolver.h"
+#include "TimeDistributedLevel.h"
+#include "PartitionPlanner.h"
+#include "ImpulseResponseTrim.h"
+#include "SampleDelayLine.h"
+#include "WorkerLevel.h"
+#include "ConvolutionArena.h"
 #include "../JuceLibraryCode/JuceHeader.h"
 #include "util/util.h"
 #include "util/SincFilter.hpp"
@@ -18,123 +24,984 @@
 static const int DEFAULT_NUM_SAMPLES = 512;
 static const int DEFAULT_BUFFER_SIZE = 512;
 
+/**
+ Convolves the input with an impulse response, one host buffer at a time, with no
+ restriction on the buffer size.
+
+ The convolution engine itself runs at an internal block size: the power of two
+ that gives the lowest worst-case cost per host buffer, according to the
+ PartitionPlanner. Host buffers are cut into, or collected into, blocks of that
+ size by a FIFO. If the host buffer size is a multiple of the block size, and
+ every buffer is, the output has no latency. Otherwise the output is delayed by
+ as many samples as can be left waiting for a block to complete: the block size
+ less the largest power of two dividing the buffer size, e.g. one block less one
+ sample for buffer sizes such as 441, or buffers of varying size (see getLatency()).
+
+ Where some latency is acceptable, setLatencyBudget() allows larger blocks, and
+ with them a larger first partition: fewer, more efficient FFTs per sample.
+
+ Constructing a manager, or changing its impulse response or any setting, prepares
+ a whole new engine, with the impulse response partitions transformed on all cores
+ by the ConvolutionScheduler. This can be done on any thread other than the audio
+ thread, e.g. to build a new manager in the background that replaces the one in
+ use once it is ready. With progressive activation (see
+ setProgressiveActivationEnabled()), only the head of the impulse response is
+ transformed up front, so that a new engine is ready in the same short time
+ whatever the length of the impulse response, and the tail follows in the background.
+
+ A manager convolves one or more inputs into one or more outputs, as routed by a
+ ConvolutionMatrix: each path from an input to an output has its own impulse
+ response, e.g. the four paths LL, LR, RL and RR of a true stereo reverb. All paths
+ share one partition plan and one engine. Each input is transformed once, however
+ many paths it feeds, and the paths into an output are summed in the frequency
+ domain, so each output is transformed back once. Independent channels (a diagonal
+ matrix) have their spectra interleaved instead, so that a single
+ multiply-accumulate pass covers every channel.
+
+ All the buffers and input spectra of an engine, and the FIFOs around it, are taken
+ from one ConvolutionArena, sized from the partition plan before the engine is built
+ and released in one go when it is replaced. The impulse response spectra, which are
+ only read once prepared, are shared instead: every level of every manager in the
+ process that partitions the same impulse response alike uses the same spectra, from
+ the ImpulseSpectrumCache, so that several instances of a plugin loading the same
+ impulse response transform and store it once.
+ */
 template <typename FLOAT_TYPE>
 class ConvolutionManager
 {
 public:
-    ConvolutionManager(FLOAT_TYPE *impulseResponse = nullptr, int numSamples = 0, int bufferSize = 0)
-    : mBufferSize(bufferSize)
-    , mTimeDistributedConvolver(nullptr)
+    /**
+     @param impulseResponse
+        The impulse response, copied. nullptr for a unit impulse.
+     @param numSamples
+        The length of the impulse response.
+     @param bufferSize
+        The host buffer size, see setBufferSize(). Zero for a default size.
+     @param latencyBudget
+        See setLatencyBudget().
+     @param backgroundThreadEnabled
+        See setBackgroundThreadEnabled().
+     @param progressiveActivationEnabled
+        See setProgressiveActivationEnabled().
+     */
+    ConvolutionManager(FLOAT_TYPE *impulseResponse = nullptr, int numSamples = 0, int bufferSize = 0,
+                       int latencyBudget = 0, bool backgroundThreadEnabled = false,
+                       bool progressiveActivationEnabled = false)
+    : ConvolutionManager(1, (impulseResponse != nullptr) ? &impulseResponse : nullptr, numSamples, bufferSize,
+                         latencyBudget, backgroundThreadEnabled, progressiveActivationEnabled)
     {
-        if (impulseResponse == nullptr)
+    }
+    
+    /**
+     @param numChannels
+        The number of channels, each convolved with its own impulse response.
+     @param impulseResponses
+        The impulse response of each channel, copied. nullptr for a unit impulse on
+        every channel.
+     @param numSamples
+        The length of the impulse responses.
+     The other parameters are as for the single-channel constructor.
+     */
+    ConvolutionManager(int numChannels, const FLOAT_TYPE *const *impulseResponses, int numSamples, int bufferSize = 0,
+                       int latencyBudget = 0, bool backgroundThreadEnabled = false,
+                       bool progressiveActivationEnabled = false)
+    : ConvolutionManager(ConvolutionMatrix::diagonal(numChannels), impulseResponses, numSamples, bufferSize,
+                         latencyBudget, backgroundThreadEnabled, progressiveActivationEnabled)
+    {
+    }
+    
+    /**
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param impulseResponses
+        The impulse response of each path, in the order of the matrix's paths, copied.
+        nullptr for a unit impulse on every path from an input to the output of the
+        same index, and silence on the others.
+     @param numSamples
+        The length of the impulse responses.
+     The other parameters are as for the single-channel constructor.
+     */
+    ConvolutionManager(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                       int bufferSize = 0, int latencyBudget = 0, bool backgroundThreadEnabled = false,
+                       bool progressiveActivationEnabled = false)
+    : mMatrix(matrix)
+    , mBufferSize(bufferSize)
+    , mBlockSize(0)
+    , mLatency(0)
+    , mLatencyBudget(std::max(0, latencyBudget))
+    , mUseWorker(backgroundThreadEnabled)
+    , mProgressive(progressiveActivationEnabled)
+    , mHugePages(false)
+    , mInputFill(0)
+    , mOutputFill(0)
+    , mSilenceThreshold(DEFAULT_SILENCE_THRESHOLD_DB)
+    , mTrimThreshold(DEFAULT_TRIM_THRESHOLD_DB)
+    , mImpulsePrecision(kSpectrumFloat)
+    , mInputPrecision(kSpectrumFloat)
+    {
+        if (mBufferSize <= 0)
         {
             mBufferSize = DEFAULT_BUFFER_SIZE;
-            mImpulseResponse = new juce::AudioBuffer<FLOAT_TYPE>(1, DEFAULT_NUM_SAMPLES);
-            checkNull(mImpulseResponse);
-            
-            FLOAT_TYPE *ir = mImpulseResponse->getWritePointer(0);
-            genImpulse(ir, DEFAULT_NUM_SAMPLES);
-            
-            init(ir, DEFAULT_NUM_SAMPLES);
-        }
-        else
-        {
-            mImpulseResponse = new juce::AudioBuffer<FLOAT_TYPE>(1, numSamples);
-            checkNull(mImpulseResponse);
-            mImpulseResponse->clear();
-            FLOAT_TYPE *ir = mImpulseResponse->getWritePointer(0);
-            
-            memcpy(ir, impulseResponse, numSamples * sizeof(FLOAT_TYPE));
-            init(ir, numSamples);
         }
+        
+        copyImpulseResponse(matrix, impulseResponses, numSamples);
+        init();
     }
     
     /**
-     Perform one base time period's worth of work for the convolution.
+     Convolve one host buffer of a single-input manager.
      @param input
-     The input is expected to hold a number of samples equal to the 'bufferSize'
-     specified in the constructor.
+        The input is expected to hold a number of samples equal to the 'bufferSize'
+        specified in the constructor or setBufferSize().
      */
     void processInput(FLOAT_TYPE *input)
     {
-        mUniformConvolver->processInput(input);
-        const FLOAT_TYPE *out1 = mUniformConvolver->getOutputBuffer();
-        FLOAT_TYPE *output = mOutput->getWritePointer(0);
+        processInput(input, mBufferSize);
+    }
+    
+    /**
+     Convolve one host buffer of any size up to the 'bufferSize' specified in the
+     constructor or setBufferSize(), for a single-input manager. The output is
+     written to the first 'numSamples' samples of getOutputBuffer().
+     */
+    void processInput(FLOAT_TYPE *input, int numSamples)
+    {
+        processInput(&input, numSamples);
+    }
+    
+    /**
+     Convolve one host buffer of every input.
+     @param inputs
+        One buffer of 'numSamples' samples per input. 'numSamples' may be any size
+        up to the 'bufferSize' specified in the constructor or setBufferSize(). Each
+        output is written to the first 'numSamples' samples of its getOutputBuffer().
+     */
+    void processInput(const FLOAT_TYPE *const *inputs, int numSamples)
+    {
+        const int numInputs = getNumInputs();
+        const int numOutputs = getNumOutputs();
         
-        /* Prepare output */
+        /* Whole blocks with nothing left over from earlier buffers go straight through */
+        if (mInputFill == 0 && mOutputFill == 0 && (numSamples % mBlockSize) == 0)
+        {
+            for (int i = 0; i < numSamples; i += mBlockSize)
+            {
+                for (int input = 0; input < numInputs; ++input)
+                {
+                    mBlockInputs[input] = inputs[input] + i;
+                }
+                for (int output = 0; output < numOutputs; ++output)
+                {
+                    mBlockOutputs[output] = mOutput.getWritePointer(output) + i;
+                }
+                processBlock(mBlockInputs, mBlockOutputs);
+            }
+            return;
+        }
         
-        if (mTimeDistributedConvolver != nullptr)
+        for (int i = 0; i < numSamples; )
         {
-            mTimeDistributedConvolver->processInput(input);
-            const FLOAT_TYPE *out2 = mTimeDistributedConvolver->getOutputBuffer();
+            const int n = std::min(numSamples - i, mBlockSize - mInputFill);
+            
+            for (int input = 0; input < numInputs; ++input)
+            {
+                memcpy(mInputFifo.getWritePointer(input) + mInputFill, inputs[input] + i, n * sizeof(FLOAT_TYPE));
+            }
+            mInputFill += n;
+            i += n;
             
-            for (int i = 0; i < mBufferSize; ++i)
+            if (mInputFill == mBlockSize)
             {
-                output[i] = out1[i] + out2[i];
+                for (int output = 0; output < numOutputs; ++output)
+                {
+                    mBlockOutputs[output] = mOutputFifo.getWritePointer(output) + mOutputFill;
+                }
+                processBlock(mInputFifo.getArrayOfReadPointers(), mBlockOutputs);
+                mOutputFill += mBlockSize;
+                mInputFill = 0;
             }
         }
-        else
+        
+        /* A buffer of a size that the latency can't absorb: from now on the output
+           is delayed by one block less one sample, which absorbs any size */
+        if (mOutputFill < numSamples)
         {
-            for (int i = 0; i < mBufferSize; ++i)
+            const int extraLatency = (mBlockSize - 1) - mLatency;
+            
+            for (int output = 0; output < numOutputs; ++output)
             {
-                output[i] = out1[i];
+                FLOAT_TYPE *outputFifo = mOutputFifo.getWritePointer(output);
+                memmove(outputFifo + extraLatency, outputFifo, mOutputFill * sizeof(FLOAT_TYPE));
+                memset(outputFifo, 0, extraLatency * sizeof(FLOAT_TYPE));
             }
+            mOutputFill += extraLatency;
+            mLatency = mBlockSize - 1;
+        }
+        
+        mOutputFill -= numSamples;
+        
+        for (int output = 0; output < numOutputs; ++output)
+        {
+            FLOAT_TYPE *outputFifo = mOutputFifo.getWritePointer(output);
+            memcpy(mOutput.getWritePointer(output), outputFifo, numSamples * sizeof(FLOAT_TYPE));
+            memmove(outputFifo, outputFifo + numSamples, mOutputFill * sizeof(FLOAT_TYPE));
         }
     }
     
-    const FLOAT_TYPE *getOutputBuffer() const
+    const FLOAT_TYPE *getOutputBuffer(int output = 0) const
     {
-        return mOutput->getReadPointer(0);
+        return mOutput.getReadPointer(output);
     }
     
+    int getNumInputs() const
+    {
+        return mMatrix.numInputs;
+    }
+    
+    int getNumOutputs() const
+    {
+        return mMatrix.numOutputs;
+    }
+    
+    const ConvolutionMatrix &getMatrix() const
+    {
+        return mMatrix;
+    }
+    
+    /**
+     Set the host buffer size: the largest number of samples passed to a single call
+     of processInput(). Any size is supported, and the internal block size is chosen
+     from it.
+     */
     void setBufferSize(int bufferSize)
     {
-        FLOAT_TYPE *ir = mImpulseResponse->getWritePointer(0);
-        int numSamples = mImpulseResponse->getNumSamples();
         mBufferSize = bufferSize;
-        
-        init(ir, numSamples);
+        init();
     }
     
     void setImpulseResponse(const FLOAT_TYPE *impulseResponse, int numSamples)
     {
-        mImpulseResponse = new juce::AudioBuffer<FLOAT_TYPE>(1, numSamples);
-        checkNull(mImpulseResponse);
-        
-        mImpulseResponse->clear();
-        
-        FLOAT_TYPE *ir = mImpulseResponse->getWritePointer(0);
-        memcpy(ir, impulseResponse, numSamples * sizeof(FLOAT_TYPE));
-        init(ir, numSamples);
+        setImpulseResponse(1, &impulseResponse, numSamples);
+    }
+    
+    /**
+     Replace the impulse responses of all channels. The number of channels may change.
+     */
+    void setImpulseResponse(int numChannels, const FLOAT_TYPE *const *impulseResponses, int numSamples)
+    {
+        setImpulseResponse(ConvolutionMatrix::diagonal(numChannels), impulseResponses, numSamples);
+    }
+    
+    /**
+     Replace the matrix and the impulse responses of all its paths. The number of
+     inputs and outputs may change.
+     */
+    void setImpulseResponse(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples)
+    {
+        copyImpulseResponse(matrix, impulseResponses, numSamples);
+        init();
+    }
+    
+    /**
+     Set how quiet an impulse response partition must be to be skipped.
+     @param thresholdDecibels
+        Partitions whose energy is lower than that of the strongest partition by more
+        than this are left out of the convolution.
+     */
+    void setSilenceThreshold(double thresholdDecibels)
+    {
+        mSilenceThreshold = thresholdDecibels;
+        init();
+    }
+    
+    /**
+     Set how much of the silence at the start and of the decay at the end of the
+     impulse response is trimmed. The silence before the onset is implemented as a
+     delay of the input rather than convolved, and the end is dropped.
+     @param thresholdDecibels
+        The leading samples, and likewise the trailing samples, whose energy adds up
+        to less than this relative to the total energy of the impulse response are
+        trimmed. The default of -inf only trims samples that are exactly zero, which
+        leaves the output unchanged; e.g. -120 dB also trims a decay below the
+        rounding error of single precision.
+     */
+    void setTrimThreshold(double thresholdDecibels)
+    {
+        mTrimThreshold = thresholdDecibels;
+        init();
+    }
+    
+    /**
+     @returns
+        Where the current impulse response was trimmed, and how many partitions
+        that saved.
+     */
+    const ImpulseResponseTrim &getImpulseResponseTrim() const
+    {
+        return mTrim;
+    }
+    
+    /**
+     Choose the storage format of the spectra. For very long impulse responses, the
+     multiply-accumulate is limited by memory bandwidth, and storing the spectra in
+     16 bits instead of 32 halves both the memory traffic and the footprint. The
+     arithmetic is still done in single precision. Only takes effect for float.
+     @param impulsePrecision
+        The storage format of the impulse response spectra.
+     @param inputPrecision
+        The storage format of the input spectrum history: kSpectrumFloat, or the
+        same as 'impulsePrecision'. kSpectrumBFloat16 is recommended for the input,
+        whose spectra of long partitions can exceed the range of kSpectrumHalf.
+     */
+    void setSpectrumPrecision(SpectrumPrecision impulsePrecision, SpectrumPrecision inputPrecision = kSpectrumFloat)
+    {
+        mImpulsePrecision = impulsePrecision;
+        mInputPrecision = inputPrecision;
+        init();
+    }
+    
+    /**
+     @returns
+        The measured error of the convolution caused by the storage format of the
+        spectra, relative to the output level, in decibels: the quantization error
+        of the impulse response spectra plus that of every input spectrum stored so
+        far. -inf in full precision.
+     */
+    double getSpectrumPrecisionError() const
+    {
+        return mEngine->getSpectrumPrecisionError();
+    }
+    
+    /**
+     @returns
+        The number of bytes taken by the impulse response and input spectra.
+     */
+    size_t getSpectrumStorageSize() const
+    {
+        return mEngine->getSpectrumStorageSize();
+    }
+    
+    /**
+     @returns
+        The delay in samples of the output: zero if the host buffer size is a multiple
+        of getBlockSize(), otherwise getBlockSize() less the largest power of two that
+        divides the buffer size. It becomes getBlockSize() - 1 as soon as a buffer of
+        a different size is processed.
+     */
+    int getLatency() const
+    {
+        return mLatency;
+    }
+    
+    /**
+     Allow the output to be delayed by up to 'numSamples' samples, in exchange for a
+     lower average CPU load. Block sizes larger than the buffer size whose latency
+     fits in the budget are then considered too, and the one with the lowest cost per
+     sample is used, making the first partition as large as the budget allows
+     for long impulse responses. The work of a block is still done in the buffer that
+     completes it, so the worst-case cost of a buffer grows with the block size.
+     Zero, the default, chooses the block size with the lowest worst-case cost per
+     buffer instead. The resulting latency is returned by getLatency().
+     */
+    void setLatencyBudget(int numSamples)
+    {
+        mLatencyBudget = std::max(0, numSamples);
+        init();
+    }
+    
+    int getLatencyBudget() const
+    {
+        return mLatencyBudget;
+    }
+    
+    /**
+     Compute the levels of the partition plan with partitions of at least
+     kMinWorkerPartitionSize samples on the threads of the process-wide
+     ConvolutionScheduler (see WorkerLevel), leaving the audio thread with the head
+     of the impulse response and the cheap levels. Off by default. The partition
+     plan is the same either way.
+     */
+    void setBackgroundThreadEnabled(bool enabled)
+    {
+        mUseWorker = enabled;
+        init();
+    }
+    
+    bool isBackgroundThreadEnabled() const
+    {
+        return mUseWorker;
+    }
+    
+    /**
+     Start convolving as soon as the head of the impulse response, the partitions of
+     the UPConvolver, is transformed. The partitions of the later levels are then
+     transformed in the background by the ConvolutionScheduler, in order, and each
+     one joins the convolution as soon as it is ready, contributing nothing until
+     then. The engine never waits for them. Off by default, so that the whole impulse
+     response is convolved from the first sample.
+     */
+    void setProgressiveActivationEnabled(bool enabled)
+    {
+        mProgressive = enabled;
+        init();
+    }
+    
+    bool isProgressiveActivationEnabled() const
+    {
+        return mProgressive;
+    }
+    
+    /**
+     Back the arena holding the state of the engine with huge pages, where the system
+     provides them and the arena spans at least one. With long impulse responses,
+     the multiply-accumulate then walks the spectra with far fewer TLB misses. Off by
+     default.
+     */
+    void setHugePagesEnabled(bool enabled)
+    {
+        mHugePages = enabled;
+        init();
+    }
+    
+    bool isHugePagesEnabled() const
+    {
+        return mHugePages;
+    }
+    
+    /**
+     @returns
+        true if the state of the engine is actually on huge pages.
+     */
+    bool isUsingHugePages() const
+    {
+        return mArena->isUsingHugePages();
+    }
+    
+    /**
+     @returns
+        The number of bytes of the arena holding the state of the engine, less the
+        impulse response spectra, which may be shared with other managers.
+     */
+    size_t getArenaSize() const
+    {
+        return mArena->getCapacity();
+    }
+    
+    /**
+     @returns
+        The number of impulse response partitions not yet transformed, and so not
+        yet convolved. Only ever non-zero with progressive activation.
+     */
+    int getNumPendingPartitions() const
+    {
+        return mEngine->getNumPendingPartitions();
+    }
+    
+    /**
+     @returns
+        The number of blocks whose output the background thread did not deliver in
+        time, and which were played as silence, since the engine was last rebuilt.
+     */
+    int getNumDeadlineMisses() const
+    {
+        return mEngine->getNumDeadlineMisses();
+    }
+    
+    /**
+     @returns
+        The work done for this convolution on the background threads since the
+        engine was last rebuilt. See ConvolutionScheduler::getInstance() for the
+        whole pool's.
+     */
+    ConvolutionScheduler::Statistics getBackgroundStatistics() const
+    {
+        return mEngine->getBackgroundStatistics();
+    }
+    
+    /**
+     @returns
+        The power of two block size at which the convolution engine runs.
+     */
+    int getBlockSize() const
+    {
+        return mBlockSize;
+    }
+    
+    /**
+     @returns
+        The partitioning scheme chosen by the PartitionPlanner for the current
+        impulse response and block size.
+     */
+    const PartitionPlan &getPartitionPlan() const
+    {
+        return mPartitionPlan;
     }
     
 private:
+    /**
+     The partitioned convolution engine for one buffer size: a UPConvolver for the
+     head of the impulse response followed by a TimeDistributedLevel for each further
+     level of the partition plan, or a WorkerLevel for the long ones if the background
+     threads are enabled.
+     */
+    class Engine
+    {
+    public:
+        virtual ~Engine() {}
+        
+        /**
+         Process one buffer per input and write the same number of samples of
+         convolved output to each output.
+         */
+        virtual void processInput(const FLOAT_TYPE *const *inputs, FLOAT_TYPE *const *outputs) = 0;
+        
+        virtual double getSpectrumPrecisionError() const = 0;
+        virtual size_t getSpectrumStorageSize() const = 0;
+        virtual int getNumDeadlineMisses() const = 0;
+        virtual ConvolutionScheduler::Statistics getBackgroundStatistics() const = 0;
+        virtual int getNumPendingPartitions() const = 0;
+        
+        /** Relative errors of the two factors of a product add up */
+        static double addErrors(double decibels1, double decibels2)
+        {
+            return 10.0 * log10(pow(10.0, decibels1 / 10.0) + pow(10.0, decibels2 / 10.0));
+        }
+    };
+    
+    /**
+     Engine whose buffer size is the compile-time constant BLOCK_SIZE, or a runtime
+     value when BLOCK_SIZE is zero.
+     */
+    template <int BLOCK_SIZE>
+    class BlockSizeEngine : public Engine
+    {
+    public:
+        /** Build the engine with all its state in 'arena', which must outlive it */
+        BlockSizeEngine(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                        const PartitionPlan &plan, double silenceThreshold, SpectrumPrecision impulsePrecision,
+                        SpectrumPrecision inputPrecision, bool useWorker, bool progressive, ConvolutionArena &arena)
+        : mNumOutputs(matrix.numOutputs)
+        , mBufferSize(plan.bufferSize)
+        {
+            const int numHeadPartitions = plan.levels[0].numPartitions;
+            const int numPaths = matrix.getNumPaths();
+            std::vector<const FLOAT_TYPE *> subIRs(numPaths);
+            
+            mUniformConvolver = new UPConvolver<FLOAT_TYPE, BLOCK_SIZE>(matrix, impulseResponses, numSamples, mBufferSize, numHeadPartitions,
+                                                                   silenceThreshold, impulsePrecision, inputPrecision, false, &arena);
+            checkNull(mUniformConvolver);
+            
+            for (size_t i = 1; i < plan.levels.size(); ++i)
+            {
+                const PartitionLevel &level = plan.levels[i];
+                const int start = plan.getLevelStart(i);
+                
+                if (start >= numSamples)
+                    break;
+                
+                for (int path = 0; path < numPaths; ++path)
+                {
+                    subIRs[path] = impulseResponses[path] + start;
+                }
+                const int subNumSamples = std::min(numSamples - start, level.partitionSize * level.numPartitions);
+                
+                if (isWorkerLevel(level, useWorker))
+                {
+                    WorkerLevel<FLOAT_TYPE> *workerLevel = new WorkerLevel<FLOAT_TYPE>(matrix, subIRs.data(), subNumSamples, start, mBufferSize,
+                                                                                       level.partitionSize, ConvolutionScheduler::getInstance(),
+                                                                                       silenceThreshold, impulsePrecision, inputPrecision, progressive,
+                                                                                       &arena);
+                    mLevels.add(workerLevel);
+                    mWorkerLevels.push_back(workerLevel);
+                }
+                else
+                {
+                    mLevels.add(new TimeDistributedLevel<FLOAT_TYPE, BLOCK_SIZE>(matrix, subIRs.data(), subNumSamples, start, mBufferSize,
+                                                                                 level.partitionSize, silenceThreshold, impulsePrecision,
+                                                                                 inputPrecision, progressive, &arena));
+                }
+            }
+        }
+        
+        /** @returns The number of bytes the constructor takes from the arena for the same arguments. */
+        static size_t getArenaSize(const ConvolutionMatrix &matrix, int numSamples, const PartitionPlan &plan,
+                                   SpectrumPrecision impulsePrecision, SpectrumPrecision inputPrecision, bool useWorker,
+                                   bool progressive)
+        {
+            const int bufferSize = plan.bufferSize;
+            size_t size = UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::getArenaSize(matrix, numSamples, bufferSize, plan.levels[0].numPartitions,
+                                                                          impulsePrecision, inputPrecision);
+            
+            for (size_t i = 1; i < plan.levels.size(); ++i)
+            {
+                const PartitionLevel &level = plan.levels[i];
+                const int start = plan.getLevelStart(i);
+                
+                if (start >= numSamples)
+                    break;
+                
+                const int subNumSamples = std::min(numSamples - start, level.partitionSize * level.numPartitions);
+                
+                if (isWorkerLevel(level, useWorker))
+                {
+                    size += WorkerLevel<FLOAT_TYPE>::getArenaSize(matrix, subNumSamples, start, bufferSize, level.partitionSize,
+                                                                  impulsePrecision, inputPrecision, progressive);
+                }
+                else
+                {
+                    size += TimeDistributedLevel<FLOAT_TYPE, BLOCK_SIZE>::getArenaSize(matrix, subNumSamples, start, bufferSize,
+                                                                                       level.partitionSize, impulsePrecision,
+                                                                                       inputPrecision, progressive);
+                }
+            }
+            return size;
+        }
+        
+        void processInput(const FLOAT_TYPE *const *inputs, FLOAT_TYPE *const *outputs) override
+        {
+            const int bufferSize = (BLOCK_SIZE != 0) ? BLOCK_SIZE : mBufferSize;
+            
+            mUniformConvolver->processInput(inputs);
+            
+            for (int output = 0; output < mNumOutputs; ++output)
+            {
+                memcpy(outputs[output], mUniformConvolver->getOutputBuffer(output), bufferSize * sizeof(FLOAT_TYPE));
+            }
+            
+            for (int level = 0; level < mLevels.size(); ++level)
+            {
+                ConvolutionLevel<FLOAT_TYPE> *convolver = mLevels.getUnchecked(level);
+                convolver->processInput(inputs);
+                
+                for (int output = 0; output < mNumOutputs; ++output)
+                {
+                    FLOAT_TYPE *out = outputs[output];
+                    const FLOAT_TYPE *levelOutput = convolver->getOutputBuffer(output);
+                    
+                    for (int i = 0; i < bufferSize; ++i)
+                    {
+                        out[i] += levelOutput[i];
+                    }
+                }
+            }
+        }
+        
+        double getSpectrumPrecisionError() const override
+        {
+            double error = getSpectrumPrecisionError(mUniformConvolver->getDelayLine());
+            
+            for (int level = 0; level < mLevels.size(); ++level)
+            {
+                error = std::max(error, getSpectrumPrecisionError(mLevels.getUnchecked(level)->getDelayLine()));
+            }
+            return error;
+        }
+        
+        size_t getSpectrumStorageSize() const override
+        {
+            size_t size = mUniformConvolver->getDelayLine().getStorageSize();
+            
+            for (int level = 0; level < mLevels.size(); ++level)
+            {
+                size += mLevels.getUnchecked(level)->getDelayLine().getStorageSize();
+            }
+            return size;
+        }
+        
+        int getNumDeadlineMisses() const override
+        {
+            int numMisses = 0;
+            
+            for (size_t level = 0; level < mWorkerLevels.size(); ++level)
+            {
+                numMisses += mWorkerLevels[level]->getNumDeadlineMisses();
+            }
+            return numMisses;
+        }
+        
+        ConvolutionScheduler::Statistics getBackgroundStatistics() const override
+        {
+            ConvolutionScheduler::Statistics statistics;
+            
+            for (size_t level = 0; level < mWorkerLevels.size(); ++level)
+            {
+                ConvolutionScheduler::getInstance().addStatistics(*mWorkerLevels[level], statistics);
+            }
+            return statistics;
+        }
+        
+        int getNumPendingPartitions() const override
+        {
+            int numPending = 0;
+            
+            for (int level = 0; level < mLevels.size(); ++level)
+            {
+                const FrequencyDomainDelayLine<FLOAT_TYPE> &delayLine = mLevels.getUnchecked(level)->getDelayLine();
+                numPending += delayLine.getNumPartitions() - delayLine.getNumReadyPartitions();
+            }
+            return numPending;
+        }
+        
+    private:
+        int mNumOutputs;
+        int mBufferSize;
+        juce::ScopedPointer<UPConvolver<FLOAT_TYPE, BLOCK_SIZE> > mUniformConvolver;
+        juce::OwnedArray<ConvolutionLevel<FLOAT_TYPE> > mLevels;
+        std::vector<WorkerLevel<FLOAT_TYPE> *> mWorkerLevels;
+        
+        static double getSpectrumPrecisionError(const FrequencyDomainDelayLine<FLOAT_TYPE> &delayLine)
+        {
+            return Engine::addErrors(delayLine.getImpulseQuantizationError(), delayLine.getInputQuantizationError());
+        }
+        
+        static bool isWorkerLevel(const PartitionLevel &level, bool useWorker)
+        {
+            return useWorker && level.partitionSize >= kMinWorkerPartitionSize;
+        }
+    };
+    
+    /** The range of block sizes tried, unless the buffer size is a smaller power of two */
+    enum { kMinBlockSize = 32, kMaxBlockSize = 16384 };
+    
+    /**
+     With the background threads enabled, the levels with at least this partition size
+     are computed on them: a worker then has at least this many samples, the duration
+     of a partition, to meet each deadline.
+     */
+    enum { kMinWorkerPartitionSize = 2048 };
+    
+    ConvolutionMatrix mMatrix;
     int mBufferSize;
-    juce::ScopedPointer<UPConvolver<FLOAT_TYPE> > mUniformConvolver;
-    juce::ScopedPointer<TimeDistributedFFTConvolver<FLOAT_TYPE> >  mTimeDistributedConvolver;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutput;
+    int mBlockSize;
+    int mLatency;
+    int mLatencyBudget;
+    bool mUseWorker;
+    bool mProgressive;
+    bool mHugePages;
+    int mInputFill;
+    int mOutputFill;
+    double mSilenceThreshold;
+    double mTrimThreshold;
+    ImpulseResponseTrim mTrim;
+    SpectrumPrecision mImpulsePrecision;
+    SpectrumPrecision mInputPrecision;
+    PartitionPlan mPartitionPlan;
     juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mImpulseResponse;
     
-    void init(FLOAT_TYPE *impulseResponse, int numSamples)
+    /* The engine and the buffers around it, taken from mArena, declared first to be
+       deleted after everything in it */
+    juce::ScopedPointer<ConvolutionArena> mArena;
+    juce::ScopedPointer<Engine> mEngine;
+    juce::AudioBuffer<FLOAT_TYPE> mOutput;
+    juce::ScopedPointer<SampleDelayLine<FLOAT_TYPE> > mPreDelay;
+    juce::AudioBuffer<FLOAT_TYPE> mDelayedInput;
+    juce::AudioBuffer<FLOAT_TYPE> mInputFifo;
+    juce::AudioBuffer<FLOAT_TYPE> mOutputFifo;
+    const FLOAT_TYPE **mBlockInputs;
+    FLOAT_TYPE **mBlockOutputs;
+    
+    /** Convolve one block of mBlockSize samples of every input */
+    void processBlock(const FLOAT_TYPE *const *inputs, FLOAT_TYPE *const *outputs)
     {
-        mUniformConvolver = new UPConvolver<FLOAT_TYPE>(impulseResponse, numSamples, mBufferSize, 8);
-        checkNull(mUniformConvolver);
+        if (mPreDelay != nullptr)
+        {
+            mPreDelay->process(inputs, mDelayedInput.getArrayOfWritePointers(), mBlockSize);
+            inputs = mDelayedInput.getArrayOfReadPointers();
+        }
         
-        FLOAT_TYPE *subIR = impulseResponse + (8 * mBufferSize);
-        int subNumSamples = numSamples - (8 * mBufferSize);
+        mEngine->processInput(inputs, outputs);
+    }
+    
+    /**
+     Replace mMatrix with 'matrix', and mImpulseResponse with a copy of
+     'impulseResponses', one channel per path, or with a unit impulse on every path
+     from an input to the output of the same index if it is nullptr.
+     */
+    void copyImpulseResponse(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples)
+    {
+        const int numPaths = matrix.getNumPaths();
         
-        if (subNumSamples > 0)
+        if (numPaths < 1)
         {
-            mTimeDistributedConvolver = new TimeDistributedFFTConvolver<FLOAT_TYPE>(subIR, subNumSamples, mBufferSize);
-            checkNull(mTimeDistributedConvolver);
+            throw std::invalid_argument("A convolution needs at least one path");
+        }
+        
+        if (impulseResponses == nullptr)
+        {
+            numSamples = DEFAULT_NUM_SAMPLES;
+        }
+        
+        mImpulseResponse = new juce::AudioBuffer<FLOAT_TYPE>(numPaths, numSamples);
+        checkNull(mImpulseResponse);
+        mImpulseResponse->clear();
+        
+        for (int path = 0; path < numPaths; ++path)
+        {
+            FLOAT_TYPE *ir = mImpulseResponse->getWritePointer(path);
+            
+            if (impulseResponses != nullptr)
+            {
+                memcpy(ir, impulseResponses[path], numSamples * sizeof(FLOAT_TYPE));
+            }
+            else if (matrix.paths[path].input == matrix.paths[path].output)
+            {
+                genImpulse(ir, numSamples);
+            }
+        }
+        
+        mMatrix = matrix;
+    }
+    
+    /**
+     Choose the block size, among the powers of two up to the buffer size rounded up,
+     whose partitioning scheme has the lowest cost per buffer: the cost of one block
+     times the number of blocks that may complete within one buffer. Block sizes that
+     divide the buffer size are tried first, and win ties.
+     @returns
+        The plan of the chosen block size.
+     */
+    PartitionPlan choosePartitionPlan(int numSamples)
+    {
+        PartitionPlanner<FLOAT_TYPE> &planner = PartitionPlanner<FLOAT_TYPE>::getInstance();
+        PartitionPlan best;
+        double bestCost = 0.0;
+        int blockSize = 1;
+        
+        while (blockSize < mBufferSize && blockSize < kMinBlockSize)
+        {
+            blockSize *= 2;
+        }
+        
+        for (;; blockSize *= 2)
+        {
+            PartitionPlan plan = planner.plan(numSamples, blockSize);
+            const int blocksPerBuffer = std::max(1, (mBufferSize / blockSize) + !!(mBufferSize % blockSize));
+            const double cost = blocksPerBuffer * plan.cost;
+            
+            if (best.levels.empty() || cost < bestCost)
+            {
+                best = plan;
+                bestCost = cost;
+            }
+            
+            if (blockSize >= mBufferSize)
+                break;
+        }
+        
+        /* Larger blocks that fit in the latency budget, compared by their cost per sample */
+        for (blockSize = 2 * best.bufferSize; blockSize <= kMaxBlockSize && getBlockLatency(blockSize) <= mLatencyBudget; blockSize *= 2)
+        {
+            PartitionPlan plan = planner.plan(numSamples, blockSize);
+            
+            if (plan.cost / blockSize < best.cost / best.bufferSize)
+            {
+                best = plan;
+            }
+        }
+        
+        return best;
+    }
+    
+    /**
+     @returns
+        The latency of the FIFO for a block size, with buffers of the buffer size: the
+        largest number of samples that can be left waiting for a block to complete.
+     */
+    int getBlockLatency(int blockSize) const
+    {
+        return blockSize - std::min(blockSize, mBufferSize & -mBufferSize);
+    }
+    
+    /**
+     Trim the impulse response, choose the block size and partitioning scheme and
+     create the engine for them. The common block sizes get an engine specialized
+     for that size at compile time; any other size falls back to the generic engine.
+     */
+    void init()
+    {
+        PartitionPlanner<FLOAT_TYPE> &planner = PartitionPlanner<FLOAT_TYPE>::getInstance();
+        const int numInputs = mMatrix.numInputs;
+        const int numOutputs = mMatrix.numOutputs;
+        const int numPaths = mMatrix.getNumPaths();
+        
+        /* One trim for all paths, which share the input delay */
+        mTrim = ImpulseResponseTrim::analyze(mImpulseResponse->getArrayOfReadPointers(), numPaths,
+                                             mImpulseResponse->getNumSamples(), mTrimThreshold);
+        const int numSamples = mTrim.length;
+        std::vector<const FLOAT_TYPE *> impulseResponses(numPaths);
+        
+        for (int path = 0; path < numPaths; ++path)
+        {
+            impulseResponses[path] = mImpulseResponse->getReadPointer(path) + mTrim.onset;
+        }
+        
+        mPartitionPlan = choosePartitionPlan(numSamples);
+        mBlockSize = mPartitionPlan.bufferSize;
+        mTrim.partitionsSaved = planner.plan(mTrim.numSamples, mBlockSize).getNumPartitions() - mPartitionPlan.getNumPartitions();
+        
+        /* The engine is built in an arena of its own, and the previous one released
+           once nothing refers to it any more */
+        size_t arenaSize = BlockSizeEngine<0>::getArenaSize(mMatrix, numSamples, mPartitionPlan, mImpulsePrecision, mInputPrecision,
+                                                            mUseWorker, mProgressive)
+                         + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, mBufferSize)
+                         + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numInputs, mBlockSize)
+                         + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, mBufferSize + mBlockSize)
+                         + ConvolutionArena::getAllocationSize<const FLOAT_TYPE *>(numInputs)
+                         + ConvolutionArena::getAllocationSize<FLOAT_TYPE *>(numOutputs);
+        
+        if (mTrim.onset > 0)
+        {
+            arenaSize += SampleDelayLine<FLOAT_TYPE>::getArenaSize(mTrim.onset, mBlockSize, numInputs)
+                       + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numInputs, mBlockSize);
+        }
+        
+        juce::ScopedPointer<ConvolutionArena> arena = new ConvolutionArena(arenaSize, mHugePages);
+        checkNull(arena);
+        
+        switch (mBlockSize)
+        {
+            case 64:
+                mEngine = new BlockSizeEngine<64>(mMatrix, impulseResponses.data(), numSamples, mPartitionPlan, mSilenceThreshold, mImpulsePrecision, mInputPrecision, mUseWorker, mProgressive, *arena);
+                break;
+            case 128:
+                mEngine = new BlockSizeEngine<128>(mMatrix, impulseResponses.data(), numSamples, mPartitionPlan, mSilenceThreshold, mImpulsePrecision, mInputPrecision, mUseWorker, mProgressive, *arena);
+                break;
+            case 256:
+                mEngine = new BlockSizeEngine<256>(mMatrix, impulseResponses.data(), numSamples, mPartitionPlan, mSilenceThreshold, mImpulsePrecision, mInputPrecision, mUseWorker, mProgressive, *arena);
+                break;
+            case 512:
+                mEngine = new BlockSizeEngine<512>(mMatrix, impulseResponses.data(), numSamples, mPartitionPlan, mSilenceThreshold, mImpulsePrecision, mInputPrecision, mUseWorker, mProgressive, *arena);
+                break;
+            default:
+                mEngine = new BlockSizeEngine<0>(mMatrix, impulseResponses.data(), numSamples, mPartitionPlan, mSilenceThreshold, mImpulsePrecision, mInputPrecision, mUseWorker, mProgressive, *arena);
+                break;
+        }
+        checkNull(mEngine);
+        
+        if (mTrim.onset > 0)
+        {
+            mPreDelay = new SampleDelayLine<FLOAT_TYPE>(mTrim.onset, mBlockSize, numInputs, arena);
+            checkNull(mPreDelay);
+            arena->allocateBuffer(mDelayedInput, numInputs, mBlockSize);
         }
         else
         {
-            mTimeDistributedConvolver = nullptr;
+            mPreDelay = nullptr;
+            mDelayedInput = juce::AudioBuffer<FLOAT_TYPE>();
         }
         
-        mOutput = new juce::AudioBuffer<FLOAT_TYPE>(1, mBufferSize);
-        checkNull(mOutput);
+        arena->allocateBuffer(mOutput, numOutputs, mBufferSize);
+        
+        /* The output FIFO holds up to the latency plus one buffer */
+        arena->allocateBuffer(mInputFifo, numInputs, mBlockSize);
+        arena->allocateBuffer(mOutputFifo, numOutputs, mBufferSize + mBlockSize);
+        mBlockInputs = arena->allocate<const FLOAT_TYPE *>(numInputs);
+        mBlockOutputs = arena->allocate<FLOAT_TYPE *>(numOutputs);
+        mArena = arena.release();
+        
+        mLatency = getBlockLatency(mBlockSize);
+        mInputFill = 0;
+        mOutputFill = mLatency;
     }
 };
 
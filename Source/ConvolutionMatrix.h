@@ -0,0 +1,120 @@
+//
+//  ConvolutionMatrix.h
+//  RTConvolve
+//
+
+#ifndef ConvolutionMatrix_h
+#define ConvolutionMatrix_h
+
+#include <vector>
+#include <stdexcept>
+
+/**
+ The routing of a multichannel convolution: which inputs feed which outputs. Each
+ path convolves one input with an impulse response of its own and adds the result
+ to one output, e.g. the four paths LL, LR, RL and RR of a true stereo reverb.
+ Impulse responses are passed to the convolvers in path order.
+
+ Paths that are left out cost nothing, so a sparse matrix, such as the diagonal one
+ of independent channels, only pays for the paths it has.
+ */
+struct ConvolutionMatrix
+{
+    struct Path
+    {
+        int input;
+        int output;
+    };
+
+    int numInputs;
+    int numOutputs;
+    std::vector<Path> paths;
+
+    /** A matrix of 'numInputs' inputs and 'numOutputs' outputs with no paths yet. */
+    ConvolutionMatrix(int numInputs, int numOutputs)
+    : numInputs(numInputs)
+    , numOutputs(numOutputs)
+    {
+        if (numInputs < 1 || numOutputs < 1)
+        {
+            throw std::invalid_argument("A convolution needs at least one input and one output");
+        }
+    }
+
+    /**
+     Add the path from 'input' to 'output'.
+     @returns
+        The index of the path, and of its impulse response.
+     */
+    int addPath(int input, int output)
+    {
+        if (input < 0 || input >= numInputs || output < 0 || output >= numOutputs)
+        {
+            throw std::invalid_argument("The path must join an existing input to an existing output");
+        }
+
+        Path path = { input, output };
+        paths.push_back(path);
+        return (int)paths.size() - 1;
+    }
+
+    int getNumPaths() const
+    {
+        return (int)paths.size();
+    }
+
+    /**
+     @returns
+        'numChannels' independent channels: path c from input c to output c.
+     */
+    static ConvolutionMatrix diagonal(int numChannels)
+    {
+        ConvolutionMatrix matrix(numChannels, numChannels);
+
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            matrix.addPath(channel, channel);
+        }
+        return matrix;
+    }
+
+    /**
+     @returns
+        Every input feeding every output, in input-major order: path
+        input * numOutputs + output. For two channels, the true stereo paths
+        LL, LR, RL and RR.
+     */
+    static ConvolutionMatrix full(int numInputs, int numOutputs)
+    {
+        ConvolutionMatrix matrix(numInputs, numOutputs);
+
+        for (int input = 0; input < numInputs; ++input)
+        {
+            for (int output = 0; output < numOutputs; ++output)
+            {
+                matrix.addPath(input, output);
+            }
+        }
+        return matrix;
+    }
+
+    /**
+     @returns
+        true if this is diagonal(numInputs): each input feeds the output of the same
+        index and nothing else, so that the channels can be interleaved.
+     */
+    bool isDiagonal() const
+    {
+        if (numInputs != numOutputs || getNumPaths() != numInputs)
+            return false;
+
+        for (int i = 0; i < getNumPaths(); ++i)
+        {
+            if (paths[i].input != i || paths[i].output != i)
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif /* ConvolutionMatrix_h */
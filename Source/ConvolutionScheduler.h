@@ -0,0 +1,748 @@
+//
+//  ConvolutionScheduler.h
+//  RTConvolve
+//
+
+#ifndef ConvolutionScheduler_h
+#define ConvolutionScheduler_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+#if defined(_WIN32)
+ #ifndef NOMINMAX
+  #define NOMINMAX
+ #endif
+ #include <windows.h>
+#elif defined(__APPLE__)
+ #include <dispatch/dispatch.h>
+#else
+ #include <semaphore.h>
+ #include <cerrno>
+#endif
+
+/**
+ A pool of threads, shared by every convolution in the process, that computes the
+ late levels of the partitioned convolutions in the background. However many
+ plugin instances there are, their tails are spread over one thread per core, less
+ one for the host's audio threads, instead of piling up on the audio threads.
+
+ The work is divided into jobs, each of which produces blocks of output in order,
+ one at a time. Every job is assigned to one worker thread, which runs its own jobs
+ in order of deadline: the pending block that is needed first is computed first.
+ A worker that has nothing of its own to do steals the most urgent pending job
+ of a busy worker, as does any worker for a job due earlier than all of its own,
+ so a burst of work on one thread spreads over the others.
+
+ The audio threads only hand blocks to the jobs and wake their workers by posting
+ to a semaphore; they never take a lock or wait for the pool (see WorkerLevel).
+
+ The pool also spreads the preparation of impulse responses over the cores, see
+ parallelFor() and BackgroundLoop. That work has no deadline, and only fills the
+ time left over. The workers run at real-time priority where the platform allows,
+ but drop to normal priority while they do such work, so that it competes with the
+ rest of the system as any other background work does.
+ */
+class ConvolutionScheduler
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /** The deadline of a job with nothing pending, later than any other */
+    static int64_t getNoDeadline()
+    {
+        return std::numeric_limits<int64_t>::max();
+    }
+
+    /** Work handed over by the audio threads */
+    class Job
+    {
+    public:
+        Job()
+        : mWorker(-1)
+        , mClaimed(false)
+        , mBusyTicks(0)
+        , mNumBlocks(0)
+        , mNumSteals(0)
+        {
+        }
+
+        virtual ~Job() {}
+
+        /**
+         Called on any worker thread, including while another one processes the job.
+         @returns
+            The time, in Clock ticks since its epoch, by which the oldest pending block
+            must be done, or getNoDeadline() if there is none.
+         */
+        virtual int64_t getNextDeadline() const = 0;
+
+        /**
+         Compute the oldest pending block. Called on one worker thread at a time.
+         @returns
+            true if a block of work was done, false if there was none pending.
+         */
+        virtual bool processPending() = 0;
+
+    private:
+        friend class ConvolutionScheduler;
+
+        int mWorker;
+        std::atomic<bool> mClaimed;
+        Clock::time_point mAdded;
+        std::atomic<int64_t> mBusyTicks;
+        std::atomic<int64_t> mNumBlocks;
+        std::atomic<int64_t> mNumSteals;
+    };
+
+    /** The work done by the pool, or by some of its jobs */
+    struct Statistics
+    {
+        Statistics()
+        : numThreads(0)
+        , numJobs(0)
+        , numBlocks(0)
+        , numSteals(0)
+        , busySeconds(0.0)
+        , elapsedSeconds(0.0)
+        {
+        }
+
+        int numThreads;
+        int numJobs;
+
+        /** The number of blocks computed (for the pool, also ranges of parallelFor()), and how
+            many of them by a thread other than the job's own */
+        int64_t numBlocks;
+        int64_t numSteals;
+
+        /** The thread time spent on the blocks, and the time over which it was spent */
+        double busySeconds;
+        double elapsedSeconds;
+
+        /** @returns The average number of threads kept busy, 1.0 being a whole core. */
+        double getLoad() const
+        {
+            return (elapsedSeconds > 0.0) ? busySeconds / elapsedSeconds : 0.0;
+        }
+
+        /** @returns The fraction of the pool's capacity used, between 0 and 1. */
+        double getUtilisation() const
+        {
+            return (numThreads > 0) ? getLoad() / numThreads : 0.0;
+        }
+
+        /** Add the work of other jobs of the same pool, e.g. another channel's */
+        void add(const Statistics &other)
+        {
+            numThreads = std::max(numThreads, other.numThreads);
+            numJobs += other.numJobs;
+            numBlocks += other.numBlocks;
+            numSteals += other.numSteals;
+            busySeconds += other.busySeconds;
+            elapsedSeconds = std::max(elapsedSeconds, other.elapsedSeconds);
+        }
+    };
+
+    /**
+     @param numThreads
+        The number of worker threads. Zero, the default, is one per core less one,
+        and at least one.
+     */
+    explicit ConvolutionScheduler(int numThreads = 0)
+    : mStarted(Clock::now())
+    , mNumBlocks(0)
+    , mNumSteals(0)
+    {
+        if (numThreads <= 0)
+        {
+            numThreads = std::max(1, (int) std::thread::hardware_concurrency() - 1);
+        }
+
+        for (int i = 0; i < numThreads; ++i)
+        {
+            mQueues.add(new JobQueue());
+            mWorkers.add(new Worker(*this, i));
+        }
+
+        for (int i = 0; i < numThreads; ++i)
+        {
+            mWorkers.getUnchecked(i)->start();
+        }
+    }
+
+    ~ConvolutionScheduler()
+    {
+        /* Every job must have been removed by now. The workers look at each other's
+           state, so they all stop before any is deleted. */
+        for (int i = 0; i < mWorkers.size(); ++i)
+        {
+            mWorkers.getUnchecked(i)->signalThreadShouldExit();
+            mWorkers.getUnchecked(i)->wake();
+        }
+
+        for (int i = 0; i < mWorkers.size(); ++i)
+        {
+            mWorkers.getUnchecked(i)->stopThread(1000);
+        }
+        mWorkers.clear();
+    }
+
+    /** @returns The pool shared by the whole process, started on first use. */
+    static ConvolutionScheduler &getInstance()
+    {
+        static ConvolutionScheduler instance;
+        return instance;
+    }
+
+    int getNumThreads() const
+    {
+        return mWorkers.size();
+    }
+
+    /** Add a job, assigning it to the worker with the fewest. Not on an audio thread. */
+    void addJob(Job *job)
+    {
+        int worker = 0;
+        size_t fewest = std::numeric_limits<size_t>::max();
+
+        for (int i = 0; i < mQueues.size(); ++i)
+        {
+            const juce::ScopedLock lock(mQueues.getUnchecked(i)->lock);
+
+            if (mQueues.getUnchecked(i)->jobs.size() < fewest)
+            {
+                fewest = mQueues.getUnchecked(i)->jobs.size();
+                worker = i;
+            }
+        }
+
+        job->mWorker = worker;
+        job->mAdded = Clock::now();
+
+        const juce::ScopedLock lock(mQueues.getUnchecked(worker)->lock);
+        mQueues.getUnchecked(worker)->jobs.push_back(job);
+    }
+
+    /**
+     Remove a job, waiting for any block of it being computed to finish. Once this
+     returns, the job may be deleted. Not on an audio thread.
+     */
+    void removeJob(Job *job)
+    {
+        JobQueue *queue = mQueues.getUnchecked(job->mWorker);
+
+        {
+            const juce::ScopedLock lock(queue->lock);
+            queue->jobs.erase(std::remove(queue->jobs.begin(), queue->jobs.end(), job), queue->jobs.end());
+        }
+
+        while (job->mClaimed.load(std::memory_order_acquire))
+        {
+            juce::Thread::yield();
+        }
+    }
+
+    /**
+     Wake the job's worker after a block has been handed to it, and an idle worker
+     to steal it if that one is busy. Called on the audio thread.
+     */
+    void notify(const Job &job)
+    {
+        Worker *owner = mWorkers.getUnchecked(job.mWorker);
+        owner->wake();
+
+        if (! owner->isIdle())
+        {
+            for (int i = 0; i < mWorkers.size(); ++i)
+            {
+                if (mWorkers.getUnchecked(i)->isIdle())
+                {
+                    mWorkers.getUnchecked(i)->wake();
+                    break;
+                }
+            }
+        }
+    }
+
+    /** @returns The work done by the whole pool since it was started. */
+    Statistics getStatistics() const
+    {
+        Statistics statistics;
+        statistics.numThreads = mWorkers.size();
+        statistics.numBlocks = mNumBlocks.load(std::memory_order_relaxed);
+        statistics.numSteals = mNumSteals.load(std::memory_order_relaxed);
+        statistics.elapsedSeconds = std::chrono::duration<double>(Clock::now() - mStarted).count();
+
+        for (int i = 0; i < mWorkers.size(); ++i)
+        {
+            const juce::ScopedLock lock(mQueues.getUnchecked(i)->lock);
+            statistics.numJobs += (int) mQueues.getUnchecked(i)->jobs.size();
+            statistics.busySeconds += toSeconds(mWorkers.getUnchecked(i)->getBusyTicks());
+        }
+        return statistics;
+    }
+
+    /**
+     Add the work done on one job since it was added to 'statistics', e.g. to sum up
+     the jobs of one plugin instance.
+     */
+    void addStatistics(const Job &job, Statistics &statistics) const
+    {
+        statistics.numThreads = mWorkers.size();
+        statistics.numJobs += 1;
+        statistics.numBlocks += job.mNumBlocks.load(std::memory_order_relaxed);
+        statistics.numSteals += job.mNumSteals.load(std::memory_order_relaxed);
+        statistics.busySeconds += toSeconds(job.mBusyTicks.load(std::memory_order_relaxed));
+        statistics.elapsedSeconds = std::max(statistics.elapsedSeconds,
+                                             std::chrono::duration<double>(Clock::now() - job.mAdded).count());
+    }
+
+    /**
+     Call 'function(first, end)' for ranges of items that together cover items
+     0 ... numItems - 1, in parallel on the pool's threads and the calling thread,
+     and return once all of them are done. The ranges have no deadline, so the
+     workers only take them up when no block of a job is pending. Not on an audio
+     thread, nor on one of the pool's.
+     */
+    template <typename FUNCTION>
+    void parallelFor(int numItems, const FUNCTION &function)
+    {
+        const int numRanges = std::min(numItems, kRangesPerThread * (mWorkers.size() + 1));
+
+        if (numRanges <= 1)
+        {
+            if (numItems > 0)
+            {
+                function(0, numItems);
+            }
+            return;
+        }
+
+        Loop<FUNCTION> loop(function, numItems, (numItems + numRanges - 1) / numRanges);
+        juce::OwnedArray<LoopJob<FUNCTION> > jobs;
+
+        for (int i = 0; i < mWorkers.size(); ++i)
+        {
+            LoopJob<FUNCTION> *job = jobs.add(new LoopJob<FUNCTION>(loop));
+            addJob(job);
+            mWorkers.getUnchecked(job->mWorker)->wake();
+        }
+
+        while (loop.runRange())
+        {
+        }
+
+        while (! loop.isDone())
+        {
+            juce::Thread::yield();
+        }
+
+        for (int i = 0; i < jobs.size(); ++i)
+        {
+            removeJob(jobs.getUnchecked(i));
+        }
+    }
+
+private:
+    /** How finely parallelFor() divides its items, for the threads to even out */
+    enum { kRangesPerThread = 4 };
+
+    /** The deadline of work that has none, e.g. a range of a parallelFor(): after every
+        block of the other jobs */
+    static int64_t getBackgroundDeadline()
+    {
+        return getNoDeadline() - 1;
+    }
+
+    /** The state of one parallelFor(), shared by its jobs */
+    template <typename FUNCTION>
+    class Loop
+    {
+    public:
+        Loop(const FUNCTION &function, int numItems, int rangeSize)
+        : mFunction(function)
+        , mNumItems(numItems)
+        , mRangeSize(rangeSize)
+        , mNext(0)
+        , mNumDone(0)
+        {
+        }
+
+        bool hasRanges() const
+        {
+            return mNext.load(std::memory_order_relaxed) < mNumItems;
+        }
+
+        /** @returns false if every range has been taken. */
+        bool runRange()
+        {
+            const int first = mNext.fetch_add(mRangeSize, std::memory_order_relaxed);
+
+            if (first >= mNumItems)
+                return false;
+
+            const int end = std::min(first + mRangeSize, mNumItems);
+            mFunction(first, end);
+            mNumDone.fetch_add(end - first, std::memory_order_release);
+            return true;
+        }
+
+        bool isDone() const
+        {
+            return mNumDone.load(std::memory_order_acquire) == mNumItems;
+        }
+
+        /** Leave the ranges not taken yet undone */
+        void cancel()
+        {
+            mNext.store(mNumItems, std::memory_order_relaxed);
+        }
+
+    private:
+        const FUNCTION &mFunction;
+        int mNumItems;
+        int mRangeSize;
+        std::atomic<int> mNext;
+        std::atomic<int> mNumDone;
+    };
+
+    /** One worker's share of a parallelFor(), due after every block of the other jobs */
+    template <typename FUNCTION>
+    class LoopJob : public Job
+    {
+    public:
+        explicit LoopJob(Loop<FUNCTION> &loop)
+        : mLoop(loop)
+        {
+        }
+
+        int64_t getNextDeadline() const override
+        {
+            return mLoop.hasRanges() ? getBackgroundDeadline() : getNoDeadline();
+        }
+
+        bool processPending() override
+        {
+            return mLoop.runRange();
+        }
+
+    private:
+        Loop<FUNCTION> &mLoop;
+    };
+
+public:
+    /**
+     A parallelFor() that runs in the background: the pool's threads call the function
+     for one item at a time, in order, while the thread that started it carries on.
+     Deleting the loop abandons the items not started yet, and waits for those in
+     progress. Not to be started or deleted on an audio thread.
+     */
+    class BackgroundLoop
+    {
+    public:
+        typedef std::function<void (int first, int end)> Function;
+
+        BackgroundLoop(ConvolutionScheduler &scheduler, int numItems, const Function &function)
+        : mScheduler(scheduler)
+        , mFunction(function)
+        , mLoop(mFunction, numItems, 1)
+        {
+            for (int i = 0; i < scheduler.mWorkers.size(); ++i)
+            {
+                LoopJob<Function> *job = mJobs.add(new LoopJob<Function>(mLoop));
+                scheduler.addJob(job);
+                scheduler.mWorkers.getUnchecked(job->mWorker)->wake();
+            }
+        }
+
+        ~BackgroundLoop()
+        {
+            mLoop.cancel();
+
+            for (int i = 0; i < mJobs.size(); ++i)
+            {
+                mScheduler.removeJob(mJobs.getUnchecked(i));
+            }
+        }
+
+        /** @returns true once the function has been called for every item. */
+        bool isDone() const
+        {
+            return mLoop.isDone();
+        }
+
+    private:
+        ConvolutionScheduler &mScheduler;
+        Function mFunction;
+        Loop<Function> mLoop;
+        juce::OwnedArray<LoopJob<Function> > mJobs;
+    };
+
+private:
+
+    /** The jobs assigned to one worker */
+    struct JobQueue
+    {
+        juce::CriticalSection lock;
+        std::vector<Job *> jobs;
+    };
+
+    /**
+     The operating system's counting semaphore, on which an idle worker sleeps. Posting
+     to it takes no lock, unlike juce::Thread::notify(), so an audio thread can do it.
+     */
+    class Semaphore
+    {
+    public:
+        Semaphore()
+        {
+#if defined(_WIN32)
+            mSemaphore = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+#elif defined(__APPLE__)
+            mSemaphore = dispatch_semaphore_create(0);
+#else
+            sem_init(&mSemaphore, 0, 0);
+#endif
+        }
+
+        ~Semaphore()
+        {
+#if defined(_WIN32)
+            CloseHandle(mSemaphore);
+#elif defined(__APPLE__)
+            dispatch_release(mSemaphore);
+#else
+            sem_destroy(&mSemaphore);
+#endif
+        }
+
+        void post()
+        {
+#if defined(_WIN32)
+            ReleaseSemaphore(mSemaphore, 1, nullptr);
+#elif defined(__APPLE__)
+            dispatch_semaphore_signal(mSemaphore);
+#else
+            sem_post(&mSemaphore);
+#endif
+        }
+
+        void wait()
+        {
+#if defined(_WIN32)
+            WaitForSingleObject(mSemaphore, INFINITE);
+#elif defined(__APPLE__)
+            dispatch_semaphore_wait(mSemaphore, DISPATCH_TIME_FOREVER);
+#else
+            while (sem_wait(&mSemaphore) != 0 && errno == EINTR)
+            {
+            }
+#endif
+        }
+
+    private:
+#if defined(_WIN32)
+        HANDLE mSemaphore;
+#elif defined(__APPLE__)
+        dispatch_semaphore_t mSemaphore;
+#else
+        sem_t mSemaphore;
+#endif
+
+        JUCE_DECLARE_NON_COPYABLE (Semaphore)
+    };
+
+    class Worker : public juce::Thread
+    {
+    public:
+        Worker(ConvolutionScheduler &scheduler, int index)
+        : juce::Thread("RTConvolve worker " + juce::String(index))
+        , mScheduler(scheduler)
+        , mIndex(index)
+        , mIdle(false)
+        , mWakePending(false)
+        , mRealtime(true)
+        , mBusyTicks(0)
+        {
+        }
+
+        ~Worker()
+        {
+            stopThread(1000);
+        }
+
+        /** Start the thread at the highest priority, which is real-time where the platform allows */
+        void start()
+        {
+            startThread(kRealtimePriority);
+        }
+
+        /**
+         Wake the thread if it is idle, or have it look for work once more before it
+         next sleeps if not. Lock-free, for the audio threads.
+         */
+        void wake()
+        {
+            /* One post per sleep is enough, however many blocks are handed over */
+            if (! mWakePending.exchange(true, std::memory_order_acq_rel))
+            {
+                mSemaphore.post();
+            }
+        }
+
+        bool isIdle() const
+        {
+            return mIdle.load(std::memory_order_relaxed);
+        }
+
+        int64_t getBusyTicks() const
+        {
+            return mBusyTicks.load(std::memory_order_relaxed);
+        }
+
+        void run() override
+        {
+            while (! threadShouldExit())
+            {
+                int64_t deadline;
+                Job *job = mScheduler.claimJob(mIndex, deadline);
+
+                if (job == nullptr)
+                {
+                    mIdle.store(true, std::memory_order_relaxed);
+                    mSemaphore.wait();
+
+                    /* Anything handed over before this is seen by the next claimJob() */
+                    mWakePending.exchange(false, std::memory_order_acq_rel);
+                    mIdle.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+
+                setRealtime(deadline != getBackgroundDeadline());
+
+                const Clock::time_point start = Clock::now();
+                const bool didWork = job->processPending();
+                const int64_t ticks = (Clock::now() - start).count();
+
+                if (didWork)
+                {
+                    mBusyTicks.fetch_add(ticks, std::memory_order_relaxed);
+                    mScheduler.mNumBlocks.fetch_add(1, std::memory_order_relaxed);
+                    job->mBusyTicks.fetch_add(ticks, std::memory_order_relaxed);
+                    job->mNumBlocks.fetch_add(1, std::memory_order_relaxed);
+
+                    if (job->mWorker != mIndex)
+                    {
+                        mScheduler.mNumSteals.fetch_add(1, std::memory_order_relaxed);
+                        job->mNumSteals.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+
+                /* The job may be removed and deleted as soon as it is released */
+                job->mClaimed.store(false, std::memory_order_release);
+            }
+        }
+
+    private:
+        /** juce::Thread's highest priority, and its default one */
+        enum { kRealtimePriority = 10, kNormalPriority = 5 };
+
+        ConvolutionScheduler &mScheduler;
+        int mIndex;
+        std::atomic<bool> mIdle;
+        std::atomic<bool> mWakePending;
+        Semaphore mSemaphore;
+        bool mRealtime;
+        std::atomic<int64_t> mBusyTicks;
+
+        /** Switch between real-time priority, for blocks with a deadline, and normal priority */
+        void setRealtime(bool realtime)
+        {
+            if (realtime != mRealtime)
+            {
+                setPriority(realtime ? kRealtimePriority : kNormalPriority);
+                mRealtime = realtime;
+            }
+        }
+    };
+
+    Clock::time_point mStarted;
+    std::atomic<int64_t> mNumBlocks;
+    std::atomic<int64_t> mNumSteals;
+    juce::OwnedArray<JobQueue> mQueues;
+
+    /* Declared last, so that the threads stop before anything they use is deleted */
+    juce::OwnedArray<Worker> mWorkers;
+
+    static double toSeconds(int64_t ticks)
+    {
+        return std::chrono::duration<double>(Clock::duration(ticks)).count();
+    }
+
+    /**
+     Claim the pending job with the earliest deadline among those of worker 'index',
+     and those of busy workers that are due earlier still.
+     @param deadline
+        Set to the deadline of the job claimed.
+     @returns
+        The job, which no other worker will run until it is released, or nullptr if
+        there is nothing to do.
+     */
+    Job *claimJob(int index, int64_t &deadline)
+    {
+        Job *claimed = nullptr;
+        deadline = getNoDeadline();
+
+        for (int i = 0; i < mQueues.size(); ++i)
+        {
+            const int worker = (index + i) % mQueues.size();
+
+            /* An idle worker has been woken for its own jobs */
+            if (worker != index && mWorkers.getUnchecked(worker)->isIdle())
+                continue;
+
+            JobQueue *queue = mQueues.getUnchecked(worker);
+            const juce::ScopedLock lock(queue->lock);
+
+            Job *earliest = nullptr;
+            int64_t earliestDeadline = deadline;
+
+            for (size_t j = 0; j < queue->jobs.size(); ++j)
+            {
+                Job *job = queue->jobs[j];
+
+                if (job->mClaimed.load(std::memory_order_relaxed))
+                    continue;
+
+                const int64_t jobDeadline = job->getNextDeadline();
+
+                if (jobDeadline < earliestDeadline)
+                {
+                    earliest = job;
+                    earliestDeadline = jobDeadline;
+                }
+            }
+
+            if (earliest != nullptr && ! earliest->mClaimed.exchange(true, std::memory_order_acquire))
+            {
+                if (claimed != nullptr)
+                {
+                    claimed->mClaimed.store(false, std::memory_order_release);
+                }
+                claimed = earliest;
+                deadline = earliestDeadline;
+            }
+        }
+        return claimed;
+    }
+};
+
+#endif /* ConvolutionScheduler_h */
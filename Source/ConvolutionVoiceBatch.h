@@ -0,0 +1,284 @@
+//
+//  ConvolutionVoiceBatch.h
+//  RTConvolve
+//
+
+#ifndef ConvolutionVoiceBatch_h
+#define ConvolutionVoiceBatch_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "util/fft_batch.hpp"
+#include "util/complex_mac.hpp"
+#include "util/util.h"
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+/**
+ Convolves many independent voices, each with its own impulse response, and advances
+ all of them by one block per call, e.g. the hundreds of short streams of an offline
+ rendering service, each with a small impulse response. One batch takes the place of
+ as many ConvolutionManagers, with their scattered allocations and per-object calls.
+
+ Every voice is uniformly partitioned at the block size, so no voice has any latency.
+ The voices are sorted by their number of partitions and packed into groups of up to
+ kMaxGroupSize voices, whose state is laid out as a structure of arrays: sample or
+ bin n of the voice in lane v is at n * numLanes + v. A group transforms the blocks
+ of all of its voices with one BatchFFTPlan call, vectorized across the voices, and
+ multiplies and accumulates all of their partitions with a single
+ complexMultiplyAccumulate() over the interleaved spectra. All the state of a group
+ is taken from one allocation.
+
+ Long impulse responses are better served by the non-uniform partitioning of a
+ ConvolutionManager.
+ */
+template <typename FLOAT_TYPE>
+class ConvolutionVoiceBatch
+{
+public:
+    /** The most voices in a group: a vector of sixteen floats spans a group's lanes */
+    enum { kMaxGroupSize = 16 };
+
+    /**
+     @param numVoices
+        The number of voices.
+     @param impulseResponses
+        The impulse response of each voice, copied.
+     @param numSamples
+        The length of the impulse response of each voice.
+     @param blockSize
+        The number of samples of every voice processed by each call of
+        processInput(), a power of two.
+     */
+    ConvolutionVoiceBatch(int numVoices, const FLOAT_TYPE *const *impulseResponses, const int *numSamples, int blockSize)
+    : mNumVoices(numVoices)
+    , mBlockSize(blockSize)
+    {
+        if (numVoices < 1)
+        {
+            throw std::invalid_argument("A batch needs at least one voice");
+        }
+
+        if (blockSize < 1 || (blockSize & (blockSize - 1)) != 0)
+        {
+            throw std::invalid_argument("blockSize must be a power of two");
+        }
+
+        mFFTPlan = new BatchFFTPlan<FLOAT_TYPE>(2 * blockSize);
+        checkNull(mFFTPlan);
+
+        mOutput = new juce::AudioBuffer<FLOAT_TYPE>(numVoices, blockSize);
+        checkNull(mOutput);
+        mOutput->clear();
+
+        /* Voices of similar lengths share a group, which is as long as its longest voice */
+        std::vector<int> voices(numVoices);
+        std::vector<int> numPartitions(numVoices);
+
+        for (int voice = 0; voice < numVoices; ++voice)
+        {
+            voices[voice] = voice;
+            numPartitions[voice] = std::max(1, (numSamples[voice] + blockSize - 1) / blockSize);
+        }
+
+        std::stable_sort(voices.begin(), voices.end(), [&numPartitions](int a, int b)
+        {
+            return numPartitions[a] > numPartitions[b];
+        });
+
+        for (int first = 0; first < numVoices; first += kMaxGroupSize)
+        {
+            const int numLanes = std::min((int)kMaxGroupSize, numVoices - first);
+            std::vector<int> groupVoices(voices.begin() + first, voices.begin() + first + numLanes);
+
+            mGroups.add(new VoiceGroup(*mFFTPlan, groupVoices, numPartitions[groupVoices[0]], impulseResponses, numSamples, blockSize));
+        }
+    }
+
+    /**
+     Convolve one block of every voice.
+     @param inputs
+        One buffer of 'blockSize' samples per voice.
+     */
+    void processInput(const FLOAT_TYPE *const *inputs)
+    {
+        for (int group = 0; group < mGroups.size(); ++group)
+        {
+            mGroups.getUnchecked(group)->process(*mFFTPlan, inputs, *mOutput);
+        }
+    }
+
+    /**
+     @returns
+        The 'blockSize' samples of output of a voice for the most recent block.
+     */
+    const FLOAT_TYPE *getOutputBuffer(int voice) const
+    {
+        return mOutput->getReadPointer(voice);
+    }
+
+    int getNumVoices() const
+    {
+        return mNumVoices;
+    }
+
+    int getBlockSize() const
+    {
+        return mBlockSize;
+    }
+
+    int getNumGroups() const
+    {
+        return mGroups.size();
+    }
+
+private:
+    /**
+     Up to kMaxGroupSize voices, one per lane, with the same number of partitions:
+     the ones of its longest voice, the others being padded with silent partitions.
+     */
+    class VoiceGroup
+    {
+    public:
+        VoiceGroup(const BatchFFTPlan<FLOAT_TYPE> &plan, const std::vector<int> &voices, int numPartitions,
+                   const FLOAT_TYPE *const *impulseResponses, const int *numSamples, int blockSize)
+        : mVoices(voices)
+        , mNumLanes((int)voices.size())
+        , mNumPartitions(numPartitions)
+        , mBlockSize(blockSize)
+        , mNewest(0)
+        {
+            const int numLanes = mNumLanes;
+            const int spectrumSize = (blockSize + 1) * numLanes;
+            const size_t partitionStorage = (size_t)numPartitions * spectrumSize;
+
+            /* The impulse and input spectra, then the transform and the overlap tail */
+            mStorage.calloc(4 * partitionStorage + 2 * blockSize * numLanes + spectrumSize + blockSize * numLanes);
+            mImpulseReal = mStorage;
+            mImpulseImag = mImpulseReal + partitionStorage;
+            mInputReal = mImpulseImag + partitionStorage;
+            mInputImag = mInputReal + partitionStorage;
+            mTransformReal = mInputImag + partitionStorage;
+            mTransformImag = mTransformReal + 2 * blockSize * numLanes;
+            mTail = mTransformImag + spectrumSize;
+
+            mInputPointersReal.malloc(numPartitions);
+            mInputPointersImag.malloc(numPartitions);
+            mImpulsePointersReal.malloc(numPartitions);
+            mImpulsePointersImag.malloc(numPartitions);
+
+            for (int partition = 0; partition < numPartitions; ++partition)
+            {
+                FLOAT_TYPE *re = mTransformReal;
+                FLOAT_TYPE *im = mTransformImag;
+
+                memset(re, 0, 2 * blockSize * numLanes * sizeof(FLOAT_TYPE));
+
+                for (int lane = 0; lane < numLanes; ++lane)
+                {
+                    const int voice = mVoices[lane];
+                    const int start = partition * blockSize;
+                    const int samplesToCopy = std::min(numSamples[voice] - start, blockSize);
+
+                    for (int n = 0; n < samplesToCopy; ++n)
+                    {
+                        re[n * numLanes + lane] = impulseResponses[voice][start + n];
+                    }
+                }
+
+                plan.rfft(re, im, numLanes);
+
+                memcpy(mImpulseReal + partition * spectrumSize, re, spectrumSize * sizeof(FLOAT_TYPE));
+                memcpy(mImpulseImag + partition * spectrumSize, im, spectrumSize * sizeof(FLOAT_TYPE));
+                mImpulsePointersReal[partition] = mImpulseReal + partition * spectrumSize;
+                mImpulsePointersImag[partition] = mImpulseImag + partition * spectrumSize;
+            }
+
+            memset(mTransformReal, 0, (2 * blockSize * numLanes + spectrumSize) * sizeof(FLOAT_TYPE));
+        }
+
+        void process(const BatchFFTPlan<FLOAT_TYPE> &plan, const FLOAT_TYPE *const *inputs, juce::AudioBuffer<FLOAT_TYPE> &outputs)
+        {
+            const int numLanes = mNumLanes;
+            const int blockSize = mBlockSize;
+            const int spectrumSize = (blockSize + 1) * numLanes;
+            FLOAT_TYPE *re = mTransformReal;
+            FLOAT_TYPE *im = mTransformImag;
+
+            /* Interleave the new block of every voice, zero-padded to the transform size */
+            for (int lane = 0; lane < numLanes; ++lane)
+            {
+                const FLOAT_TYPE *input = inputs[mVoices[lane]];
+
+                for (int n = 0; n < blockSize; ++n)
+                {
+                    re[n * numLanes + lane] = input[n];
+                }
+            }
+            memset(re + blockSize * numLanes, 0, blockSize * numLanes * sizeof(FLOAT_TYPE));
+
+            plan.rfft(re, im, numLanes);
+
+            /* The input spectra are a ring, newest first */
+            mNewest = (mNewest == 0) ? mNumPartitions - 1 : mNewest - 1;
+            memcpy(mInputReal + mNewest * spectrumSize, re, spectrumSize * sizeof(FLOAT_TYPE));
+            memcpy(mInputImag + mNewest * spectrumSize, im, spectrumSize * sizeof(FLOAT_TYPE));
+
+            for (int partition = 0; partition < mNumPartitions; ++partition)
+            {
+                const int slot = (mNewest + partition) % mNumPartitions;
+                mInputPointersReal[partition] = mInputReal + slot * spectrumSize;
+                mInputPointersImag[partition] = mInputImag + slot * spectrumSize;
+            }
+
+            /* Every partition of every voice in one pass */
+            complexMultiplyAccumulate(re, im, mInputPointersReal.getData(), mInputPointersImag.getData(),
+                                      mImpulsePointersReal.getData(), mImpulsePointersImag.getData(),
+                                      (unsigned int)mNumPartitions, 0u, (unsigned int)spectrumSize);
+
+            plan.irfft(re, im, numLanes);
+
+            /* Overlap-add, and back to one buffer per voice */
+            for (int lane = 0; lane < numLanes; ++lane)
+            {
+                FLOAT_TYPE *output = outputs.getWritePointer(mVoices[lane]);
+
+                for (int n = 0; n < blockSize; ++n)
+                {
+                    output[n] = re[n * numLanes + lane] + mTail[n * numLanes + lane];
+                }
+            }
+            memcpy(mTail, re + blockSize * numLanes, blockSize * numLanes * sizeof(FLOAT_TYPE));
+        }
+
+    private:
+        std::vector<int> mVoices;
+        int mNumLanes;
+        int mNumPartitions;
+        int mBlockSize;
+        int mNewest;
+
+        juce::HeapBlock<FLOAT_TYPE> mStorage;
+        FLOAT_TYPE *mImpulseReal;
+        FLOAT_TYPE *mImpulseImag;
+        FLOAT_TYPE *mInputReal;
+        FLOAT_TYPE *mInputImag;
+        FLOAT_TYPE *mTransformReal;
+        FLOAT_TYPE *mTransformImag;
+        FLOAT_TYPE *mTail;
+
+        juce::HeapBlock<const FLOAT_TYPE *> mInputPointersReal;
+        juce::HeapBlock<const FLOAT_TYPE *> mInputPointersImag;
+        juce::HeapBlock<const FLOAT_TYPE *> mImpulsePointersReal;
+        juce::HeapBlock<const FLOAT_TYPE *> mImpulsePointersImag;
+    };
+
+    int mNumVoices;
+    int mBlockSize;
+    juce::ScopedPointer<BatchFFTPlan<FLOAT_TYPE> > mFFTPlan;
+    juce::OwnedArray<VoiceGroup> mGroups;
+    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutput;
+};
+
+#endif /* ConvolutionVoiceBatch_h */
@@ -0,0 +1,948 @@
+//
+//  FrequencyDomainDelayLine.h
+//  RTConvolve
+//
+
+#ifndef FrequencyDomainDelayLine_h
+#define FrequencyDomainDelayLine_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ConvolutionMatrix.h"
+#include "ConvolutionArena.h"
+#include "ImpulseSpectrumCache.h"
+#include "util/util.h"
+#include "util/complex_mac.hpp"
+#include "util/reduced_precision.hpp"
+#include <stdint.h>
+#include <cmath>
+#include <atomic>
+#include <type_traits>
+
+/**
+ Impulse response partitions whose energy is this far, in decibels, below that of
+ the strongest partition are left out of the convolution by default. This is below
+ the rounding error of single precision arithmetic.
+ */
+static const double DEFAULT_SILENCE_THRESHOLD_DB = -140.0;
+
+/**
+ The FrequencyDomainDelayLine class holds the spectra of a partitioned convolution:
+ the spectrum of every impulse response partition, and a ring of the spectra of the
+ most recent input partitions.
+
+ The input spectra live in a ConvolutionArena, with the tables of the
+ multiply-accumulate after them, and the impulse response spectra in an
+ ImpulseSpectra block of their own, all in cache line aligned allocations. Each
+ spectrum is stored as its real parts followed by its imaginary parts, padded to a
+ whole number of cache lines, and the spectra follow each other in partition order. The input ring is kept in
+ reverse order of arrival, so that the input spectrum to be multiplied with impulse
+ response partition p is always p rows after the newest one. A multiply-accumulate
+ over all partitions therefore walks both the impulse response spectra and the input
+ spectra forwards through memory, wrapping around at most once.
+
+ Impulse response partitions that are silent, for example in a pre-delay or in a
+ tail padded to a fixed length, can be left out of the multiply-accumulate
+ altogether with findActivePartitions().
+
+ A delay line can convolve several inputs into several outputs, as routed by a
+ ConvolutionMatrix. Every input spectrum is stored once, however many paths it
+ feeds, and every path has impulse response spectra of its own. The contributions
+ of all the paths into an output are summed by one multiply-accumulate, in the
+ frequency domain, so each output needs a single inverse transform.
+
+ For independent channels, ConvolutionMatrix::diagonal(), the spectra are
+ interleaved bin by bin: bin k of channel c is element k * C + c of a spectrum of C
+ channels. The multiply-accumulate of all channels is then a single pass over spectra
+ C times as long, which fills the SIMD registers with the same bin of two, four or
+ eight channels at a time, and walks each partition's memory once for all of them.
+ Other matrices store each input and path spectrum in a block of its own, and sum
+ the (partition, path) pairs of each output in one pass of its own.
+
+ Partitions only join the multiply-accumulate once they are marked ready with
+ setPartitionReady(). The impulse response can thus be transformed in the
+ background while the delay line is in use, each partition contributing to the
+ output from the first input spectrum after it is ready, and nothing before.
+
+ With single precision samples, the impulse response spectra and, optionally, the
+ input spectra can be stored in one of the 16-bit formats of reduced_precision.hpp,
+ halving the memory footprint and the memory traffic of the multiply-accumulate.
+ The spectra are converted when they are written, and widened back to float in
+ registers by the multiply-accumulate kernel. The error this introduces is
+ measured against the full precision spectra, see getImpulseQuantizationError().
+ With double precision samples, spectra are always stored in full precision.
+
+ Objects are created with create(), which picks the implementation for the
+ requested storage formats.
+
+ Delay lines created with an ImpulseSpectrumKey share their impulse response
+ spectra with every other delay line, in the process, created with an equal key
+ and the same layout: only the first transforms them, and the others only keep
+ input spectra of their own. Whoever sets the spectra claims each partition first
+ with claimPartition(), so that several delay lines preparing the same spectra at
+ once split the work between them.
+ */
+template <typename FLOAT_TYPE>
+class FrequencyDomainDelayLine
+{
+public:
+
+    /**
+     Create a delay line with all spectra set to zero.
+     @param numPartitions
+        The number of impulse response partitions, and of input spectra kept.
+     @param numBins
+        The number of complex bins in each spectrum.
+     @param impulsePrecision
+        The storage format of the impulse response spectra.
+     @param inputPrecision
+        The storage format of the input spectra. Either kSpectrumFloat or the same
+        format as 'impulsePrecision'.
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param arena
+        The arena to take the input spectra from, with getArenaSize() bytes to spare
+        for them. nullptr for an arena of the delay line's own.
+     @param key
+        What the impulse response spectra are computed from, to share them through
+        the ImpulseSpectrumCache with other delay lines of the same key. The layout
+        of the spectra is added to it. nullptr for spectra of the delay line's own.
+     */
+    static FrequencyDomainDelayLine *create(int numPartitions, int numBins,
+                                            SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                                            SpectrumPrecision inputPrecision = kSpectrumFloat,
+                                            const ConvolutionMatrix &matrix = ConvolutionMatrix::diagonal(1),
+                                            ConvolutionArena *arena = nullptr,
+                                            const ImpulseSpectrumKey *key = nullptr);
+
+    /**
+     @returns
+        The number of bytes create() takes from an arena for the same arguments. The
+        impulse response spectra are not taken from the arena.
+     */
+    static size_t getArenaSize(int numPartitions, int numBins, SpectrumPrecision impulsePrecision,
+                               SpectrumPrecision inputPrecision, const ConvolutionMatrix &matrix)
+    {
+        /* As in create(), the input is only reduced along with the impulse response */
+        const bool reduced = std::is_same<FLOAT_TYPE, float>::value && impulsePrecision != kSpectrumFloat;
+        const size_t impulseElementSize = reduced ? sizeof(uint16_t) : sizeof(FLOAT_TYPE);
+        const size_t inputElementSize = (reduced && inputPrecision != kSpectrumFloat) ? sizeof(uint16_t) : sizeof(FLOAT_TYPE);
+
+        return getLayout(numPartitions, numBins, matrix, impulseElementSize, inputElementSize).arenaSize;
+    }
+
+    virtual ~FrequencyDomainDelayLine()
+    {
+        ImpulseSpectrumCache::getInstance().release(mSpectra);
+    }
+
+    int getNumPartitions() const
+    {
+        return mNumPartitions;
+    }
+
+    int getNumBins() const
+    {
+        return mNumBins;
+    }
+
+    const ConvolutionMatrix &getMatrix() const
+    {
+        return mMatrix;
+    }
+
+    /** @returns true if the spectra of the channels are interleaved, see the class comment. */
+    bool isInterleaved() const
+    {
+        return mInterleaved;
+    }
+
+    virtual SpectrumPrecision getImpulsePrecision() const = 0;
+    virtual SpectrumPrecision getInputPrecision() const = 0;
+
+    /** @returns The number of bytes taken by the spectra, shared or not. */
+    virtual size_t getStorageSize() const = 0;
+
+    /**
+     Store 'numBins' bins of the spectrum of one path of an impulse response partition,
+     starting at bin 'firstBin'. Every bin of every path of every partition should
+     be set exactly once, before the partition is marked ready. Different partitions
+     may be set concurrently from different threads, including while the delay line
+     is in use.
+     */
+    virtual void setImpulse(int partition, int firstBin, const FLOAT_TYPE *re, const FLOAT_TYPE *im, int numBins,
+                            int path = 0) = 0;
+
+    /**
+     Claim an impulse response partition to set.
+     @returns
+        true if the caller is to set the partition and mark it ready. false if it is
+        set by another delay line sharing the spectra, or was claimed before.
+     */
+    bool claimPartition(int partition)
+    {
+        return mSpectra->claimPartition(partition);
+    }
+
+    /**
+     Mark an impulse response partition whose spectrum is completely set as ready to
+     join the multiply-accumulate. It does so at the next advance() at which every
+     partition before it is ready too: partitions are expected to become ready in
+     about their order, and advance() only looks at the next one.
+     */
+    void setPartitionReady(int partition)
+    {
+        mSpectra->setPartitionReady(partition);
+    }
+
+    /** @returns The number of partitions marked ready so far. */
+    int getNumReadyPartitions() const
+    {
+        return mSpectra->getNumReadyPartitions();
+    }
+
+    /**
+     Wait until every partition is ready, once the caller has set all those it
+     could claim, for those still being set by the delay lines sharing the spectra.
+     */
+    void waitUntilReady() const
+    {
+        while (getNumReadyPartitions() < mNumPartitions)
+        {
+            juce::Thread::yield();
+        }
+    }
+
+    /**
+     @returns
+        The impulse response spectra, which are those of every other delay line
+        created with the same key.
+     */
+    const ImpulseSpectra &getImpulseSpectra() const
+    {
+        return *mSpectra;
+    }
+
+    /**
+     Store 'numBins' bins of one input of the newest input spectrum, starting at bin
+     'firstBin'.
+     */
+    virtual void setNewestInput(int firstBin, const FLOAT_TYPE *re, const FLOAT_TYPE *im, int numBins, int input = 0) = 0;
+
+    /**
+     Make room for a new input spectrum by discarding the oldest one. The new
+     spectrum is initially the one that was discarded, and should be overwritten
+     with setNewestInput(). Partitions that have become ready since the last call
+     join the multiply-accumulate, see findActivePartitions().
+     */
+    virtual void advance() = 0;
+
+    /**
+     Find the impulse response partitions that contribute to the output. Partitions
+     that are not ready, or whose spectrum has less energy than the strongest ready
+     partition's by more than 'thresholdDecibels', are skipped by the multiply-accumulate
+     from now on. Without interleaving, this is decided for each path on its own, so a
+     silent path costs nothing. As more partitions become ready, advance() compares
+     each new one with the strongest so far instead of searching them all again, and
+     only goes back over the active ones when a new one is the strongest, to drop those
+     it leaves below the threshold. Not to be called concurrently with advance() or
+     multiplyAccumulate().
+     @returns
+        The number of active partitions, counted once for each path without
+        interleaving.
+     */
+    virtual int findActivePartitions(double thresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB) = 0;
+
+    /**
+     @returns
+        The number of partitions included in the multiply-accumulate.
+     */
+    int getNumActivePartitions() const
+    {
+        return mNumActivePartitions;
+    }
+
+    /**
+     For every output o, Y[o] = the sum over the paths into o, and over their active
+     partitions p, of input spectrum p of the path's input times impulse response
+     partition p of the path, for the 'numBins' bins starting at 'firstBin'. Y[o](0) is
+     the sum for bin 'firstBin'. Only to be called from one thread at a time.
+     */
+    virtual void multiplyAccumulate(FLOAT_TYPE *const *YR, FLOAT_TYPE *const *YI, int firstBin, int numBins) const = 0;
+
+    /**
+     @returns
+        The energy of the difference between the stored impulse response spectra and
+        the full precision ones, relative to the energy of the full precision ones, in
+        decibels. The convolution of a signal with the stored impulse response differs
+        from the exact one by about as much. -inf when nothing was lost.
+     */
+    double getImpulseQuantizationError() const
+    {
+        double energy = 0.0;
+        double error = 0.0;
+
+        for (int i = 0; i < mNumPartitions; ++i)
+        {
+            if (isPartitionReady(i))
+            {
+                for (int path = 0; path < mMatrix.getNumPaths(); ++path)
+                {
+                    energy += mSpectra->getPartitionEnergy(i, path);
+                    error += mSpectra->getPartitionErrorEnergy(i, path);
+                }
+            }
+        }
+        return toDecibels(error, energy);
+    }
+
+    /**
+     @returns
+        Like getImpulseQuantizationError(), for the input spectra stored so far. To keep
+        the cost off the audio thread, only one input spectrum in kInputErrorInterval
+        is measured, which is plenty for an estimate.
+     */
+    double getInputQuantizationError() const
+    {
+        return toDecibels(mInputErrorEnergy, mInputEnergy);
+    }
+
+protected:
+    /** How many input spectra there are for each one whose quantization error is measured */
+    enum { kInputErrorInterval = 64 };
+
+    int mNumPartitions;
+    int mNumBins;
+    ConvolutionMatrix mMatrix;
+    bool mInterleaved;
+    int mNumActivePartitions;
+
+    /* The impulse response spectra, their energy and which partitions are ready,
+       possibly shared with other delay lines */
+    ImpulseSpectra *mSpectra;
+
+    /* Energy of the full precision input spectra measured, and of what rounding them lost */
+    double mInputEnergy;
+    double mInputErrorEnergy;
+
+    /**
+     Where the spectra go, for spectra stored in elements of the given sizes.
+     Interleaved, channel c of bin k is at k * C + c. Otherwise each input and path
+     has a block of whole cache lines, bin k of block c at c * block + k.
+     */
+    struct Layout
+    {
+        int impulseStride;
+        int inputStride;
+        int impulseBlock;
+        int inputBlock;
+        int binStep;
+
+        /* The impulse response and input spectra, and everything taken from the
+           arena, which is all but the impulse response spectra */
+        size_t impulseSize;
+        size_t inputSize;
+        size_t arenaSize;
+    };
+
+    static Layout getLayout(int numPartitions, int numBins, const ConvolutionMatrix &matrix,
+                            size_t impulseElementSize, size_t inputElementSize)
+    {
+        const int numInputs = matrix.numInputs;
+        const int numPaths = matrix.getNumPaths();
+        Layout layout;
+
+        if (matrix.isDiagonal())
+        {
+            layout.impulseStride = getStride(numBins * numPaths, impulseElementSize);
+            layout.inputStride = getStride(numBins * numInputs, inputElementSize);
+            layout.impulseBlock = layout.inputBlock = 1;
+            layout.binStep = numPaths;
+        }
+        else
+        {
+            layout.impulseBlock = getStride(numBins, impulseElementSize);
+            layout.inputBlock = getStride(numBins, inputElementSize);
+            layout.impulseStride = numPaths * layout.impulseBlock;
+            layout.inputStride = numInputs * layout.inputBlock;
+            layout.binStep = 1;
+        }
+
+        layout.impulseSize = ConvolutionArena::getAllocationSize<char>(2 * (size_t)numPartitions * layout.impulseStride * impulseElementSize);
+        layout.inputSize = ConvolutionArena::getAllocationSize<char>(2 * (size_t)numPartitions * layout.inputStride * inputElementSize);
+
+        /* The pointer tables, the active pairs and the interleaved output of the storage */
+        const int maxPairs = numPartitions * (matrix.isDiagonal() ? 1 : numPaths);
+        const int numGroups = matrix.isDiagonal() ? 1 : matrix.numOutputs;
+
+        layout.arenaSize = layout.inputSize
+                         + (2 * ConvolutionArena::getAllocationSize<const void *>(numPartitions))
+                         + (2 * ConvolutionArena::getAllocationSize<const void *>(2 * numPartitions))
+                         + (3 * ConvolutionArena::getAllocationSize<int>(maxPairs))
+                         + (4 * ConvolutionArena::getAllocationSize<const void *>(maxPairs))
+                         + (2 * ConvolutionArena::getAllocationSize<int>(numGroups))
+                         + ConvolutionArena::getAllocationSize<double>(numPaths);
+
+        if (matrix.isDiagonal() && numPaths > 1)
+        {
+            layout.arenaSize += ConvolutionArena::getAllocationSize<FLOAT_TYPE>(2 * (size_t)numBins * numPaths);
+        }
+        return layout;
+    }
+
+    /** Number of elements of a spectrum's real or imaginary parts, padded to whole cache lines */
+    static int getStride(int numBins, size_t elementSize)
+    {
+        const int elementsPerLine = ConvolutionArena::kAlignment / (int)elementSize;
+        return ((numBins + elementsPerLine - 1) / elementsPerLine) * elementsPerLine;
+    }
+
+    FrequencyDomainDelayLine(int numPartitions, int numBins, const ConvolutionMatrix &matrix)
+    : mNumPartitions(numPartitions)
+    , mNumBins(numBins)
+    , mMatrix(matrix)
+    , mInterleaved(matrix.isDiagonal())
+    , mNumActivePartitions(0)
+    , mSpectra(nullptr)
+    , mInputEnergy(0.0)
+    , mInputErrorEnergy(0.0)
+    {
+    }
+
+    /**
+     Take the impulse response spectra from the cache if there is a key, or else
+     create them. The layout of the spectra is added to the key, so that only delay
+     lines storing them the same way share them.
+     */
+    void createImpulseSpectra(const Layout &layout, const ImpulseSpectrumKey *key, SpectrumPrecision impulsePrecision,
+                              size_t impulseElementSize, bool useHugePages)
+    {
+        const int numPaths = mMatrix.getNumPaths();
+
+        if (key == nullptr)
+        {
+            mSpectra = new ImpulseSpectra(layout.impulseSize, mNumPartitions, numPaths, useHugePages);
+            checkNull(mSpectra);
+            return;
+        }
+
+        ImpulseSpectrumKey storageKey(*key);
+        storageKey.add((int64_t)sizeof(FLOAT_TYPE));
+        storageKey.add((int64_t)impulseElementSize);
+        storageKey.add((int64_t)impulsePrecision);
+        storageKey.add((int64_t)mNumPartitions);
+        storageKey.add((int64_t)mNumBins);
+        storageKey.add((int64_t)numPaths);
+        storageKey.add((int64_t)mInterleaved);
+
+        mSpectra = ImpulseSpectrumCache::getInstance().acquire(storageKey, layout.impulseSize, mNumPartitions, numPaths, useHugePages);
+    }
+
+    bool isPartitionReady(int partition) const
+    {
+        return mSpectra->isPartitionReady(partition);
+    }
+
+    double getPartitionEnergy(int partition, int path) const
+    {
+        return mSpectra->getPartitionEnergy(partition, path);
+    }
+
+    static double toDecibels(double error, double energy)
+    {
+        if (error <= 0.0)
+            return -HUGE_VAL;
+        return 10.0 * log10(error / std::max(energy, 1e-300));
+    }
+};
+
+/**
+ The implementation of FrequencyDomainDelayLine for impulse response spectra stored
+ as IMPULSE_TYPE and input spectra stored as INPUT_TYPE.
+ */
+template <typename FLOAT_TYPE, typename IMPULSE_TYPE, typename INPUT_TYPE>
+class FrequencyDomainDelayLineStorage : public FrequencyDomainDelayLine<FLOAT_TYPE>
+{
+public:
+    FrequencyDomainDelayLineStorage(int numPartitions, int numBins, const ConvolutionMatrix &matrix,
+                                    SpectrumPrecision impulsePrecision, SpectrumPrecision inputPrecision,
+                                    ConvolutionArena *arena, const ImpulseSpectrumKey *key)
+    : FrequencyDomainDelayLine<FLOAT_TYPE>(numPartitions, numBins, matrix)
+    , mImpulsePrecision(impulsePrecision)
+    , mInputPrecision(inputPrecision)
+    , mNewest(0)
+    , mInputCount(-1)
+    , mThresholdFactor(0.0)
+    , mNumPartitionsScanned(0)
+    {
+        const int numPaths = matrix.getNumPaths();
+        const typename FrequencyDomainDelayLine<FLOAT_TYPE>::Layout layout =
+            this->getLayout(numPartitions, numBins, matrix, sizeof(IMPULSE_TYPE), sizeof(INPUT_TYPE));
+
+        mImpulseStride = layout.impulseStride;
+        mInputStride = layout.inputStride;
+        mImpulseBlock = layout.impulseBlock;
+        mInputBlock = layout.inputBlock;
+        mBinStep = layout.binStep;
+        mStorageSize = layout.impulseSize + layout.inputSize;
+
+        /* The impulse response spectra go on huge pages along with the rest */
+        this->createImpulseSpectra(layout, key, impulsePrecision, sizeof(IMPULSE_TYPE),
+                                   arena != nullptr && arena->isUsingHugePages());
+        mImpulseResponse = (IMPULSE_TYPE *)this->mSpectra->getData();
+
+        if (arena == nullptr)
+        {
+            mOwnArena = new ConvolutionArena(layout.arenaSize);
+            checkNull(mOwnArena);
+            arena = mOwnArena;
+        }
+
+        mInput = (INPUT_TYPE *)arena->allocate<char>(layout.inputSize);
+
+        /* Pointer tables for the multiply-accumulate. The input table is repeated
+           twice, so that the pointers in partition order from any newest row are
+           a contiguous window of it. */
+        mImpulsePointersReal = arena->allocate<const IMPULSE_TYPE *>(numPartitions);
+        mImpulsePointersImag = arena->allocate<const IMPULSE_TYPE *>(numPartitions);
+        mInputPointersReal = arena->allocate<const INPUT_TYPE *>(2 * numPartitions);
+        mInputPointersImag = arena->allocate<const INPUT_TYPE *>(2 * numPartitions);
+
+        for (int i = 0; i < numPartitions; ++i)
+        {
+            mImpulsePointersReal[i] = getImpulseReal(i);
+            mImpulsePointersImag[i] = getImpulseImag(i);
+        }
+
+        for (int i = 0; i < 2 * numPartitions; ++i)
+        {
+            mInputPointersReal[i] = getInputReal(i % numPartitions);
+            mInputPointersImag[i] = getInputImag(i % numPartitions);
+        }
+
+        /* Interleaved, a pair is a partition of all paths at once */
+        const int maxPairs = numPartitions * (this->mInterleaved ? 1 : numPaths);
+        const int numGroups = this->mInterleaved ? 1 : matrix.numOutputs;
+
+        mActivePartitions = arena->allocate<int>(maxPairs);
+        mActivePaths = arena->allocate<int>(maxPairs);
+        mActiveInputOffsets = arena->allocate<int>(maxPairs);
+        mActiveImpulsePointersReal = arena->allocate<const IMPULSE_TYPE *>(maxPairs);
+        mActiveImpulsePointersImag = arena->allocate<const IMPULSE_TYPE *>(maxPairs);
+        mActiveInputPointersReal = arena->allocate<const INPUT_TYPE *>(maxPairs);
+        mActiveInputPointersImag = arena->allocate<const INPUT_TYPE *>(maxPairs);
+        mGroupStart = arena->allocate<int>(numGroups);
+        mGroupEnd = arena->allocate<int>(numGroups);
+        mMaxEnergy = arena->allocate<double>(numPaths);
+
+        /* Each output's group has room for every partition of every path into it */
+        for (int group = 0, start = 0; group < numGroups; ++group)
+        {
+            mGroupStart[group] = mGroupEnd[group] = start;
+
+            for (int path = 0; path < numPaths; ++path)
+            {
+                if (this->mInterleaved ? (path == 0) : (matrix.paths[path].output == group))
+                    start += numPartitions;
+            }
+        }
+
+        mInterleavedOutput = nullptr;
+
+        if (this->mInterleaved && numPaths > 1)
+        {
+            mInterleavedOutput = arena->allocate<FLOAT_TYPE>(2 * (size_t)numBins * numPaths);
+        }
+    }
+
+    SpectrumPrecision getImpulsePrecision() const override
+    {
+        return mImpulsePrecision;
+    }
+
+    SpectrumPrecision getInputPrecision() const override
+    {
+        return mInputPrecision;
+    }
+
+    size_t getStorageSize() const override
+    {
+        return mStorageSize;
+    }
+
+    void setImpulse(int partition, int firstBin, const FLOAT_TYPE *re, const FLOAT_TYPE *im, int numBins, int path) override
+    {
+        const int offset = (firstBin * mBinStep) + (path * mImpulseBlock);
+        IMPULSE_TYPE *dr = getImpulseReal(partition) + offset;
+        IMPULSE_TYPE *di = getImpulseImag(partition) + offset;
+
+        storeBins(dr, re, numBins, mBinStep);
+        storeBins(di, im, numBins, mBinStep);
+
+        double energy = 0.0;
+        double error = 0.0;
+
+        for (int j = 0; j < numBins; ++j)
+        {
+            const double er = (double)re[j] - (double)(FLOAT_TYPE)dr[j * mBinStep];
+            const double ei = (double)im[j] - (double)(FLOAT_TYPE)di[j * mBinStep];
+            energy += ((double)re[j] * re[j]) + ((double)im[j] * im[j]);
+            error += (er * er) + (ei * ei);
+        }
+
+        this->mSpectra->addPartitionEnergy(partition, path, energy, error);
+    }
+
+    void setNewestInput(int firstBin, const FLOAT_TYPE *re, const FLOAT_TYPE *im, int numBins, int input) override
+    {
+        const int offset = (firstBin * mBinStep) + (input * mInputBlock);
+        INPUT_TYPE *dr = getInputReal(mNewest) + offset;
+        INPUT_TYPE *di = getInputImag(mNewest) + offset;
+
+        storeBins(dr, re, numBins, mBinStep);
+        storeBins(di, im, numBins, mBinStep);
+
+        if (! std::is_same<INPUT_TYPE, FLOAT_TYPE>::value && mInputCount == 0)
+        {
+            for (int j = 0; j < numBins; ++j)
+            {
+                const double er = (double)re[j] - (double)(FLOAT_TYPE)dr[j * mBinStep];
+                const double ei = (double)im[j] - (double)(FLOAT_TYPE)di[j * mBinStep];
+                this->mInputEnergy += ((double)re[j] * re[j]) + ((double)im[j] * im[j]);
+                this->mInputErrorEnergy += (er * er) + (ei * ei);
+            }
+        }
+    }
+
+    void advance() override
+    {
+        mNewest = (mNewest == 0) ? (this->mNumPartitions - 1) : (mNewest - 1);
+        mInputCount = (mInputCount + 1) % this->kInputErrorInterval;
+
+        if (mNumPartitionsScanned < this->mNumPartitions && this->isPartitionReady(mNumPartitionsScanned))
+        {
+            addReadyPartitions();
+        }
+        updateActiveInputPointers();
+    }
+
+    int findActivePartitions(double thresholdDecibels) override
+    {
+        const int numGroups = this->mInterleaved ? 1 : this->mMatrix.numOutputs;
+
+        mThresholdFactor = pow(10.0, thresholdDecibels / 10.0);
+        mNumPartitionsScanned = 0;
+        this->mNumActivePartitions = 0;
+
+        for (int group = 0; group < numGroups; ++group)
+        {
+            mGroupEnd[group] = mGroupStart[group];
+        }
+
+        for (int path = 0; path < this->mMatrix.getNumPaths(); ++path)
+        {
+            mMaxEnergy[path] = 0.0;
+        }
+
+        addReadyPartitions();
+        updateActiveInputPointers();
+        return this->mNumActivePartitions;
+    }
+
+    void multiplyAccumulate(FLOAT_TYPE *const *YR, FLOAT_TYPE *const *YI, int firstBin, int numBins) const override
+    {
+        if (! this->mInterleaved)
+        {
+            /* The pairs of each output in one pass, summing its paths */
+            for (int output = 0; output < this->mMatrix.numOutputs; ++output)
+            {
+                const int first = mGroupStart[output];
+
+                complexMultiplyAccumulate(YR[output], YI[output], mActiveInputPointersReal + first,
+                                          mActiveInputPointersImag + first,
+                                          mActiveImpulsePointersReal + first,
+                                          mActiveImpulsePointersImag + first,
+                                          mGroupEnd[output] - first, firstBin, numBins);
+            }
+            return;
+        }
+
+        /* The channels of a bin are consecutive, so they are one longer spectrum */
+        const int numChannels = this->mMatrix.getNumPaths();
+        FLOAT_TYPE *yr = (numChannels == 1) ? YR[0] : mInterleavedOutput;
+        FLOAT_TYPE *yi = (numChannels == 1) ? YI[0] : mInterleavedOutput + (numBins * numChannels);
+
+        if (isSparse())
+        {
+            complexMultiplyAccumulate(yr, yi, mActiveInputPointersReal, mActiveInputPointersImag,
+                                      mActiveImpulsePointersReal, mActiveImpulsePointersImag,
+                                      this->mNumActivePartitions, firstBin * numChannels, numBins * numChannels);
+        }
+        else
+        {
+            complexMultiplyAccumulate(yr, yi, mInputPointersReal + mNewest, mInputPointersImag + mNewest,
+                                      mImpulsePointersReal, mImpulsePointersImag,
+                                      this->mNumPartitions, firstBin * numChannels, numBins * numChannels);
+        }
+
+        if (numChannels > 1)
+        {
+            for (int channel = 0; channel < numChannels; ++channel)
+            {
+                FLOAT_TYPE *rey = YR[channel];
+                FLOAT_TYPE *imy = YI[channel];
+
+                for (int k = 0; k < numBins; ++k)
+                {
+                    rey[k] = yr[k * numChannels + channel];
+                    imy[k] = yi[k * numChannels + channel];
+                }
+            }
+        }
+    }
+
+private:
+    SpectrumPrecision mImpulsePrecision;
+    SpectrumPrecision mInputPrecision;
+    int mImpulseStride;
+    int mInputStride;
+    int mImpulseBlock;
+    int mInputBlock;
+    int mBinStep;
+    int mNewest;
+    size_t mStorageSize;
+
+    /* The calls of advance() so far less one, modulo kInputErrorInterval: the
+       quantization error of the newest input spectrum is measured when this is zero,
+       starting with the first one */
+    int mInputCount;
+
+    /* The impulse response spectra, those of mSpectra */
+    IMPULSE_TYPE *mImpulseResponse;
+
+    /* Everything below is taken from the arena given to create(), or from this one */
+    juce::ScopedPointer<ConvolutionArena> mOwnArena;
+    INPUT_TYPE *mInput;
+
+    const IMPULSE_TYPE **mImpulsePointersReal;
+    const IMPULSE_TYPE **mImpulsePointersImag;
+    const INPUT_TYPE **mInputPointersReal;
+    const INPUT_TYPE **mInputPointersImag;
+
+    /* Compact lists of the active (partition, path) pairs, those of output o from
+       mGroupStart[o] to mGroupEnd[o]. Interleaved, there is one group of partitions,
+       only used when some are silent, and the path of a pair is 0. */
+    int *mActivePartitions;
+    int *mActivePaths;
+    int *mActiveInputOffsets;
+    const IMPULSE_TYPE **mActiveImpulsePointersReal;
+    const IMPULSE_TYPE **mActiveImpulsePointersImag;
+    const INPUT_TYPE **mActiveInputPointersReal;
+    const INPUT_TYPE **mActiveInputPointersImag;
+    int *mGroupStart;
+    int *mGroupEnd;
+
+    /* The silence threshold of findActivePartitions() as a factor of energy, the
+       number of partitions it and advance() have looked at so far, and the energy
+       of the strongest of them, for each path, or only path 0 when interleaved */
+    double mThresholdFactor;
+    int mNumPartitionsScanned;
+    double *mMaxEnergy;
+
+    /* The interleaved sums of all channels, before they are split up */
+    FLOAT_TYPE *mInterleavedOutput;
+
+    /** Store 'numBins' bins, every 'step'th element of 'dst' */
+    template <typename S>
+    static void storeBins(S *dst, const FLOAT_TYPE *src, int numBins, int step)
+    {
+        if (step == 1)
+        {
+            convertSpectrum(dst, src, numBins);
+            return;
+        }
+
+        for (int j = 0; j < numBins; ++j)
+        {
+            convertSpectrum(dst + (j * step), src + j, 1);
+        }
+    }
+
+    IMPULSE_TYPE *getImpulseReal(int partition) const
+    {
+        return mImpulseResponse + (2 * (size_t)partition * mImpulseStride);
+    }
+
+    IMPULSE_TYPE *getImpulseImag(int partition) const
+    {
+        return getImpulseReal(partition) + mImpulseStride;
+    }
+
+    INPUT_TYPE *getInputReal(int row) const
+    {
+        return mInput + (2 * (size_t)row * mInputStride);
+    }
+
+    INPUT_TYPE *getInputImag(int row) const
+    {
+        return getInputReal(row) + mInputStride;
+    }
+
+    /** @returns The energy of a partition, summed over its paths. */
+    double getEnergy(int partition) const
+    {
+        double energy = 0.0;
+
+        for (int path = 0; path < this->mMatrix.getNumPaths(); ++path)
+        {
+            energy += this->getPartitionEnergy(partition, path);
+        }
+        return energy;
+    }
+
+    /** @returns The energy of a (partition, path) pair, or of a partition if interleaved. */
+    double getEnergy(int partition, int path) const
+    {
+        return this->mInterleaved ? getEnergy(partition) : this->getPartitionEnergy(partition, path);
+    }
+
+    /**
+     Add the partitions that have become ready since the last call, in order, up to the
+     first that is not, each to the group of every path it has.
+     */
+    void addReadyPartitions()
+    {
+        const ConvolutionMatrix &matrix = this->mMatrix;
+
+        while (mNumPartitionsScanned < this->mNumPartitions && this->isPartitionReady(mNumPartitionsScanned))
+        {
+            const int partition = mNumPartitionsScanned++;
+
+            if (this->mInterleaved)
+            {
+                /* A partition is active if any channel needs it */
+                addPartition(0, partition, 0, 0, 0);
+                continue;
+            }
+
+            for (int path = 0; path < matrix.getNumPaths(); ++path)
+            {
+                addPartition(matrix.paths[path].output, partition, path, path * mImpulseBlock,
+                             matrix.paths[path].input * mInputBlock);
+            }
+        }
+    }
+
+    /**
+     Add one path of a partition to a group if its energy is within the threshold of
+     the strongest of the path so far. If it is the strongest, first drop the active
+     pairs of the path that it leaves below the threshold.
+     */
+    void addPartition(int group, int partition, int path, int impulseOffset, int inputOffset)
+    {
+        const double energy = getEnergy(partition, path);
+
+        if (energy <= 0.0)
+            return;
+
+        if (energy > mMaxEnergy[path])
+        {
+            mMaxEnergy[path] = energy;
+            removeInactivePairs(group, path, energy * mThresholdFactor);
+        }
+
+        if (energy >= mMaxEnergy[path] * mThresholdFactor)
+        {
+            const int pair = mGroupEnd[group]++;
+
+            mActivePartitions[pair] = partition;
+            mActivePaths[pair] = path;
+            mActiveInputOffsets[pair] = inputOffset;
+            mActiveImpulsePointersReal[pair] = getImpulseReal(partition) + impulseOffset;
+            mActiveImpulsePointersImag[pair] = getImpulseImag(partition) + impulseOffset;
+            ++this->mNumActivePartitions;
+        }
+    }
+
+    /** Remove the pairs of a path from a group whose energy is below 'threshold', keeping the order of the others */
+    void removeInactivePairs(int group, int path, double threshold)
+    {
+        int kept = mGroupStart[group];
+
+        for (int pair = mGroupStart[group]; pair < mGroupEnd[group]; ++pair)
+        {
+            if (mActivePaths[pair] == path && getEnergy(mActivePartitions[pair], path) < threshold)
+                continue;
+
+            mActivePartitions[kept] = mActivePartitions[pair];
+            mActivePaths[kept] = mActivePaths[pair];
+            mActiveInputOffsets[kept] = mActiveInputOffsets[pair];
+            mActiveImpulsePointersReal[kept] = mActiveImpulsePointersReal[pair];
+            mActiveImpulsePointersImag[kept] = mActiveImpulsePointersImag[pair];
+            ++kept;
+        }
+
+        this->mNumActivePartitions -= mGroupEnd[group] - kept;
+        mGroupEnd[group] = kept;
+    }
+
+    bool isSparse() const
+    {
+        return ! this->mInterleaved || this->mNumActivePartitions != this->mNumPartitions;
+    }
+
+    void updateActiveInputPointers()
+    {
+        if (! isSparse())
+            return;
+
+        const int numGroups = this->mInterleaved ? 1 : this->mMatrix.numOutputs;
+
+        for (int group = 0; group < numGroups; ++group)
+        {
+            for (int i = mGroupStart[group]; i < mGroupEnd[group]; ++i)
+            {
+                mActiveInputPointersReal[i] = mInputPointersReal[mNewest + mActivePartitions[i]] + mActiveInputOffsets[i];
+                mActiveInputPointersImag[i] = mInputPointersImag[mNewest + mActivePartitions[i]] + mActiveInputOffsets[i];
+            }
+        }
+    }
+};
+
+template <typename FLOAT_TYPE>
+FrequencyDomainDelayLine<FLOAT_TYPE> *FrequencyDomainDelayLine<FLOAT_TYPE>::create(int numPartitions, int numBins,
+                                                                                   SpectrumPrecision impulsePrecision,
+                                                                                   SpectrumPrecision inputPrecision,
+                                                                                   const ConvolutionMatrix &matrix,
+                                                                                   ConvolutionArena *arena,
+                                                                                   const ImpulseSpectrumKey *key)
+{
+    /* The 16-bit formats are only widened to float; double precision stays double */
+    const bool reduced = std::is_same<FLOAT_TYPE, float>::value;
+    typedef typename std::conditional<std::is_same<FLOAT_TYPE, float>::value, Half, FLOAT_TYPE>::type HalfType;
+    typedef typename std::conditional<std::is_same<FLOAT_TYPE, float>::value, BFloat16, FLOAT_TYPE>::type BFloat16Type;
+
+    if (! reduced || impulsePrecision == kSpectrumFloat)
+    {
+        return new FrequencyDomainDelayLineStorage<FLOAT_TYPE, FLOAT_TYPE, FLOAT_TYPE>(numPartitions, numBins, matrix, kSpectrumFloat, kSpectrumFloat, arena, key);
+    }
+
+    if (inputPrecision != kSpectrumFloat && inputPrecision != impulsePrecision)
+    {
+        throw std::invalid_argument("inputPrecision must be kSpectrumFloat or equal to impulsePrecision");
+    }
+
+    const bool reducedInput = (inputPrecision != kSpectrumFloat);
+
+    if (impulsePrecision == kSpectrumHalf)
+    {
+        if (reducedInput)
+            return new FrequencyDomainDelayLineStorage<FLOAT_TYPE, HalfType, HalfType>(numPartitions, numBins, matrix, impulsePrecision, inputPrecision, arena, key);
+        return new FrequencyDomainDelayLineStorage<FLOAT_TYPE, HalfType, FLOAT_TYPE>(numPartitions, numBins, matrix, impulsePrecision, inputPrecision, arena, key);
+    }
+
+    if (reducedInput)
+        return new FrequencyDomainDelayLineStorage<FLOAT_TYPE, BFloat16Type, BFloat16Type>(numPartitions, numBins, matrix, impulsePrecision, inputPrecision, arena, key);
+    return new FrequencyDomainDelayLineStorage<FLOAT_TYPE, BFloat16Type, FLOAT_TYPE>(numPartitions, numBins, matrix, impulsePrecision, inputPrecision, arena, key);
+}
+
+#endif /* FrequencyDomainDelayLine_h */
@@ -0,0 +1,154 @@
+//
+//  ImpulseResponseTrim.h
+//  RTConvolve
+//
+
+#ifndef ImpulseResponseTrim_h
+#define ImpulseResponseTrim_h
+
+#include <cmath>
+#include <algorithm>
+
+/**
+ By default, only the leading and trailing samples of an impulse response that are
+ exactly zero are trimmed, which leaves the convolution unchanged whatever the sample
+ type. A finite threshold trims the parts of an impulse response that each hold
+ less than that fraction, in decibels, of its total energy, introducing an error of
+ at most that fraction of the output energy for each end: e.g. -120 dB is below the
+ rounding error of single precision for long impulse responses.
+ */
+static const double DEFAULT_TRIM_THRESHOLD_DB = -HUGE_VAL;
+
+/**
+ The part of an impulse response that is worth convolving with: the samples between
+ its onset and the point where its remaining energy has decayed below a threshold.
+ Whatever precedes the onset is implemented as a pure delay, and whatever follows
+ the end is dropped.
+ */
+struct ImpulseResponseTrim
+{
+    /** The number of samples before the onset, implemented as a delay. */
+    int onset;
+
+    /** The number of samples from the onset to the end. */
+    int length;
+
+    /** The length of the untrimmed impulse response. */
+    int numSamples;
+
+    /**
+     The number of impulse response partitions that the partitioned convolution of
+     the untrimmed impulse response would have used, but the trimmed one doesn't.
+     Filled in by ConvolutionManager.
+     */
+    int partitionsSaved;
+
+    ImpulseResponseTrim()
+    : onset(0)
+    , length(0)
+    , numSamples(0)
+    , partitionsSaved(0)
+    {
+    }
+
+    /**
+     Find the onset and end of an impulse response.
+     @param thresholdDecibels
+        The leading samples whose energy adds up to less than this, relative to the
+        total energy of the impulse response, are before the onset. The same holds for
+        the trailing samples after the end. With -inf, only samples that are exactly
+        zero are. An impulse response that is entirely silent is not trimmed.
+     */
+    template <typename FLOAT_TYPE>
+    static ImpulseResponseTrim analyze(const FLOAT_TYPE *impulseResponse, int numSamples,
+                                       double thresholdDecibels = DEFAULT_TRIM_THRESHOLD_DB)
+    {
+        return analyze(&impulseResponse, 1, numSamples, thresholdDecibels);
+    }
+
+    /**
+     Find the onset and end shared by the channels of a multichannel impulse response:
+     the earliest onset and the latest end of any channel, so that the channels stay
+     aligned. Silent channels are ignored, and if every channel is silent the impulse
+     response is not trimmed.
+     */
+    template <typename FLOAT_TYPE>
+    static ImpulseResponseTrim analyze(const FLOAT_TYPE *const *impulseResponses, int numChannels, int numSamples,
+                                       double thresholdDecibels = DEFAULT_TRIM_THRESHOLD_DB)
+    {
+        ImpulseResponseTrim trim;
+        trim.numSamples = numSamples;
+        trim.length = numSamples;
+
+        int onset = numSamples;
+        int end = 0;
+
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            int channelOnset, channelEnd;
+
+            if (findOnsetAndEnd(impulseResponses[channel], numSamples, thresholdDecibels, channelOnset, channelEnd))
+            {
+                onset = std::min(onset, channelOnset);
+                end = std::max(end, channelEnd);
+            }
+        }
+
+        if (end > onset)
+        {
+            trim.onset = onset;
+            trim.length = end - onset;
+        }
+        return trim;
+    }
+
+private:
+    /**
+     @returns
+        false if the impulse response is silent, otherwise true with its onset and end.
+     */
+    template <typename FLOAT_TYPE>
+    static bool findOnsetAndEnd(const FLOAT_TYPE *impulseResponse, int numSamples, double thresholdDecibels,
+                                int &onset, int &end)
+    {
+        double totalEnergy = 0.0;
+
+        for (int i = 0; i < numSamples; ++i)
+        {
+            totalEnergy += (double)impulseResponse[i] * impulseResponse[i];
+        }
+
+        if (totalEnergy <= 0.0)
+        {
+            return false;
+        }
+
+        const double threshold = totalEnergy * pow(10.0, thresholdDecibels / 10.0);
+        double energy = 0.0;
+        onset = 0;
+        end = numSamples;
+
+        /* Leading samples, while their energy stays below the threshold */
+        while (onset < numSamples)
+        {
+            energy += (double)impulseResponse[onset] * impulseResponse[onset];
+            if (energy > threshold)
+                break;
+            ++onset;
+        }
+
+        /* Trailing samples, likewise */
+        energy = 0.0;
+        while (end > onset + 1)
+        {
+            energy += (double)impulseResponse[end - 1] * impulseResponse[end - 1];
+            if (energy > threshold)
+                break;
+            --end;
+        }
+
+        return true;
+    }
+};
+
+#endif /* ImpulseResponseTrim_h */
@@ -0,0 +1,317 @@
+//
+//  ImpulseSpectrumCache.h
+//  RTConvolve
+//
+
+#ifndef ImpulseSpectrumCache_h
+#define ImpulseSpectrumCache_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ConvolutionArena.h"
+#include "util/util.h"
+#include <stdint.h>
+#include <cstring>
+#include <atomic>
+#include <vector>
+#include <map>
+
+/**
+ Identifies a set of impulse response spectra by everything they are computed from:
+ the samples of the impulse response, hashed, and the partitioning, transform and
+ storage format, added as plain values. Two convolvers with equal keys store
+ identical spectra.
+
+ The samples are hashed 64 bits at a time into two independent 64-bit hashes, so
+ that a key is effectively unique for any number of impulse responses in a process.
+ */
+class ImpulseSpectrumKey
+{
+public:
+    ImpulseSpectrumKey()
+    {
+        mHash[0] = 0xcbf29ce484222325ull;
+        mHash[1] = 0x9e3779b97f4a7c15ull;
+    }
+
+    /** Add 'numBytes' bytes of data, e.g. the samples of one path of an impulse response. */
+    void add(const void *data, size_t numBytes)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        size_t i = 0;
+
+        for (; i + sizeof(uint64_t) <= numBytes; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i, sizeof(uint64_t));
+            addWord(word);
+        }
+
+        if (i < numBytes)
+        {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, numBytes - i);
+            addWord(word);
+        }
+
+        addWord(numBytes);
+    }
+
+    /** Add a parameter, e.g. a partition size. */
+    void add(int64_t value)
+    {
+        addWord((uint64_t)value);
+    }
+
+    bool operator==(const ImpulseSpectrumKey &other) const
+    {
+        return mHash[0] == other.mHash[0] && mHash[1] == other.mHash[1];
+    }
+
+    bool operator<(const ImpulseSpectrumKey &other) const
+    {
+        return (mHash[0] != other.mHash[0]) ? (mHash[0] < other.mHash[0]) : (mHash[1] < other.mHash[1]);
+    }
+
+private:
+    uint64_t mHash[2];
+
+    void addWord(uint64_t word)
+    {
+        /* FNV-1a over whole words, and a multiply-rotate mix in the manner of MurmurHash */
+        mHash[0] = (mHash[0] ^ word) * 0x100000001b3ull;
+
+        uint64_t k = word * 0x87c37b91114253d5ull;
+        k = (k << 31) | (k >> 33);
+        mHash[1] ^= k * 0x4cf5ad432745937full;
+        mHash[1] = ((mHash[1] << 27) | (mHash[1] >> 37)) * 5 + 0x52dce729;
+    }
+};
+
+/**
+ The spectra of every partition of an impulse response, as stored by a
+ FrequencyDomainDelayLine, along with the energy of each partition and whether it
+ is ready. They are written once, partition by partition, and only read after that,
+ so any number of delay lines, in any number of plugin instances, can share them,
+ each keeping its own input spectra and output state.
+
+ Several delay lines may be preparing the same spectra at once, e.g. two instances
+ loading the same impulse response in the background. Each partition is transformed
+ by whichever of them claims it first, see claimPartition(), and the others skip it.
+
+ Spectra are obtained from, and returned to, the ImpulseSpectrumCache.
+ */
+class ImpulseSpectra
+{
+public:
+    /**
+     @param numBytes
+        The size of the spectra.
+     @param numPartitions
+        The number of impulse response partitions.
+     @param numPaths
+        The number of paths of each partition.
+     @param useHugePages
+        As for ConvolutionArena.
+     */
+    ImpulseSpectra(size_t numBytes, int numPartitions, int numPaths, bool useHugePages)
+    : mArena(numBytes, useHugePages)
+    , mNumPaths(numPaths)
+    , mPartitionEnergy((size_t)numPartitions * numPaths, 0.0)
+    , mPartitionErrorEnergy((size_t)numPartitions * numPaths, 0.0)
+    , mPartitionClaimed(numPartitions)
+    , mPartitionReady(numPartitions)
+    , mNumReadyPartitions(0)
+    , mReferenceCount(1)
+    , mCached(false)
+    {
+        mData = mArena.allocate<char>(numBytes);
+    }
+
+    char *getData() const
+    {
+        return mData;
+    }
+
+    size_t getSize() const
+    {
+        return mArena.getCapacity();
+    }
+
+    int getNumPartitions() const
+    {
+        return (int)mPartitionReady.size();
+    }
+
+    /**
+     Claim a partition to transform.
+     @returns
+        true the first time it is called for the partition, after which the caller
+        must set the partition and mark it ready. false if someone else has claimed it.
+     */
+    bool claimPartition(int partition)
+    {
+        return ! mPartitionClaimed[partition].exchange(true, std::memory_order_acq_rel);
+    }
+
+    void setPartitionReady(int partition)
+    {
+        mPartitionReady[partition].store(true, std::memory_order_release);
+        mNumReadyPartitions.fetch_add(1, std::memory_order_release);
+    }
+
+    bool isPartitionReady(int partition) const
+    {
+        return mPartitionReady[partition].load(std::memory_order_acquire);
+    }
+
+    int getNumReadyPartitions() const
+    {
+        return mNumReadyPartitions.load(std::memory_order_acquire);
+    }
+
+    /** Add to the energy of a path of a partition, and to what storing it lost, as it is set */
+    void addPartitionEnergy(int partition, int path, double energy, double error)
+    {
+        mPartitionEnergy[partition * mNumPaths + path] += energy;
+        mPartitionErrorEnergy[partition * mNumPaths + path] += error;
+    }
+
+    /** Only to be called once the partition is ready. */
+    double getPartitionEnergy(int partition, int path) const
+    {
+        return mPartitionEnergy[partition * mNumPaths + path];
+    }
+
+    /** Only to be called once the partition is ready. */
+    double getPartitionErrorEnergy(int partition, int path) const
+    {
+        return mPartitionErrorEnergy[partition * mNumPaths + path];
+    }
+
+private:
+    friend class ImpulseSpectrumCache;
+
+    ConvolutionArena mArena;
+    char *mData;
+    int mNumPaths;
+
+    /* Per partition and path, at partition * numPaths + path, so that partitions
+       can be set concurrently */
+    std::vector<double> mPartitionEnergy;
+    std::vector<double> mPartitionErrorEnergy;
+
+    std::vector<std::atomic<bool> > mPartitionClaimed;
+    std::vector<std::atomic<bool> > mPartitionReady;
+    std::atomic<int> mNumReadyPartitions;
+
+    /* Guarded by the cache's lock if mCached */
+    int mReferenceCount;
+    bool mCached;
+    ImpulseSpectrumKey mKey;
+
+    JUCE_DECLARE_NON_COPYABLE (ImpulseSpectra)
+};
+
+/**
+ The process-wide cache of impulse response spectra, shared by every convolver,
+ and so by every plugin instance, in the process.
+
+ Spectra are looked up by an ImpulseSpectrumKey. The first convolver to ask for a
+ key gets new spectra to prepare, and the others the same ones, prepared or being
+ prepared, so that an impulse response loaded into several instances, or into the
+ same instance again with other settings that leave a level's partitioning as it
+ was, is only transformed and stored once. Spectra are reference counted, and
+ leave the cache as soon as nothing uses them any more.
+
+ Not to be used from an audio thread: acquire() and release() take a lock, and
+ may allocate or free the spectra.
+ */
+class ImpulseSpectrumCache
+{
+public:
+    static ImpulseSpectrumCache &getInstance()
+    {
+        static ImpulseSpectrumCache instance;
+        return instance;
+    }
+
+    /**
+     @returns
+        The spectra for 'key', with a reference for the caller to release(): the
+        cached ones if there are any, or else new ones, zeroed, with no partition
+        claimed. The other arguments are those of the ImpulseSpectra constructor,
+        and are the same for equal keys.
+     */
+    ImpulseSpectra *acquire(const ImpulseSpectrumKey &key, size_t numBytes, int numPartitions, int numPaths, bool useHugePages)
+    {
+        const juce::ScopedLock lock(mLock);
+        std::map<ImpulseSpectrumKey, ImpulseSpectra *>::iterator entry = mEntries.find(key);
+
+        if (entry != mEntries.end())
+        {
+            ++entry->second->mReferenceCount;
+            return entry->second;
+        }
+
+        ImpulseSpectra *spectra = new ImpulseSpectra(numBytes, numPartitions, numPaths, useHugePages);
+        checkNull(spectra);
+        spectra->mCached = true;
+        spectra->mKey = key;
+        mEntries[key] = spectra;
+        mNumBytes += spectra->getSize();
+        return spectra;
+    }
+
+    /**
+     Give up a reference to spectra obtained from acquire(), or created on their own.
+     The spectra are deleted when the last one is released.
+     */
+    void release(ImpulseSpectra *spectra)
+    {
+        if (spectra == nullptr)
+            return;
+
+        if (! spectra->mCached)
+        {
+            delete spectra;
+            return;
+        }
+
+        const juce::ScopedLock lock(mLock);
+
+        if (--spectra->mReferenceCount == 0)
+        {
+            mEntries.erase(spectra->mKey);
+            mNumBytes -= spectra->getSize();
+            delete spectra;
+        }
+    }
+
+    /** @returns The number of different spectra in use. */
+    int getNumEntries() const
+    {
+        const juce::ScopedLock lock(mLock);
+        return (int)mEntries.size();
+    }
+
+    /** @returns The number of bytes of all the spectra in use, each counted once. */
+    size_t getNumBytes() const
+    {
+        const juce::ScopedLock lock(mLock);
+        return mNumBytes;
+    }
+
+private:
+    juce::CriticalSection mLock;
+    std::map<ImpulseSpectrumKey, ImpulseSpectra *> mEntries;
+    size_t mNumBytes;
+
+    ImpulseSpectrumCache()
+    : mNumBytes(0)
+    {
+    }
+
+    JUCE_DECLARE_NON_COPYABLE (ImpulseSpectrumCache)
+};
+
+#endif /* ImpulseSpectrumCache_h */
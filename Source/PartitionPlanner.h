@@ -0,0 +1,514 @@
+//
+//  PartitionPlanner.h
+//  RTConvolve
+//
+
+#ifndef PartitionPlanner_h
+#define PartitionPlanner_h
+
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include "util/fft.hpp"
+#include "util/complex_mac.hpp"
+#include "util/util.h"
+
+/**
+ One level of a partitioning scheme: 'numPartitions' consecutive partitions of
+ 'partitionSize' samples of the impulse response, convolved either by a
+ UPConvolver or, if 'timeDistributed' is set, by a TimeDistributedFFTConvolver.
+ */
+struct PartitionLevel
+{
+    int partitionSize;
+    int numPartitions;
+    bool timeDistributed;
+
+    /**
+     The largest depth of a time-distributed level. Folding the input into the cosets
+     and recombining the output from them touches every coset in every buffer, so the
+     cost per sample grows linearly with 2^depth; beyond 2^4 phases it outweighs the
+     transforms, and a larger buffer size is the cheaper way to a larger partition.
+     */
+    enum { kMaxDepth = 4 };
+
+    /**
+     @returns
+        How far into the impulse response this level must start: the delay of its
+        output. A uniform level has none. A time-distributed level spreads the work of
+        each partition over partitionSize / bufferSize buffers, and delays its output
+        by two partitions (see TimeDistributedFFTConvolver).
+     */
+    int getDelay() const
+    {
+        return timeDistributed ? (2 * partitionSize) : 0;
+    }
+
+    /**
+     @returns
+        The depth of the TimeDistributedFFTConvolver of a time-distributed level:
+        log2(partitionSize / bufferSize).
+     */
+    int getDepth(int bufferSize) const
+    {
+        int depth = 0;
+
+        while ((bufferSize << depth) < partitionSize)
+            ++depth;
+        return depth;
+    }
+};
+
+/**
+ The partitioning scheme used by a ConvolutionManager for one impulse response
+ length and buffer size. The levels cover the impulse response in order, the
+ first level starting at its first sample.
+ */
+struct PartitionPlan
+{
+    int bufferSize;
+    int numSamples;
+
+    /** Predicted worst-case time, in seconds, spent in a single call to processInput(). */
+    double cost;
+
+    std::vector<PartitionLevel> levels;
+
+    PartitionPlan()
+    : bufferSize(0)
+    , numSamples(0)
+    , cost(0.0)
+    {
+    }
+
+    /** @returns The position in the impulse response of the first sample of level 'index'. */
+    int getLevelStart(size_t index) const
+    {
+        int start = 0;
+
+        for (size_t i = 0; i < index; ++i)
+        {
+            start += levels[i].partitionSize * levels[i].numPartitions;
+        }
+        return start;
+    }
+
+    /** @returns The total number of partitions of every level. */
+    int getNumPartitions() const
+    {
+        int numPartitions = 0;
+
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            numPartitions += levels[i].numPartitions;
+        }
+        return numPartitions;
+    }
+
+    /**
+     @returns
+        A one-line description of the plan, e.g.
+        "bufferSize=512 numSamples=96000 cost=1.2e-05 levels=U512x8,T2048x46",
+        where 'U' denotes a uniform level and 'T' a time-distributed one.
+        The string can be turned back into a plan with fromString().
+     */
+    std::string toString() const
+    {
+        std::ostringstream stream;
+        stream << "bufferSize=" << bufferSize << " numSamples=" << numSamples << " cost=" << cost << " levels=";
+
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            stream << (i > 0 ? "," : "") << (levels[i].timeDistributed ? 'T' : 'U')
+                   << levels[i].partitionSize << 'x' << levels[i].numPartitions;
+        }
+        return stream.str();
+    }
+
+    /**
+     Parse a string produced by toString().
+     @returns
+        false if the string is not a valid plan, in which case 'plan' is unchanged.
+     */
+    static bool fromString(const std::string &text, PartitionPlan &plan)
+    {
+        PartitionPlan result;
+        std::string levels;
+        std::istringstream stream(text);
+        std::string field;
+
+        while (stream >> field)
+        {
+            size_t separator = field.find('=');
+            if (separator == std::string::npos)
+                return false;
+
+            std::string key = field.substr(0, separator);
+            std::istringstream value(field.substr(separator + 1));
+
+            if (key == "bufferSize")
+                value >> result.bufferSize;
+            else if (key == "numSamples")
+                value >> result.numSamples;
+            else if (key == "cost")
+                value >> result.cost;
+            else if (key == "levels")
+                levels = value.str();
+
+            if (value.fail())
+                return false;
+        }
+
+        std::istringstream levelStream(levels);
+        std::string levelText;
+
+        while (std::getline(levelStream, levelText, ','))
+        {
+            PartitionLevel level;
+            char type, times;
+            std::istringstream levelValue(levelText);
+
+            levelValue >> type >> level.partitionSize >> times >> level.numPartitions;
+            if (levelValue.fail() || (type != 'U' && type != 'T') || times != 'x')
+                return false;
+
+            level.timeDistributed = (type == 'T');
+            result.levels.push_back(level);
+        }
+
+        if (result.bufferSize <= 0 || result.levels.empty())
+            return false;
+
+        plan = result;
+        return true;
+    }
+};
+
+/**
+ Chooses the partitioning scheme of a ConvolutionManager from a cost model of
+ the running machine.
+
+ The cost of every building block of the convolvers is measured once per size:
+ one real FFT of a partition, and the complex multiply-accumulate of the
+ spectrum of one partition. The worst-case time of one call to processInput()
+ of every candidate scheme is predicted from these, and the cheapest candidate
+ is chosen. Measurements take a few milliseconds per size and are shared by
+ every ConvolutionManager in the process. They can be saved with
+ getMeasurements() and given back to a later process with setMeasurements(),
+ so that they are not repeated at every launch.
+ */
+template <typename FLOAT_TYPE>
+class PartitionPlanner
+{
+public:
+    static PartitionPlanner &getInstance()
+    {
+        static PartitionPlanner planner;
+        return planner;
+    }
+
+    /**
+     Choose the partitioning scheme with the lowest worst-case cost per buffer.
+
+     The candidates are uniform partitions of the buffer size over the whole impulse
+     response, and every non-uniform scheme of a uniform head followed by one or more
+     time-distributed levels whose partition sizes grow by powers of two, as in
+     Garcia's optimal partitioning. Every level but the last is given just enough
+     partitions to cover the delay of the next one, which is then the earliest it
+     can start. Every level works in every buffer, the time-distributed ones spreading
+     the work of a partition evenly over as many buffers as it has samples, so the
+     worst-case cost of a scheme is the sum of the costs of its levels. Time-distributed
+     partitions are at most 2^PartitionLevel::kMaxDepth buffers long.
+     @param numSamples
+        The length of the impulse response.
+     @param bufferSize
+        The host audio application's buffer size.
+     */
+    PartitionPlan plan(int numSamples, int bufferSize)
+    {
+        const int numUniformPartitions = std::max(1, divideRoundingUp(numSamples, bufferSize));
+
+        /* Uniform partitions of the buffer size for the whole impulse response */
+        PartitionPlan best = makePlan(numSamples, bufferSize);
+        addUniformLevel(best, bufferSize, numUniformPartitions);
+
+        /* The time-distributed partition sizes 4 * bufferSize * 2^k that fit in the impulse response */
+        const int maxSize = std::min((int)kMaxPartitionSize, bufferSize << PartitionLevel::kMaxDepth);
+        std::vector<int> sizes;
+        for (int size = 4 * bufferSize; size <= maxSize && size < numSamples; size *= 2)
+        {
+            sizes.push_back(size);
+        }
+
+        /* Every increasing sequence of those sizes, as a bit mask */
+        for (unsigned int mask = 1; sizes.size() < 31 && mask < (1u << sizes.size()); ++mask)
+        {
+            std::vector<PartitionLevel> levels(1, makeLevel(bufferSize, false));
+
+            for (size_t i = 0; i < sizes.size(); ++i)
+            {
+                if (mask & (1u << i))
+                    levels.push_back(makeLevel(sizes[i], true));
+            }
+
+            PartitionPlan candidate = makePlan(numSamples, bufferSize);
+            if (fillLevels(candidate, levels))
+            {
+                if (candidate.cost < best.cost)
+                {
+                    best = candidate;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    /**
+     @returns
+        The measured time, in seconds, of one real FFT of 'N' points.
+     */
+    double getFFTCost(int N)
+    {
+        return getMeasurement(N).fft;
+    }
+
+    /**
+     @returns
+        The measured time, in seconds, of the complex multiply-accumulate of the
+        N / 2 + 1 bins of the spectrum of one partition of an 'N' point FFT.
+     */
+    double getMultiplyAccumulateCost(int N)
+    {
+        return getMeasurement(N).mac;
+    }
+
+    /**
+     @returns
+        Every measurement taken so far, one "N fftCost macCost" line per size.
+     */
+    std::string getMeasurements() const
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        std::ostringstream stream;
+
+        for (typename std::map<int, Measurement>::const_iterator it = mMeasurements.begin(); it != mMeasurements.end(); ++it)
+        {
+            stream << it->first << ' ' << it->second.fft << ' ' << it->second.mac << '\n';
+        }
+        return stream.str();
+    }
+
+    /**
+     Add measurements previously returned by getMeasurements(), which may come from
+     an earlier run on the same machine. Malformed lines are ignored.
+     */
+    void setMeasurements(const std::string &text)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        std::istringstream stream(text);
+        std::string line;
+
+        while (std::getline(stream, line))
+        {
+            std::istringstream lineStream(line);
+            int N;
+            Measurement measurement;
+
+            if ((lineStream >> N >> measurement.fft >> measurement.mac) && N > 0 && isPowerOfTwo(N))
+            {
+                mMeasurements[N] = measurement;
+            }
+        }
+    }
+
+private:
+    struct Measurement
+    {
+        double fft;
+        double mac;
+    };
+
+    mutable std::mutex mLock;
+    std::mutex mMeasurementLock;
+    std::map<int, Measurement> mMeasurements;
+
+    /** Larger partitions have delays of many seconds and make measurements very slow */
+    enum { kMaxPartitionSize = 65536 };
+
+    PartitionPlanner() {}
+
+    static int divideRoundingUp(int x, int y)
+    {
+        return (x / y) + !!(x % y);
+    }
+
+    static PartitionLevel makeLevel(int partitionSize, bool timeDistributed)
+    {
+        PartitionLevel level = { partitionSize, 0, timeDistributed };
+        return level;
+    }
+
+    /**
+     Give each level its number of partitions and add its cost to the plan: every level
+     but the last just reaches the start of the next one, and the last one covers the
+     rest of the impulse response.
+     @returns
+        false if the impulse response ends before the last level.
+     */
+    bool fillLevels(PartitionPlan &plan, const std::vector<PartitionLevel> &levels)
+    {
+        int start = 0;
+
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            const int end = (i + 1 < levels.size()) ? levels[i + 1].getDelay() : plan.numSamples;
+
+            if (start >= plan.numSamples)
+                return false;
+
+            const int numPartitions = std::max(1, divideRoundingUp(end - start, levels[i].partitionSize));
+
+            if (levels[i].timeDistributed)
+                addTimeDistributedLevel(plan, levels[i].partitionSize, numPartitions);
+            else
+                addUniformLevel(plan, levels[i].partitionSize, numPartitions);
+
+            start += numPartitions * levels[i].partitionSize;
+        }
+
+        return true;
+    }
+
+    static PartitionPlan makePlan(int numSamples, int bufferSize)
+    {
+        PartitionPlan plan;
+        plan.bufferSize = bufferSize;
+        plan.numSamples = numSamples;
+        return plan;
+    }
+
+    /**
+     A uniform level does one forward and one inverse FFT of twice the partition
+     size and every multiply-accumulate on each call.
+     */
+    void addUniformLevel(PartitionPlan &plan, int partitionSize, int numPartitions)
+    {
+        PartitionLevel level = { partitionSize, numPartitions, false };
+        const int N = 2 * partitionSize;
+
+        plan.levels.push_back(level);
+        plan.cost += (2.0 * getFFTCost(N)) + (numPartitions * getMultiplyAccumulateCost(N));
+    }
+
+    /**
+     A time-distributed level with C = partitionSize / bufferSize phases does, on each
+     call, either the forward or the inverse transform of one group of its cosets,
+     which costs about one real FFT of 4 * bufferSize points, and the multiply-accumulates
+     of bufferSize bins of every partition. Folding the input into the C / 2 + 1 cosets
+     and recombining the output from them takes about 6 flops per sample and coset, where
+     the multiply-accumulate of a bin takes 8.
+     */
+    void addTimeDistributedLevel(PartitionPlan &plan, int partitionSize, int numPartitions)
+    {
+        PartitionLevel level = { partitionSize, numPartitions, true };
+        const int numCosets = (partitionSize / plan.bufferSize) / 2 + 1;
+        const double macCost = getMultiplyAccumulateCost(2 * plan.bufferSize);
+
+        plan.levels.push_back(level);
+        plan.cost += getFFTCost(4 * plan.bufferSize) + ((numPartitions + 0.75 * numCosets) * macCost);
+    }
+
+    Measurement getMeasurement(int N)
+    {
+        /* Only one thread measures at a time, so that measurements don't disturb each other */
+        std::lock_guard<std::mutex> measurementLock(mMeasurementLock);
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            typename std::map<int, Measurement>::const_iterator it = mMeasurements.find(N);
+            if (it != mMeasurements.end())
+                return it->second;
+        }
+
+        Measurement measurement = measure(N);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        mMeasurements[N] = measurement;
+        return measurement;
+    }
+
+    /**
+     Time the FFT and multiply-accumulate of size N, taking the best of several runs.
+     The multiply-accumulates are timed over several partitions, as in the convolvers,
+     so that the result includes the cost of streaming the spectra through the cache.
+     */
+    static Measurement measure(int N)
+    {
+        typedef std::chrono::steady_clock Clock;
+        const int numRuns = 5;
+        const int numPartitions = 16;
+        const int numBins = N / 2 + 1;
+        const int transformsPerRun = std::max(1, 65536 / N);
+        FFTPlan<FLOAT_TYPE> fftPlan(N);
+        std::vector<FLOAT_TYPE> input(N), re(N), im(numBins);
+        std::vector<FLOAT_TYPE> xr(numPartitions * numBins), xi(numPartitions * numBins);
+        std::vector<FLOAT_TYPE> hr(numPartitions * numBins), hi(numPartitions * numBins);
+        std::vector<FLOAT_TYPE> yr(numBins), yi(numBins);
+        std::vector<const FLOAT_TYPE *> xrp(numPartitions), xip(numPartitions), hrp(numPartitions), hip(numPartitions);
+        Measurement measurement = { 0.0, 0.0 };
+
+        for (int i = 0; i < N; ++i)
+        {
+            input[i] = (FLOAT_TYPE)sin(0.1 * i);
+        }
+
+        for (size_t i = 0; i < xr.size(); ++i)
+        {
+            xr[i] = hr[i] = (FLOAT_TYPE)sin(0.1 * i);
+            xi[i] = hi[i] = (FLOAT_TYPE)cos(0.3 * i);
+        }
+
+        for (int j = 0; j < numPartitions; ++j)
+        {
+            xrp[j] = xr.data() + (j * numBins);
+            xip[j] = xi.data() + (j * numBins);
+            hrp[j] = hr.data() + (j * numBins);
+            hip[j] = hi.data() + (j * numBins);
+        }
+
+        /* The first run only warms up caches and branch predictors */
+        for (int run = 0; run <= numRuns; ++run)
+        {
+            Clock::time_point start = Clock::now();
+            for (int k = 0; k < transformsPerRun; ++k)
+            {
+                memcpy(re.data(), input.data(), N * sizeof(FLOAT_TYPE));
+                fftPlan.rfft(re.data(), im.data());
+                fftPlan.irfft(re.data(), im.data());
+            }
+            double fft = std::chrono::duration<double>(Clock::now() - start).count() / (2 * transformsPerRun);
+
+            start = Clock::now();
+            for (int k = 0; k < transformsPerRun; ++k)
+            {
+                complexMultiplyAccumulate(yr.data(), yi.data(), xrp.data(), xip.data(), hrp.data(), hip.data(), numPartitions, 0, numBins);
+            }
+            double mac = std::chrono::duration<double>(Clock::now() - start).count() / (numPartitions * transformsPerRun);
+
+            if (run == 1 || (run > 1 && fft < measurement.fft))
+                measurement.fft = fft;
+            if (run == 1 || (run > 1 && mac < measurement.mac))
+                measurement.mac = mac;
+        }
+
+        return measurement;
+    }
+};
+
+#endif /* PartitionPlanner_h */
@@ -22,13 +22,17 @@ RtconvolveAudioProcessorEditor::RtconvolveAudioProcessorEditor (RtconvolveAudioP
     mButtonChooseIR.changeWidthToFitText();
     setSize (400, 300);
     
+    // The statistics go in a strip below the button
     Rectangle<int> boundingBox = getBounds();
+    boundingBox.removeFromBottom(kStatusHeight);
     mButtonChooseIR.setBounds(boundingBox);
 
     addAndMakeVisible(&mButtonChooseIR);
     
     mButtonChooseIR.addListener(this);
 
+    mTrim = processor.getImpulseResponseTrim();
+    startTimer(kRefreshIntervalMilliseconds);
 }
 
 RtconvolveAudioProcessorEditor::~RtconvolveAudioProcessorEditor()
@@ -60,6 +64,22 @@ void RtconvolveAudioProcessorEditor::paint (Graphics& g)
     g.setColour (Colours::black);
     g.setFont (15.0f);
 
+    // How much of the impulse response is convolved, and what trimming it saved
+    const String text = String(mTrim.onset) + " samples of pre-delay, " + String(mTrim.length) + " of "
+                      + String(mTrim.numSamples) + " samples convolved, " + String(mTrim.partitionsSaved) + " partitions saved";
+    g.drawFittedText(text, getLocalBounds().removeFromBottom(kStatusHeight).reduced(10, 0), Justification::centred, 1);
+}
+
+void RtconvolveAudioProcessorEditor::timerCallback()
+{
+    const ImpulseResponseTrim trim = processor.getImpulseResponseTrim();
+    
+    if (trim.onset != mTrim.onset || trim.length != mTrim.length || trim.numSamples != mTrim.numSamples
+        || trim.partitionsSaved != mTrim.partitionsSaved)
+    {
+        mTrim = trim;
+        repaint();
+    }
 }
 
 void RtconvolveAudioProcessorEditor::resized()
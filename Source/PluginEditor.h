@@ -18,7 +18,8 @@
 //==============================================================================
 /**
 */
-class RtconvolveAudioProcessorEditor  : public AudioProcessorEditor, public Button::Listener
+class RtconvolveAudioProcessorEditor  : public AudioProcessorEditor, public Button::Listener,
+                                        private Timer
 {
 public:
     RtconvolveAudioProcessorEditor (RtconvolveAudioProcessor&);
@@ -29,11 +30,23 @@ public:
     void resized() override;
     void buttonClicked(juce::Button*) override;
 private:
+    /** How often the impulse response statistics are checked for a change */
+    enum { kRefreshIntervalMilliseconds = 250 };
+    
+    /** The height of the strip that shows them */
+    enum { kStatusHeight = 30 };
+    
+    /** Repaint when a newly loaded impulse response has changed the statistics */
+    void timerCallback() override;
+    
     // This reference is provided as a quick way for your editor to
     // access the processor object that created it.
     RtconvolveAudioProcessor& processor;
     
     juce::TextButton mButtonChooseIR;
+    
+    /* The statistics shown */
+    ImpulseResponseTrim mTrim;
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RtconvolveAudioProcessorEditor)
 };
 
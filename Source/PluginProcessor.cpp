@@ -15,15 +15,38 @@
 
 //==============================================================================
 RtconvolveAudioProcessor::RtconvolveAudioProcessor()
- : mSampleRate(0.0)
- , mBufferSize(0)
+ : mState(nullptr)
+ , mFadingState(nullptr)
+ , mCrossfadePosition(0)
+ , mCrossfadeLength(44100 * kCrossfadeMilliseconds / 1000)
+ , mPublishedState(nullptr)
+ , mRetiredQueue(kNumRetiredStates)
+ , mLatency(0)
+ , mLatencyChanged(false)
+ , mNewestState(nullptr)
+ , mGeneration(0)
+ , mSampleRate(0.0)
+ , mBufferSize(DEFAULT_BUFFER_SIZE)
+ , mLatencyBudget(0)
+ , mBackgroundThreadEnabled(false)
  , mImpulseResponseFilePath("")
 {
+    prepareConvolution(true);
     
+    mLoader = new ConvolutionLoader(*this);
+    mLoader->startThread();
 }
 
 RtconvolveAudioProcessor::~RtconvolveAudioProcessor()
 {
+    // Let a preparation in progress finish before anything it uses goes away
+    mLoader = nullptr;
+    cancelPendingUpdate();
+    
+    reclaimRetiredStates();
+    delete mPublishedState.exchange(nullptr);
+    delete mFadingState;
+    delete mState;
 }
 
 //==============================================================================
@@ -81,34 +104,304 @@ void RtconvolveAudioProcessor::changeProgramName (int index, const String& newNa
 
 void RtconvolveAudioProcessor::setImpulseResponse(const AudioSampleBuffer& impulseResponseBuffer, const juce::String pathToImpulse)
 {
-    juce::ScopedLock lock(mLoadingLock);
     mImpulseResponseFilePath = pathToImpulse;
-    AudioSampleBuffer impulseResponse(impulseResponseBuffer);
+    mImpulseResponse = impulseResponseBuffer;
+    prepareConvolution(false);
+}
+
+void RtconvolveAudioProcessor::setLatencyBudget(int numSamples)
+{
+    mLatencyBudget = numSamples;
+    prepareConvolution(false);
+}
+
+void RtconvolveAudioProcessor::setBackgroundThreadEnabled(bool enabled)
+{
+    mBackgroundThreadEnabled = enabled;
+    prepareConvolution(false);
+}
+
+ConvolutionScheduler::Statistics RtconvolveAudioProcessor::getBackgroundStatistics() const
+{
+    juce::ScopedLock lock(mStateLock);
+    
+    return mNewestState->manager->getBackgroundStatistics();
+}
+
+ImpulseResponseTrim RtconvolveAudioProcessor::getImpulseResponseTrim() const
+{
+    juce::ScopedLock lock(mStateLock);
+    
+    return mNewestState->manager->getImpulseResponseTrim();
+}
+
+void RtconvolveAudioProcessor::prepareConvolution(bool synchronously)
+{
+    ConvolutionSettings settings;
+    settings.impulseResponse = mImpulseResponse;
+    settings.bufferSize = mBufferSize;
+    settings.latencyBudget = mLatencyBudget;
+    settings.backgroundThreadEnabled = mBackgroundThreadEnabled;
+    
+    // A state built synchronously, or for offline rendering, must convolve the whole
+    // impulse response from its first block
+    settings.progressive = ! synchronously && ! isNonRealtime();
     
-    if (impulseResponseBuffer.getNumChannels() == 2)
+    const int generation = ++mGeneration;
+    
+    if (synchronously)
+    {
+        installConvolutionState(createConvolutionState(settings));
+    }
+    else
+    {
+        mLoader->load(settings, generation);
+    }
+}
+
+RtconvolveAudioProcessor::ConvolutionState *RtconvolveAudioProcessor::createConvolutionState(const ConvolutionSettings &settings)
+{
+    juce::ScopedPointer<ConvolutionState> state = new ConvolutionState();
+    AudioSampleBuffer impulseResponse(settings.impulseResponse);
+    const int numSamples = impulseResponse.getNumSamples();
+    const float *impulseResponses[4] = { nullptr, nullptr, nullptr, nullptr };
+    ConvolutionMatrix matrix = ConvolutionMatrix::diagonal(2);
+    
+    if (impulseResponse.getNumChannels() == 4)
+    {
+        // A true stereo impulse response: the paths LL, LR, RL and RR
+        normalizeTrueStereoImpulseResponse(impulseResponse.getArrayOfWritePointers(), numSamples);
+        
+        for (int path = 0; path < 4; ++path)
+        {
+            impulseResponses[path] = impulseResponse.getReadPointer(path);
+        }
+        matrix = ConvolutionMatrix::full(2, 2);
+    }
+    else if (impulseResponse.getNumChannels() == 2)
     {
         float *impulseResponseLeft = impulseResponse.getWritePointer(0);
         float *impulseResponseRight = impulseResponse.getWritePointer(1);
         
-        normalizeStereoImpulseResponse(impulseResponseLeft, impulseResponseRight, impulseResponse.getNumSamples());
-        mConvolutionManager[0].setImpulseResponse(impulseResponseLeft, impulseResponse.getNumSamples());
-        mConvolutionManager[1].setImpulseResponse(impulseResponseRight, impulseResponse.getNumSamples());
+        normalizeStereoImpulseResponse(impulseResponseLeft, impulseResponseRight, numSamples);
+        impulseResponses[0] = impulseResponseLeft;
+        impulseResponses[1] = impulseResponseRight;
     }
-    else
+    else if (impulseResponse.getNumChannels() != 0)
     {
         float *ir = impulseResponse.getWritePointer(0);
         
-        normalizeMonoImpulseResponse(ir, impulseResponse.getNumSamples());
-        mConvolutionManager[0].setImpulseResponse(ir, impulseResponse.getNumSamples());
-        mConvolutionManager[1].setImpulseResponse(ir, impulseResponse.getNumSamples());
+        normalizeMonoImpulseResponse(ir, numSamples);
+        impulseResponses[0] = ir;
+        impulseResponses[1] = ir;
+    }
+    
+    state->manager = new ConvolutionManager<float>(matrix, (impulseResponses[0] != nullptr) ? impulseResponses : nullptr, numSamples,
+                                                   settings.bufferSize, settings.latencyBudget,
+                                                   settings.backgroundThreadEnabled, settings.progressive);
+    
+    return state.release();
+}
+
+void RtconvolveAudioProcessor::publishConvolutionState(ConvolutionState *state, int generation)
+{
+    // Whichever state is dropped is deleted once the lock is released
+    juce::ScopedPointer<ConvolutionState> dropped;
+    
+    {
+        juce::ScopedLock lock(mStateLock);
+        
+        if (generation != mGeneration)
+        {
+            dropped = state;
+        }
+        else
+        {
+            dropped = mPublishedState.exchange(state, std::memory_order_release);
+            mNewestState = state;
+        }
+    }
+}
+
+void RtconvolveAudioProcessor::installConvolutionState(ConvolutionState *state)
+{
+    const juce::ScopedLock callbackLock(getCallbackLock());
+    juce::ScopedLock lock(mStateLock);
+    
+    reclaimRetiredStates();
+    delete mPublishedState.exchange(nullptr);
+    delete mFadingState;
+    delete mState;
+    
+    mFadingState = nullptr;
+    mState = state;
+    mNewestState = state;
+    
+    // The block size, and with it the latency, depends on the length of the impulse response
+    mLatency = mState->manager->getLatency();
+    mLatencyChanged = false;
+    setLatencySamples(mLatency);
+}
+
+void RtconvolveAudioProcessor::takePublishedState()
+{
+    if (mFadingState != nullptr || mPublishedState.load(std::memory_order_relaxed) == nullptr)
+        return;
+    
+    // If the loader has fallen behind with deleting retired states, keep this one for now
+    if (mRetiredQueue.getFreeSpace() == 0)
+        return;
+    
+    ConvolutionState *state = mPublishedState.exchange(nullptr, std::memory_order_acquire);
+    
+    if (state == nullptr)
+        return;
+    
+    if (state->manager->getLatency() == mState->manager->getLatency())
+    {
+        mFadingState = mState;
+        mCrossfadePosition = 0;
+    }
+    else
+    {
+        // Outputs that are not aligned in time can't be crossfaded: switch at once
+        retireState(mState);
+    }
+    mState = state;
+}
+
+void RtconvolveAudioProcessor::retireState(ConvolutionState *state)
+{
+    // The loader thread deletes the old state, away from the audio thread
+    int start1, size1, start2, size2;
+    mRetiredQueue.prepareToWrite(1, start1, size1, start2, size2);
+    jassert(size1 == 1);
+    mRetiredStates[start1] = state;
+    mRetiredQueue.finishedWrite(1);
+}
+
+void RtconvolveAudioProcessor::updateLatency()
+{
+    if (mLatencyChanged.exchange(false, std::memory_order_acquire))
+    {
+        triggerAsyncUpdate();
+    }
+}
+
+void RtconvolveAudioProcessor::handleAsyncUpdate()
+{
+    setLatencySamples(mLatency.load(std::memory_order_relaxed));
+}
+
+void RtconvolveAudioProcessor::reclaimRetiredStates()
+{
+    juce::ScopedLock lock(mStateLock);
+    int start1, size1, start2, size2;
+    
+    for (;;)
+    {
+        mRetiredQueue.prepareToRead(1, start1, size1, start2, size2);
+        
+        if (size1 == 0)
+            break;
+        
+        delete mRetiredStates[start1];
+        mRetiredQueue.finishedRead(1);
+    }
+}
+
+//==============================================================================
+RtconvolveAudioProcessor::ConvolutionLoader::ConvolutionLoader(RtconvolveAudioProcessor &processor)
+ : juce::Thread("RTConvolve loader")
+ , mProcessor(processor)
+ , mGeneration(0)
+ , mPending(false)
+{
+}
+
+RtconvolveAudioProcessor::ConvolutionLoader::~ConvolutionLoader()
+{
+    stopThread(-1);
+}
+
+void RtconvolveAudioProcessor::ConvolutionLoader::load(const ConvolutionSettings &settings, int generation)
+{
+    {
+        juce::ScopedLock lock(mLock);
+        mSettings = settings;
+        mGeneration = generation;
+        mPending = true;
+    }
+    notify();
+}
+
+void RtconvolveAudioProcessor::ConvolutionLoader::run()
+{
+    while (! threadShouldExit())
+    {
+        ConvolutionSettings settings;
+        int generation = 0;
+        bool pending;
+        
+        {
+            juce::ScopedLock lock(mLock);
+            pending = mPending;
+            
+            if (pending)
+            {
+                settings = mSettings;
+                generation = mGeneration;
+                mPending = false;
+            }
+        }
+        
+        if (pending)
+        {
+            mProcessor.publishConvolutionState(createConvolutionState(settings), generation);
+        }
+        
+        mProcessor.reclaimRetiredStates();
+        mProcessor.updateLatency();
+        
+        if (! pending)
+        {
+            wait(kReclaimIntervalMilliseconds);
+        }
     }
 }
 
 //==============================================================================
 void RtconvolveAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
-    mConvolutionManager[0].setBufferSize(samplesPerBlock);
-    mConvolutionManager[1].setBufferSize(samplesPerBlock);
+    mSampleRate = sampleRate;
+    mBufferSize = samplesPerBlock;
+    mCrossfadeLength = std::max(1, (int) (sampleRate * kCrossfadeMilliseconds / 1000));
+
+    // The partition planner's measurements of this machine are kept between launches
+    PartitionPlanner<float> &planner = PartitionPlanner<float>::getInstance();
+    juce::File measurementsFile = getPartitionMeasurementsFile();
+    
+    if (measurementsFile.existsAsFile())
+    {
+        planner.setMeasurements(measurementsFile.loadFileAsString().toStdString());
+    }
+    
+    // Any block size works: the convolution managers reblock to a power of two internally,
+    // at the cost of some latency if the block size isn't a multiple of it. The host waits
+    // for this, so the managers are ready, and the latency known, when playback starts.
+    prepareConvolution(true);
+    
+    if (measurementsFile.create().wasOk())
+    {
+        measurementsFile.replaceWithText(juce::String(planner.getMeasurements()));
+    }
+}
+
+juce::File RtconvolveAudioProcessor::getPartitionMeasurementsFile()
+{
+    return juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory)
+        .getChildFile("RTConvolve")
+        .getChildFile("PartitionMeasurements.txt");
 }
 
 void RtconvolveAudioProcessor::releaseResources()
@@ -148,28 +441,74 @@ void RtconvolveAudioProcessor::processBlock (AudioSampleBuffer& buffer, MidiBuff
     for (int i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
     
-    juce::ScopedTryLock tryLock(mLoadingLock);
+    // Switch to a newly prepared impulse response, if there is one, without taking a lock
+    takePublishedState();
+    
+    ConvolutionManager<float> *manager = mState->manager;
+    const int numChannels = std::min(buffer.getNumChannels(), manager->getNumOutputs());
     
-    if (tryLock.isLocked())
+    if (numChannels == 0)
+        return;
+    
+    // Hosts may pass fewer samples than announced in prepareToPlay(), or occasionally more
+    for (int start = 0; start < buffer.getNumSamples(); start += mBufferSize)
     {
-        for (int channel = 0; channel < 1; ++channel)
+        const int numSamples = std::min(mBufferSize, buffer.getNumSamples() - start);
+        
+        // Both channels are convolved together; a mono bus feeds its channel to both
+        const float* inputs[2];
+        
+        for (int channel = 0; channel < 2; ++channel)
+        {
+            inputs[channel] = buffer.getReadPointer(std::min(channel, numChannels - 1), start);
+        }
+        
+        if (mFadingState != nullptr)
+        {
+            // Both impulse responses convolve the same input while the new one fades in
+            ConvolutionManager<float> *fading = mFadingState->manager;
+            fading->processInput(inputs, numSamples);
+            manager->processInput(inputs, numSamples);
+            
+            for (int channel = 0; channel < numChannels; ++channel)
+            {
+                float* channelData = buffer.getWritePointer(channel, start);
+                const float* y = manager->getOutputBuffer(channel);
+                const float* yFading = fading->getOutputBuffer(channel);
+                
+                for (int i = 0; i < numSamples; ++i)
+                {
+                    const float gain = std::min(1.0f, float(mCrossfadePosition + i) / mCrossfadeLength);
+                    channelData[i] = yFading[i] + gain * (y[i] - yFading[i]);
+                }
+            }
+            
+            mCrossfadePosition += numSamples;
+            
+            if (mCrossfadePosition >= mCrossfadeLength)
+            {
+                retireState(mFadingState);
+                mFadingState = nullptr;
+            }
+        }
+        else
         {
-            float* channelData = buffer.getWritePointer (channel);
-            mConvolutionManager[channel].processInput(channelData);
-            const float* y = mConvolutionManager[channel].getOutputBuffer();
-            memcpy(channelData, y, buffer.getNumSamples() * sizeof(float));
+            manager->processInput(inputs, numSamples);
             
-            if (buffer.getNumChannels() == 2)
+            for (int channel = 0; channel < numChannels; ++channel)
             {
-                float *channelDataR = buffer.getWritePointer(1);
-                const float* y = mConvolutionManager[0].getOutputBuffer();
-                memcpy(channelDataR, y, buffer.getNumSamples() * sizeof(float));
+                memcpy(buffer.getWritePointer(channel, start), manager->getOutputBuffer(channel), numSamples * sizeof(float));
             }
         }
     }
-    else
+    
+    // The latency changes with the state, and grows if a block turns out not to be a
+    // multiple of the internal block size. setLatencySamples() locks, so the loader has
+    // it reported from the message thread.
+    if (manager->getLatency() != mLatency.load(std::memory_order_relaxed))
     {
-        buffer.clear();
+        mLatency.store(manager->getLatency(), std::memory_order_relaxed);
+        mLatencyChanged.store(true, std::memory_order_release);
     }
 }
 
@@ -189,6 +528,8 @@ void RtconvolveAudioProcessor::getStateInformation (MemoryBlock& destData)
 {
     XmlElement xml("STATEINFO");
     xml.setAttribute("impulseResponseFilePath", mImpulseResponseFilePath);
+    xml.setAttribute("latencyBudget", mLatencyBudget);
+    xml.setAttribute("backgroundThread", mBackgroundThreadEnabled);
     copyXmlToBinary(xml, destData);
 }
 
@@ -196,6 +537,9 @@ void RtconvolveAudioProcessor::setStateInformation (const void* data, int sizeIn
 {
     juce::ScopedPointer<XmlElement> xml(getXmlFromBinary(data, sizeInBytes));
 
+    setLatencyBudget(xml->getIntAttribute("latencyBudget", 0));
+    setBackgroundThreadEnabled(xml->getBoolAttribute("backgroundThread", false));
+    
     String impulseResponseFilePath = xml->getStringAttribute("impulseResponseFilePath", "");
     juce::File ir(impulseResponseFilePath);
     AudioFormatManager manager;
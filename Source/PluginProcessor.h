@@ -19,7 +19,8 @@
 //==============================================================================
 /**
 */
-class RtconvolveAudioProcessor  : public AudioProcessor
+class RtconvolveAudioProcessor  : public AudioProcessor,
+                                  private AsyncUpdater
 {
 public:
     //==============================================================================
@@ -59,13 +60,178 @@ public:
     void setStateInformation (const void* data, int sizeInBytes) override;
 
     //================= CUSTOM =======================
+    /**
+     Convolve with a new impulse response, mono or stereo. The impulse response is
+     prepared on a background thread, and the previous one stays in use until it is
+     ready: this returns at once.
+     */
     void setImpulseResponse(const AudioSampleBuffer& impulseResponseBuffer, const juce::String pathToImpulse = "");
+    
+    /**
+     Allow up to 'numSamples' samples of latency, compensated by the host, in exchange
+     for a lower CPU load (see ConvolutionManager::setLatencyBudget()). The resulting
+     latency is reported to the host once the convolution has been prepared again in
+     the background and the audio thread has switched to it.
+     */
+    void setLatencyBudget(int numSamples);
+    int getLatencyBudget() const { return mLatencyBudget; }
+    
+    /**
+     Compute the long tail of the impulse response on the background threads shared by
+     every instance in the process (off by default).
+     */
+    void setBackgroundThreadEnabled(bool enabled);
+    bool isBackgroundThreadEnabled() const { return mBackgroundThreadEnabled; }
+    
+    /**
+     @returns
+        The work done for this instance, both channels, on the background threads.
+        ConvolutionScheduler::getInstance().getStatistics() has the whole pool's.
+     */
+    ConvolutionScheduler::Statistics getBackgroundStatistics() const;
+    
+    /**
+     @returns
+        Where the newest impulse response, in use or about to be, was trimmed, and how
+        many partitions that saved (see ConvolutionManager::getImpulseResponseTrim()).
+     */
+    ImpulseResponseTrim getImpulseResponseTrim() const;
 private:
-//    juce::ScopedPointer<ConvolutionManager<float> > mConvolutionManager[2];
-    ConvolutionManager<float> mConvolutionManager[2];
-    juce::CriticalSection mLoadingLock;
+    /** Everything the convolution managers are built from */
+    struct ConvolutionSettings
+    {
+        /** As loaded, before normalization. No channels for a unit impulse. */
+        AudioSampleBuffer impulseResponse;
+        int bufferSize;
+        int latencyBudget;
+        bool backgroundThreadEnabled;
+        
+        /** Whether the state goes into use before the whole impulse response is prepared */
+        bool progressive;
+    };
+    
+    /**
+     The convolution of the left and right channels, each with its own channel of the
+     impulse response, by one two-channel manager. Never changed once built.
+     */
+    struct ConvolutionState
+    {
+        juce::ScopedPointer<ConvolutionManager<float> > manager;
+    };
+    
+    /**
+     Builds the convolution state for the most recent settings passed to load() on a
+     thread of its own, and publishes it. Settings superseded before their turn are
+     skipped. In between, it deletes the states the audio thread has retired, and
+     passes on changes of its latency.
+     */
+    class ConvolutionLoader : public juce::Thread
+    {
+    public:
+        ConvolutionLoader(RtconvolveAudioProcessor &processor);
+        ~ConvolutionLoader();
+        
+        void load(const ConvolutionSettings &settings, int generation);
+        void run() override;
+        
+    private:
+        /** How often retired states are deleted, when there is nothing to load */
+        enum { kReclaimIntervalMilliseconds = 100 };
+        
+        RtconvolveAudioProcessor &mProcessor;
+        juce::CriticalSection mLock;
+        ConvolutionSettings mSettings;
+        int mGeneration;
+        bool mPending;
+    };
+    
+    /** The length of the crossfade from one convolution state to the next */
+    enum { kCrossfadeMilliseconds = 50 };
+    
+    /** The number of retired states that can wait for the loader to delete them */
+    enum { kNumRetiredStates = 8 };
+    
+    /** File in which the partition planner's measurements of this machine are kept. */
+    static juce::File getPartitionMeasurementsFile();
+    
+    /**
+     Build the convolution state for the current settings: on the calling thread if
+     'synchronously', replacing the current state at once, otherwise in the
+     background, to be crossfaded to.
+     */
+    void prepareConvolution(bool synchronously);
+    
+    /**
+     Build the convolution manager for 'settings'. A mono impulse response is used for
+     both channels. The impulse response is transformed on all cores (see
+     ConvolutionScheduler::parallelFor()). If the settings are progressive, only its
+     head is, and the rest follows in the background once the state is in use (see
+     ConvolutionManager::setProgressiveActivationEnabled()).
+     */
+    static ConvolutionState *createConvolutionState(const ConvolutionSettings &settings);
+    
+    /**
+     Hand a new state to the audio thread, unless it has been superseded by a newer
+     generation in the meantime. A state published earlier that the audio thread has
+     not taken yet is deleted.
+     */
+    void publishConvolutionState(ConvolutionState *state, int generation);
+    
+    /** Replace the current state at once, while the audio thread is stopped. */
+    void installConvolutionState(ConvolutionState *state);
+    
+    /**
+     On the audio thread: if a published state is waiting, and the previous crossfade
+     is over, start crossfading to it, or switch to it at once if its latency differs
+     from the current state's.
+     */
+    void takePublishedState();
+    
+    /** On the audio thread: pass a state that is no longer used to the loader to delete. */
+    void retireState(ConvolutionState *state);
+    
+    /** Delete the states retired by the audio thread. Not on the audio thread. */
+    void reclaimRetiredStates();
+    
+    /**
+     If the audio thread has changed the latency, have it reported to the host from the
+     message thread, see handleAsyncUpdate(). Not on the audio thread.
+     */
+    void updateLatency();
+    
+    /** Report the audio thread's latency to the host, on the message thread. */
+    void handleAsyncUpdate() override;
+    
+    /*
+     The states are handed over read-copy-update style: the audio thread takes a
+     published state from mPublishedState, crossfades to it from mState, then passes
+     the old state back through mRetiredQueue for the loader to delete. The audio
+     thread never locks, allocates or deletes anything, and never waits. Nor does it
+     report its latency to the host itself: it stores it in mLatency and raises
+     mLatencyChanged, and the loader has it reported from the message thread.
+     */
+    ConvolutionState *mState;                       // Audio thread
+    ConvolutionState *mFadingState;                 // Audio thread
+    int mCrossfadePosition;                         // Audio thread
+    int mCrossfadeLength;
+    std::atomic<ConvolutionState *> mPublishedState;
+    juce::AbstractFifo mRetiredQueue;
+    ConvolutionState *mRetiredStates[kNumRetiredStates];
+    std::atomic<int> mLatency;
+    std::atomic<bool> mLatencyChanged;
+    
+    /* The newest state, published or in use, for the other threads to query. Only
+       retired, and so deleted, once a newer one is published. */
+    ConvolutionState *mNewestState;
+    juce::CriticalSection mStateLock;
+    
+    AudioSampleBuffer mImpulseResponse;
+    std::atomic<int> mGeneration;
+    juce::ScopedPointer<ConvolutionLoader> mLoader;
     float mSampleRate;
     int mBufferSize;
+    int mLatencyBudget;
+    bool mBackgroundThreadEnabled;
     juce::String mImpulseResponseFilePath;
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (RtconvolveAudioProcessor)
@@ -0,0 +1,114 @@
+//
+//  SampleDelayLine.h
+//  RTConvolve
+//
+
+#ifndef SampleDelayLine_h
+#define SampleDelayLine_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ConvolutionArena.h"
+#include "util/util.h"
+#include <cstring>
+
+/**
+ A delay of a whole number of samples, for buffers of a fixed size, of one or more
+ channels. This is how the silence at the start of an impulse response is
+ convolved: delaying the input costs two copies per buffer, no matter how long the
+ delay.
+ */
+template <typename FLOAT_TYPE>
+class SampleDelayLine
+{
+public:
+    /**
+     @param delay
+        The delay in samples.
+     @param bufferSize
+        The number of samples in each buffer passed to process().
+     @param numChannels
+        The number of channels delayed together.
+     @param arena
+        The arena to take the ring from, with getArenaSize() bytes to spare for it.
+        nullptr to allocate it on its own.
+     */
+    SampleDelayLine(int delay, int bufferSize, int numChannels = 1, ConvolutionArena *arena = nullptr)
+    : mDelay(delay)
+    , mLength(delay + bufferSize)
+    , mWritePosition(0)
+    {
+        if (arena != nullptr)
+        {
+            arena->allocateBuffer(mRing, numChannels, mLength);
+        }
+        else
+        {
+            mRing.setSize(numChannels, mLength);
+            mRing.clear();
+        }
+    }
+
+    /** @returns The number of bytes the constructor takes from an arena for the same arguments. */
+    static size_t getArenaSize(int delay, int bufferSize, int numChannels = 1)
+    {
+        return ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numChannels, delay + bufferSize);
+    }
+
+    int getDelay() const
+    {
+        return mDelay;
+    }
+
+    /**
+     Write 'numSamples' samples of 'input' to the delay line, and read the
+     'numSamples' samples that were written 'delay' samples earlier into 'output'.
+     'numSamples' must not exceed the 'bufferSize' given to the constructor.
+     'input' and 'output' may be the same buffer.
+     */
+    void process(const FLOAT_TYPE *input, FLOAT_TYPE *output, int numSamples)
+    {
+        process(&input, &output, numSamples);
+    }
+
+    /**
+     Like process() for a single channel, for every channel: 'inputs' and 'outputs'
+     hold one pointer per channel.
+     */
+    void process(const FLOAT_TYPE *const *inputs, FLOAT_TYPE *const *outputs, int numSamples)
+    {
+        int readPosition = mWritePosition - mDelay;
+        if (readPosition < 0)
+            readPosition += mLength;
+
+        const int first = std::min(numSamples, mLength - readPosition);
+
+        for (int channel = 0; channel < mRing.getNumChannels(); ++channel)
+        {
+            FLOAT_TYPE *ring = mRing.getWritePointer(channel);
+            FLOAT_TYPE *output = outputs[channel];
+
+            copy(ring, mWritePosition, inputs[channel], numSamples);
+            memcpy(output, ring + readPosition, first * sizeof(FLOAT_TYPE));
+            memcpy(output + first, ring, (numSamples - first) * sizeof(FLOAT_TYPE));
+        }
+
+        mWritePosition += numSamples;
+        if (mWritePosition >= mLength)
+            mWritePosition -= mLength;
+    }
+
+private:
+    int mDelay;
+    int mLength;
+    int mWritePosition;
+    juce::AudioBuffer<FLOAT_TYPE> mRing;
+
+    void copy(FLOAT_TYPE *ring, int position, const FLOAT_TYPE *input, int numSamples)
+    {
+        const int first = std::min(numSamples, mLength - position);
+        memcpy(ring + position, input, first * sizeof(FLOAT_TYPE));
+        memcpy(ring, input + first, (numSamples - first) * sizeof(FLOAT_TYPE));
+    }
+};
+
+#endif /* SampleDelayLine_h */
@@ -10,180 +10,327 @@
 #define TimeDistributedFFTConvolver_h
 
 #include "../JuceLibraryCode/JuceHeader.h"
-#include "RefCountedAudioBuffer.h"
+#include "util/fft.hpp"
+#include "util/complex_mac.hpp"
+#include "FrequencyDomainDelayLine.h"
+#include "ConvolutionScheduler.h"
 
 
 /**
- The TimeDistributedFFTConvolver class computes the convolution of 
- the input with an impulse response using a slightly modified version 
- of the time-distributed fast Fourier Transform described in Jeffrey R. Hurchalla's 
+ The TimeDistributedFFTConvolver class computes the convolution of
+ the input with an impulse response using a generalized version
+ of the time-distributed fast Fourier Transform described in Jeffrey R. Hurchalla's
  paper 'A Time Distributed FFT for Efficient Low Latency Convolution'.
+
+ The work of each partition is spread evenly over C = 2^depth 'base time periods'
+ (host audio buffer size, b samples), so the partition size is C * b. The 2C * b
+ point spectrum of a zero-padded partition is decimated in frequency into C cosets
+ of 2b bins, X(Ck + r). Because the input is real, coset C - r is the complex
+ conjugate of coset r, so only cosets 0 ... C/2 are computed:
+
+    coset 0       a real FFT of 2b points (FFTPlan::rfft()), b + 1 bins
+    coset C/2     an odd-bin FFT of 2b points (FFTPlan::rfft_odd()), b bins
+    coset r       a complex FFT of 2b points, 2b bins, for 0 < r < C/2
+
+ These are computed in C/2 groups, group 0 holding cosets 0 and C/2 and group g
+ coset g, each of which costs about as much as one real FFT of 4b points. In each
+ base time period, the forward transform of one group is computed and half of its
+ bins are multiplied with the impulse response, or the other half is multiplied
+ and its inverse transform computed. The input of a partition is folded into the
+ cosets as it arrives, and the output is recombined from them as it is played out.
+ Every base time period does the same amount of work, but folding and recombining
+ touch all C/2 + 1 cosets each time, so the cost per sample grows linearly with C,
+ and soon outweighs the transforms: keep the depth small (see PartitionLevel::kMaxDepth).
+
  The convolved output will be available at the beginning of the output buffer
- 8 'base time periods' (host audio buffer size) from when the corresponding input 
- was supplied in the call to 'processInput()'. There is therefore an input-output
- delay of eight times the number of samples in one base time period.
- 
+ 2C 'base time periods' from when the corresponding input was supplied in the
+ call to 'processInput()': one partition to collect the input, and one to transform
+ it. With the default depth of 2, that is a partition size of 4b and a delay of 8b.
+
+ Several inputs can be convolved into several outputs at once, as routed by a
+ ConvolutionMatrix. Each input is folded and transformed once, the paths into an
+ output are summed in the frequency domain by the FrequencyDomainDelayLine, and
+ each output is transformed back once.
+
+ Convolvers of the same impulse responses, base time period and depth share their
+ impulse response spectra through the ImpulseSpectrumCache, wherever they are in
+ the process: only the first one transforms them.
+
+ If BLOCK_SIZE is non-zero, the base time period is fixed at compile time: every
+ FFT size, loop bound and index computation is then a constant. Such an object
+ can only be constructed with a 'bufferSize' equal to BLOCK_SIZE. With the
+ default of zero, the base time period is taken from the constructor at runtime.
  */
-template <typename FLOAT_TYPE>
+template <typename FLOAT_TYPE, int BLOCK_SIZE = 0>
 class TimeDistributedFFTConvolver
 {
 public:
-    
-    /**
-     Convenience enum for expressing the state of the object.
-     */
-    enum
-    {
-        kPhase0 = 0,
-        kPhase1,
-        kPhase2,
-        kPhase3,
-        kNumPhases
-    };
-    
+
     /**
      Construct a Time Distributed FFT-based object.
      @param impulseResponse
-        A pointer to a buffer holding the impulse response with which 
+        A pointer to a buffer holding the impulse response with which
         the subsequent input will be convolved.
      @param numSamplesImpulseResponse
         The length in samples of the impulse response.
      @param bufferSize
         The host audio application's audio buffer size, or 'base time period'.
+     @param silenceThresholdDecibels
+        Partitions whose energy is lower than that of the strongest partition by
+        more than this are treated as silent and skipped.
+     @param impulsePrecision
+        The storage format of the impulse response spectra.
+     @param inputPrecision
+        The storage format of the input spectra, see FrequencyDomainDelayLine::create().
+     @param depth
+        The work of each partition is spread over 2^depth base time periods. From
+        1 to 16, though the cost per sample grows linearly with 2^depth.
+     @param prepareInBackground
+        If true, the impulse response partitions are transformed in the background by
+        the ConvolutionScheduler, and each one contributes to the output as soon as it
+        is ready, nothing until then. Otherwise they are all transformed before the
+        constructor returns.
+     @param arena
+        The arena to take the buffers and spectra from, with getArenaSize() bytes to
+        spare for them, which must outlive the convolver. nullptr for an arena of the
+        convolver's own.
      */
-    TimeDistributedFFTConvolver(FLOAT_TYPE *impulseResponse, int numSamplesImpulseResponse, int bufferSize);
-    
+    TimeDistributedFFTConvolver(FLOAT_TYPE *impulseResponse, int numSamplesImpulseResponse, int bufferSize,
+                                double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                                SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                                SpectrumPrecision inputPrecision = kSpectrumFloat,
+                                int depth = 2, bool prepareInBackground = false, ConvolutionArena *arena = nullptr)
+    : TimeDistributedFFTConvolver(ConvolutionMatrix::diagonal(1), &impulseResponse, numSamplesImpulseResponse, bufferSize,
+                                  silenceThresholdDecibels, impulsePrecision, inputPrecision, depth, prepareInBackground, arena)
+    {
+    }
+
+    /**
+     Construct a Time Distributed FFT-based object for several inputs and outputs. The
+     other parameters are as for a single channel.
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param impulseResponses
+        One impulse response of 'numSamplesImpulseResponse' samples per path.
+     */
+    TimeDistributedFFTConvolver(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses,
+                                int numSamplesImpulseResponse,
+                                int bufferSize,
+                                double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                                SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                                SpectrumPrecision inputPrecision = kSpectrumFloat,
+                                int depth = 2, bool prepareInBackground = false, ConvolutionArena *arena = nullptr);
+
+    /**
+     @returns
+        The number of bytes the constructor takes from an arena for the same arguments.
+     */
+    static size_t getArenaSize(const ConvolutionMatrix &matrix, int numSamplesImpulseResponse, int bufferSize,
+                               SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                               SpectrumPrecision inputPrecision = kSpectrumFloat,
+                               int depth = 2, bool prepareInBackground = false);
+
     /**
      Perform one base time period's worth of work for the convolution. The convolved
-     output corresponding to this input will be ready 8 base time periods from when this
+     output corresponding to this input will be ready getDelay() samples from when this
      method is called.
      @param input
         The input is expected to hold a number of samples equal to the 'bufferSize'
         specified in the constructor.
      */
-    void processInput(FLOAT_TYPE *input);
-    
+    void processInput(const FLOAT_TYPE *input)
+    {
+        processInput(&input);
+    }
+
+    /**
+     Perform one base time period's worth of work for the convolution of every
+     input.
+     @param inputs
+        One buffer of 'bufferSize' samples per input.
+     */
+    void processInput(const FLOAT_TYPE *const *inputs);
+
     /**
      Obtain a pointer to one base time period's worth of output samples.
      @returns
-        A pointer to the beginning of the output buffer.
+        A pointer to the beginning of the output buffer of an output.
+     */
+    const FLOAT_TYPE *getOutputBuffer(int output = 0) const
+    {
+        int startIndex = mCurrentPhase * getBaseTimePeriod();
+        return mOutputReal.getReadPointer(output) + startIndex;
+    }
+
+    const ConvolutionMatrix &getMatrix() const
+    {
+        return mDelayLine->getMatrix();
+    }
+
+    /**
+     @returns
+        The spectra of this convolver, e.g. to query their storage size and precision.
      */
-    const FLOAT_TYPE *getOutputBuffer() const
+    const FrequencyDomainDelayLine<FLOAT_TYPE> &getDelayLine() const
+    {
+        return *mDelayLine;
+    }
+
+    /** @returns The number of base time periods over which each partition is spread, 2^depth. */
+    int getNumPhases() const
+    {
+        return mNumPhases;
+    }
+
+    /** @returns The partition size, getNumPhases() base time periods. */
+    int getPartitionSize() const
+    {
+        return mNumPhases * getBaseTimePeriod();
+    }
+
+    /** @returns The delay in samples between the input and its convolved output. */
+    int getDelay() const
     {
-        int startIndex = mCurrentPhase * mNumSamplesBaseTimePeriod;
-        return mOutputReal->getReadPointer(0) + startIndex;
+        return 2 * getPartitionSize();
     }
-    
+
 private:
+    /* The arena the buffers and spectra below are taken from if none was given,
+       declared first to be deleted after everything in it */
+    juce::ScopedPointer<ConvolutionArena> mOwnArena;
+
     int mNumSamplesBaseTimePeriod;
-    juce::ReferenceCountedObjectPtr<RefCountedAudioBuffer<FLOAT_TYPE> > mBuffersReal[3];
-    juce::ReferenceCountedObjectPtr<RefCountedAudioBuffer<FLOAT_TYPE> > mBuffersImag[3];
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mImpulsePartitionsReal;
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mImpulsePartitionsImag;
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mInputReal;
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mInputImag;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutputReal;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutputImag;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mPreviousTail;
+    int mNumPhases;
+    int mNumInputs;
+    int mNumOutputs;
+    int mNumPaths;
+
+    /* The input being collected ('C'), the partition being transformed ('B') and the
+       output being played out ('A'). Each holds, for every input or output channel,
+       one slot of 2b real and 2b imaginary values per computed coset: coset 0 in
+       slot 0, coset r in slot r and coset C/2 in slot C/2. Buffer 'B' transforms the
+       inputs and, once their spectra are stored, receives the outputs' spectra. The
+       three rotate through mBufferStorage. */
+    juce::AudioBuffer<FLOAT_TYPE> *mBuffers[3];
+    juce::AudioBuffer<FLOAT_TYPE> mBufferStorage[3];
+
+    /* Spectra are stored as coset 0, coset C/2, then cosets 1 ... C/2 - 1. */
+    juce::ScopedPointer<FrequencyDomainDelayLine<FLOAT_TYPE> > mDelayLine;
+    juce::AudioBuffer<FLOAT_TYPE> mOutputReal;
+    juce::AudioBuffer<FLOAT_TYPE> mPreviousTail;
+    juce::AudioBuffer<FLOAT_TYPE> mRecombined;
+
+    /* Where the multiply-accumulate writes the spectrum of each output */
+    FLOAT_TYPE **mSpectrumReal;
+    FLOAT_TYPE **mSpectrumImag;
+    juce::ScopedPointer<FFTPlan<FLOAT_TYPE, 2 * BLOCK_SIZE> > mRealFFTPlan;
+    juce::ScopedPointer<FFTPlan<FLOAT_TYPE, 4 * BLOCK_SIZE> > mComplexFFTPlan;
+
+    /* W_C^rm for 0 < r < C/2 and 0 <= m < C, as mFoldReal[r * C + m] + i mFoldImag[r * C + m] */
+    FLOAT_TYPE *mFoldReal;
+    FLOAT_TYPE *mFoldImag;
+
+    /* W_2Cb^rn for 0 < r < C/2 and 0 <= n < 2b, as mCosetReal[r * 2b + n] + i mCosetImag[r * 2b + n] */
+    FLOAT_TYPE *mCosetReal;
+    FLOAT_TYPE *mCosetImag;
 
     int mNumPartitions;
     int mCurrentPhase;
-    int mCurrentInputIndex;
-    
+
+    /* The copy of the impulse response transformed in the background, and the loop
+       transforming it, declared last to be stopped before anything it uses is deleted */
+    juce::AudioBuffer<FLOAT_TYPE> mPendingImpulse;
+    juce::ScopedPointer<ConvolutionScheduler::BackgroundLoop> mPreparation;
+
+    int getBaseTimePeriod() const
+    {
+        return (BLOCK_SIZE != 0) ? BLOCK_SIZE : mNumSamplesBaseTimePeriod;
+    }
+
+    /** The length of a coset, and of each slot of a buffer: 2b */
+    int getCosetSize() const
+    {
+        return 2 * getBaseTimePeriod();
+    }
+
+    int getNumGroups() const
+    {
+        return mNumPhases / 2;
+    }
+
+    FLOAT_TYPE *getSlotReal(juce::AudioBuffer<FLOAT_TYPE> *buffer, int slot, int channel = 0) const
+    {
+        return buffer->getWritePointer(2 * channel) + (slot * getCosetSize());
+    }
+
+    FLOAT_TYPE *getSlotImag(juce::AudioBuffer<FLOAT_TYPE> *buffer, int slot, int channel = 0) const
+    {
+        return buffer->getWritePointer(2 * channel + 1) + (slot * getCosetSize());
+    }
+
+    /**
+     Fold one base time period of input into the cosets of one channel of buffer 'C'.
+     The input of phase p holds the samples n = p * b ... p * b + b - 1 of the partition,
+     which contribute x(n) W_C^rm to coset r at position n mod 2b, where m = n / 2b.
+     */
+    void forwardDecomposition(juce::AudioBuffer<FLOAT_TYPE> *buffer, const FLOAT_TYPE *input, int phase, int channel);
+
     /**
-     Perform the 'decimation in frequency' forward decomposotition work for a quarter of the input.
-     
-     @param rex
-        The real part of the length-N input.
-     @param imx
-        The imaginary part of the length-N input.
-     @param N
-        The length (in samples) of the input. The last N/2 samples are assumed to be
-        a padding of zeros.
-     @param whichQuarter <br />
-        0 - Perform decomposition for 1st quarter of the non-pad input (first half of input buffer) <br />
-        1 - Perform decomposition for 2nd quarter of the non-pad input (first half of input buffer) <br />
-        2 - Perform decomposition for 3rd quarter of the non-pad input (first half of input buffer) <br />
-        3 - Perform decomposition for 4th quarter of the non-pad input (first half of input buffer) <br />
-        Parameter must be one of these four values, or an exception will be thrown.
+     Compute the forward transform of one group of cosets of one channel of a buffer
+     whose input has been completely folded.
      */
-    void forwardDecomposition(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int N, int whichQuarter);
-    
+    void forwardTransform(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int channel);
+
     /**
-     Convenience function to perform the forward decomposition work for all four quarters
-     of the input buffer.
-     
-     @param rex
-     The real part of the length-N input.
-     @param imx
-     The imaginary part of the length-N input.
-     @param N
-     The length (in samples) of the input. The last N/2 samples are assumed to be
-     a padding of zeros.
+     Compute the inverse transform of one group of cosets of one channel, leaving in
+     each slot the signal whose coset it is: for coset r, W_2Cb^-rn times its inverse FFT.
      */
-    void forwardDecompositionComplete(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int N);
-    
+    void inverseTransform(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int channel);
+
     /**
-     Perform the 'decimation in frequency' inverse decomposotition work for a quarter of the input.
-     
-     @param rex
-     The real part of the length-N input.
-     @param imx
-     The imaginary part of the length-N input.
-     @param N
-     The length (in samples) of the input. The last N/2 samples are assumed to be
-     a padding of zeros.
-     @param whichQuarter <br />
-     0 - Perform decomposition for 1st quarter of the non-pad input (first half of input buffer) <br />
-     1 - Perform decomposition for 2nd quarter of the non-pad input (first half of input buffer) <br />
-     2 - Perform decomposition for 3rd quarter of the non-pad input (first half of input buffer) <br />
-     3 - Perform decomposition for 4th quarter of the non-pad input (first half of input buffer) <br />
-     Parameter must be one of these four values, or an exception will be thrown.
+     Write the spectrum of one group of one channel, as computed by forwardTransform(),
+     to impulse response partition 'partition' of the delay line for the path of that
+     index, or to the newest input spectrum of the input of that index if 'partition'
+     is negative.
      */
-    void inverseDecomposition(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int N, int whichQuarter);
-    
+    void storeSpectrum(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int partition, int channel);
+
     /**
-     Convenience function to perform the inverse decomposition work for all four quarters
-     of the input buffer.
-     
-     @param rex
-     The real part of the length-N input.
-     @param imx
-     The imaginary part of the length-N input.
-     @param N
-     The length (in samples) of the input. The last N/2 samples are assumed to be
-     a padding of zeros.
+     Store the spectra of impulse response partitions 'first' ... 'end' - 1 of every
+     path, transformed exactly like the input, and mark them ready, skipping those
+     claimed by another convolver sharing the spectra. Disjoint ranges may be
+     transformed concurrently.
      */
-    void inverseDecompositionComplete(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int N);
-    
+    void transformImpulse(const FLOAT_TYPE *const *impulseResponses, int numSamples, int first, int end);
+
+    /** @returns What the impulse response spectra are computed from, see FrequencyDomainDelayLine::create(). */
+    static ImpulseSpectrumKey getImpulseSpectrumKey(const FLOAT_TYPE *const *impulseResponses, int numSamples, int bufferSize,
+                                                    int depth, int numPaths);
+
     /**
-     Computes complex multiplications in the frequency domain for half of a sub-fft's
-     convolutions.
-     @param subArray <br />
-        0 - the X(2k), ie. 'even' frequency bins
-        1 - the X(2k+1), ie. 'odd' frequency bins
+     Computes complex multiplications in the frequency domain for half of the bins of
+     one group of cosets, for every output.
      @param whichHalf <br />
-        0 - 1st half of 'subArray'.
-        1 - 2nd half of 'subArray'.
+        0 - 1st half of the group's bins (all of coset 0 for group 0).
+        1 - 2nd half of the group's bins (all of coset C/2 for group 0).
      */
-    void performConvolutions(int subArray, int whichHalf);
-    
+    void performConvolutions(int group, int whichHalf);
+
+    /** @returns The position of the first bin of coset 'slot' in a stored spectrum. */
+    int getSpectrumIndex(int slot) const;
+
     /**
      Internal helper function for updating internal data structures for a new phase of the
      overall operation.
      */
     void promoteBuffers();
-    
-    /**
-     Add the previous convolution tail to the output buffer.
-     */
-    void prepareOutput();
-    
+
     /**
-     Custom version of the fast fourier transform in which the frequency bins of the output are arranged
-     in the order needed for frequency domain convolution implemented by this class.
+     Recombine one base time period's worth of the output of one channel from the cosets
+     of buffer 'A', and of the tail of the output that overlaps the next partition, and
+     add the previous convolution tail to the output buffer.
      */
-    void fft_priv(FLOAT_TYPE *rex, FLOAT_TYPE *imx, FLOAT_TYPE *trx, FLOAT_TYPE *tix, int N);
+    void prepareOutput(int channel);
 };
 
 #include "TimeDistributedFFTConvolver.hpp"
@@ -7,391 +7,511 @@
 //
 
 #include "util/util.h"
-#include "util/fft.hpp"
 #include <stdexcept>
+#include <cmath>
 
-static const float TWOPI = 2.0 * M_PI;
-static const float NTWOPI = -2.0 * M_PI;
-
-template <typename FLOAT_TYPE>
-TimeDistributedFFTConvolver<FLOAT_TYPE>::TimeDistributedFFTConvolver(FLOAT_TYPE *impulseResponse, int numSamplesImpulseResponse, int bufferSize)
- : mCurrentPhase(kPhase3)
- , mCurrentInputIndex(0)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::TimeDistributedFFTConvolver(const ConvolutionMatrix &matrix,
+                                                                                 const FLOAT_TYPE *const *impulseResponses,
+                                                                                 int numSamplesImpulseResponse, int bufferSize,
+                                                                                 double silenceThresholdDecibels,
+                                                                                 SpectrumPrecision impulsePrecision,
+                                                                                 SpectrumPrecision inputPrecision,
+                                                                                 int depth, bool prepareInBackground,
+                                                                                 ConvolutionArena *arena)
 {
     mNumSamplesBaseTimePeriod = bufferSize;
-    
-    int partitionSize = 4 * mNumSamplesBaseTimePeriod;
-    
+
     if (isPowerOfTwo(bufferSize) == false)
     {
         throw std::invalid_argument("bufferSize must be a power of 2");
     }
-    
-    mNumPartitions = (numSamplesImpulseResponse / partitionSize) + !!(numSamplesImpulseResponse % partitionSize);
-    
-    for (int i = 0; i < mNumPartitions; ++i)
+
+    if (BLOCK_SIZE != 0 && bufferSize != BLOCK_SIZE)
     {
-        int samplesToCopy = std::min((numSamplesImpulseResponse - (i * partitionSize)), partitionSize);
-        
-        /* Allocate and fill real array */
-        
-        mImpulsePartitionsReal.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize));
-        checkNull(mImpulsePartitionsReal[i]);
-        mImpulsePartitionsReal[i]->clear();
-        
-        FLOAT_TYPE *partition = mImpulsePartitionsReal[i]->getWritePointer(0);
-        memcpy(partition, impulseResponse + (i * partitionSize), samplesToCopy * sizeof(FLOAT_TYPE));
-        
-        /* Allocate imag array */
-        
-        mImpulsePartitionsImag.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize));
-        checkNull(mImpulsePartitionsReal[i]);
-        
-        mImpulsePartitionsImag[i]->clear();
-        FLOAT_TYPE *partitionImag = mImpulsePartitionsImag[i]->getWritePointer(0);
-        
-        FLOAT_TYPE *tempReal = new FLOAT_TYPE[2 * partitionSize];
-        checkNull(tempReal);
-        memset(tempReal, 0, 2 * partitionSize * sizeof(FLOAT_TYPE));
-        
-        FLOAT_TYPE *tempImag = new FLOAT_TYPE[2 * partitionSize];
-        checkNull(tempImag);
-        memset(tempImag, 0, 2 * partitionSize * sizeof(FLOAT_TYPE));
-        
-        /* Calculate transform */
-        fft_priv(partition, partitionImag, tempReal, tempImag, 2 * partitionSize);
-        
-        delete [] tempReal;
-        delete [] tempImag;
-        
-        /* Allocate an input buffer */
-        mInputReal.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize));
-        mInputImag.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize));
-        mInputReal[i]->clear();
-        mInputImag[i]->clear();
+        throw std::invalid_argument("bufferSize must match the BLOCK_SIZE template argument");
     }
-    
-    mOutputReal = new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    checkNull(mOutputReal);
-    mOutputReal->clear();
-    mOutputImag = new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    checkNull(mOutputImag);
-    mOutputImag->clear();
-    
-    mBuffersReal[0] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    mBuffersReal[1] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    mBuffersReal[2] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-
-    mBuffersImag[0] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    mBuffersImag[1] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
-    mBuffersImag[2] = new RefCountedAudioBuffer<FLOAT_TYPE>(1, 2 * partitionSize);
+
+    if (depth < 1 || depth > 16)
+    {
+        throw std::invalid_argument("depth must be between 1 and 16");
+    }
+
+    mNumInputs = matrix.numInputs;
+    mNumOutputs = matrix.numOutputs;
+    mNumPaths = matrix.getNumPaths();
+    mNumPhases = 1 << depth;
+    mCurrentPhase = mNumPhases - 1;
+
+    const int partitionSize = getPartitionSize();
+    const int cosetSize = getCosetSize();
+    const int numGroups = getNumGroups();
+    const int numSlots = numGroups + 1;
+
+    if (arena == nullptr)
+    {
+        mOwnArena = new ConvolutionArena(getArenaSize(matrix, numSamplesImpulseResponse, bufferSize, impulsePrecision,
+                                                      inputPrecision, depth, prepareInBackground));
+        checkNull(mOwnArena);
+        arena = mOwnArena;
+    }
+
+    mRealFFTPlan = new FFTPlan<FLOAT_TYPE, 2 * BLOCK_SIZE>(cosetSize);
+    checkNull(mRealFFTPlan);
+    mComplexFFTPlan = new FFTPlan<FLOAT_TYPE, 4 * BLOCK_SIZE>(2 * cosetSize);
+    checkNull(mComplexFFTPlan);
+
+    /* Twiddle factors of the complex cosets 1 ... C/2 - 1. Row 0 is unused. */
+    const int numTwiddleRows = std::max(numGroups, 1);
+    const int N = 2 * partitionSize;
+    mFoldReal = arena->allocate<FLOAT_TYPE>(numTwiddleRows * mNumPhases);
+    mFoldImag = arena->allocate<FLOAT_TYPE>(numTwiddleRows * mNumPhases);
+    mCosetReal = arena->allocate<FLOAT_TYPE>(numTwiddleRows * cosetSize);
+    mCosetImag = arena->allocate<FLOAT_TYPE>(numTwiddleRows * cosetSize);
+
+    for (int r = 1; r < numGroups; ++r)
+    {
+        for (int m = 0; m < mNumPhases; ++m)
+        {
+            const double angle = -2.0 * M_PI * ((r * m) % mNumPhases) / mNumPhases;
+            mFoldReal[r * mNumPhases + m] = (FLOAT_TYPE)cos(angle);
+            mFoldImag[r * mNumPhases + m] = (FLOAT_TYPE)sin(angle);
+        }
+
+        for (int n = 0; n < cosetSize; ++n)
+        {
+            const double angle = -2.0 * M_PI * (double)(r * n) / N;
+            mCosetReal[r * cosetSize + n] = (FLOAT_TYPE)cos(angle);
+            mCosetImag[r * cosetSize + n] = (FLOAT_TYPE)sin(angle);
+        }
+    }
+
+    mNumPartitions = (numSamplesImpulseResponse / partitionSize) + !!(numSamplesImpulseResponse % partitionSize);
+
+    /* Convolvers of the same impulse responses, base time period and depth share their spectra */
+    const ImpulseSpectrumKey key = getImpulseSpectrumKey(impulseResponses, numSamplesImpulseResponse, bufferSize, depth, mNumPaths);
+    mDelayLine = FrequencyDomainDelayLine<FLOAT_TYPE>::create(mNumPartitions, partitionSize + 1, impulsePrecision, inputPrecision,
+                                                              matrix, arena, &key);
+    checkNull(mDelayLine);
 
     for (int i = 0; i < 3; ++i)
     {
-        mBuffersReal[i]->clear();
-        mBuffersImag[i]->clear();
+        arena->allocateBuffer(mBufferStorage[i], 2 * std::max(mNumInputs, mNumOutputs), numSlots * cosetSize);
+        mBuffers[i] = &mBufferStorage[i];
     }
-    
-    mPreviousTail = new juce::AudioBuffer<FLOAT_TYPE>(1, partitionSize);
-    checkNull(mPreviousTail);
-    mPreviousTail->clear();
+
+    if (! prepareInBackground)
+    {
+        /* The partitions are transformed on all cores, less any another convolver has done */
+        ConvolutionScheduler::getInstance().parallelFor(mNumPartitions, [&](int first, int end)
+        {
+            transformImpulse(impulseResponses, numSamplesImpulseResponse, first, end);
+        });
+        mDelayLine->waitUntilReady();
+    }
+
+    mDelayLine->findActivePartitions(silenceThresholdDecibels);
+
+    arena->allocateBuffer(mOutputReal, mNumOutputs, partitionSize);
+    arena->allocateBuffer(mPreviousTail, mNumOutputs, partitionSize);
+    arena->allocateBuffer(mRecombined, 2, bufferSize);
+
+    mSpectrumReal = arena->allocate<FLOAT_TYPE *>(mNumOutputs);
+    mSpectrumImag = arena->allocate<FLOAT_TYPE *>(mNumOutputs);
+
+    if (prepareInBackground && mDelayLine->getNumReadyPartitions() < mNumPartitions)
+    {
+        /* The caller's impulse responses may be gone by the time a partition's turn comes */
+        const int numSamples = numSamplesImpulseResponse;
+        arena->allocateBuffer(mPendingImpulse, mNumPaths, std::max(numSamples, 1));
+
+        for (int path = 0; path < mNumPaths; ++path)
+        {
+            memcpy(mPendingImpulse.getWritePointer(path), impulseResponses[path], numSamples * sizeof(FLOAT_TYPE));
+        }
+
+        const FLOAT_TYPE *const *irs = mPendingImpulse.getArrayOfReadPointers();
+        mPreparation = new ConvolutionScheduler::BackgroundLoop(ConvolutionScheduler::getInstance(), mNumPartitions,
+                                                                [this, irs, numSamples](int first, int end)
+        {
+            transformImpulse(irs, numSamples, first, end);
+        });
+        checkNull(mPreparation);
+    }
+}
+
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+size_t TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::getArenaSize(const ConvolutionMatrix &matrix, int numSamplesImpulseResponse,
+                                                                         int bufferSize, SpectrumPrecision impulsePrecision,
+                                                                         SpectrumPrecision inputPrecision, int depth,
+                                                                         bool prepareInBackground)
+{
+    const int numPhases = 1 << depth;
+    const int partitionSize = numPhases * bufferSize;
+    const int cosetSize = 2 * bufferSize;
+    const int numGroups = numPhases / 2;
+    const int numTwiddleRows = std::max(numGroups, 1);
+    const int numPartitions = (numSamplesImpulseResponse / partitionSize) + !!(numSamplesImpulseResponse % partitionSize);
+    const int numOutputs = matrix.numOutputs;
+
+    size_t size = FrequencyDomainDelayLine<FLOAT_TYPE>::getArenaSize(numPartitions, partitionSize + 1, impulsePrecision,
+                                                                     inputPrecision, matrix)
+                + (2 * ConvolutionArena::getAllocationSize<FLOAT_TYPE>(numTwiddleRows * numPhases))
+                + (2 * ConvolutionArena::getAllocationSize<FLOAT_TYPE>(numTwiddleRows * cosetSize))
+                + (3 * ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(2 * std::max(matrix.numInputs, numOutputs),
+                                                                             (numGroups + 1) * cosetSize))
+                + (2 * ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, partitionSize))
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(2, bufferSize)
+                + (2 * ConvolutionArena::getAllocationSize<FLOAT_TYPE *>(numOutputs));
+
+    if (prepareInBackground)
+    {
+        size += ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(matrix.getNumPaths(), std::max(numSamplesImpulseResponse, 1));
+    }
+    return size;
+}
+
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+ImpulseSpectrumKey TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::getImpulseSpectrumKey(const FLOAT_TYPE *const *impulseResponses,
+                                                                                             int numSamples, int bufferSize,
+                                                                                             int depth, int numPaths)
+{
+    const char kind[] = "TimeDistributedFFTConvolver";
+    ImpulseSpectrumKey key;
+
+    key.add(kind, sizeof(kind));
+    key.add((int64_t)bufferSize);
+    key.add((int64_t)depth);
+
+    for (int path = 0; path < numPaths; ++path)
+    {
+        key.add(impulseResponses[path], std::max(numSamples, 0) * sizeof(FLOAT_TYPE));
+    }
+    return key;
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::processInput(FLOAT_TYPE *input)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::transformImpulse(const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                                                                           int first, int end)
 {
-    ReferenceCountedObjectPtr<RefCountedAudioBuffer<FLOAT_TYPE> > temp;
-    int partitionSize = 4 * mNumSamplesBaseTimePeriod;
-    mCurrentPhase = trueMod((mCurrentPhase + 1), 4);
-    int Q = mCurrentPhase * mNumSamplesBaseTimePeriod;
-    
-    switch (mCurrentPhase)
+    const int bufferSize = getBaseTimePeriod();
+    const int partitionSize = getPartitionSize();
+    const int numGroups = getNumGroups();
+
+    juce::AudioBuffer<FLOAT_TYPE> partition(1, partitionSize);
+    juce::AudioBuffer<FLOAT_TYPE> temp(2 * std::max(mNumPaths, 1), (numGroups + 1) * getCosetSize());
+    temp.clear();
+
+    for (int i = first; i < end; ++i)
     {
-    case kPhase0:
+        if (! mDelayLine->claimPartition(i))
         {
-            promoteBuffers();
-
-            /* Buffer 'C' */
-            mBuffersReal[2]->clear();
-            mBuffersImag[2]->clear();
-            
-            FLOAT_TYPE *cr = mBuffersReal[2]->getWritePointer(0);
-            memcpy(cr + Q, input, mNumSamplesBaseTimePeriod * sizeof(FLOAT_TYPE));
-            
-            FLOAT_TYPE *ci = mBuffersImag[2]->getWritePointer(0);
-
-            forwardDecomposition(cr, ci, 2 * partitionSize, 0);
-            
-            /* Buffer 'B' */
-            
-            FLOAT_TYPE *br = mBuffersReal[1]->getWritePointer(0);
-            FLOAT_TYPE *bi = mBuffersImag[1]->getWritePointer(0);
-            
-            fft(br, bi, partitionSize); /* X(2k) */
-            
-            FLOAT_TYPE *rex0 = mInputReal[mCurrentInputIndex]->getWritePointer(0);
-            FLOAT_TYPE *imx0 = mInputImag[mCurrentInputIndex]->getWritePointer(0);
-            
-            memcpy(rex0, br, partitionSize * sizeof(FLOAT_TYPE));
-            memcpy(imx0, bi, partitionSize * sizeof(FLOAT_TYPE));
-            
-            performConvolutions(0, 0);  /* Perform first half of convolutions for vector Y(2k) */
-            
-            /* Buffer 'A' */
-            FLOAT_TYPE *ar = mBuffersReal[0]->getWritePointer(0);
-            FLOAT_TYPE *ai = mBuffersImag[0]->getWritePointer(0);
-            
-            inverseDecomposition(ar, ai, 2 * partitionSize, 0);
-            prepareOutput();
-            break;
+            continue;
         }
-        case kPhase1:
+
+        int samplesToCopy = std::min((numSamples - (i * partitionSize)), partitionSize);
+
+        for (int path = 0; path < mNumPaths; ++path)
         {
-            /* Buffer 'C' */
-            FLOAT_TYPE *cr = mBuffersReal[2]->getWritePointer(0);
-            memcpy(cr + Q, input, mNumSamplesBaseTimePeriod * sizeof(FLOAT_TYPE));
-            
-            FLOAT_TYPE *ci = mBuffersImag[2]->getWritePointer(0);
-            forwardDecomposition(cr, ci, 2 * partitionSize, 1);
-
-            /* Buffer 'B' */
-            FLOAT_TYPE *br = mBuffersReal[1]->getWritePointer(0);
-            FLOAT_TYPE *bi = mBuffersImag[1]->getWritePointer(0);
-            performConvolutions(0, 1);
-            ifft(br, bi, partitionSize);    /* Y(2k) sub-ifft */
-            
-            /* Buffer 'A' */
-            FLOAT_TYPE *ar = mBuffersReal[0]->getWritePointer(0);
-            FLOAT_TYPE *ai = mBuffersImag[0]->getWritePointer(0);
-            
-            inverseDecomposition(ar, ai, 2 * partitionSize, 1);
-            prepareOutput();
-            break;
+            partition.clear();
+            memcpy(partition.getWritePointer(0), impulseResponses[path] + (i * partitionSize), samplesToCopy * sizeof(FLOAT_TYPE));
+
+            for (int phase = 0; phase < mNumPhases; ++phase)
+            {
+                forwardDecomposition(&temp, partition.getReadPointer(0) + (phase * bufferSize), phase, path);
+            }
+
+            for (int group = 0; group < numGroups; ++group)
+            {
+                forwardTransform(&temp, group, path);
+                storeSpectrum(&temp, group, i, path);
+            }
         }
-        case kPhase2:
+
+        mDelayLine->setPartitionReady(i);
+    }
+}
+
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::processInput(const FLOAT_TYPE *const *inputs)
+{
+    mCurrentPhase = trueMod((mCurrentPhase + 1), mNumPhases);
+    const int group = mCurrentPhase / 2;
+
+    if (mCurrentPhase == 0)
+    {
+        promoteBuffers();
+    }
+
+    /* Buffer 'C' */
+    for (int input = 0; input < mNumInputs; ++input)
+    {
+        forwardDecomposition(mBuffers[2], inputs[input], mCurrentPhase, input);
+    }
+
+    /* Buffer 'B': each input is transformed once, each output once */
+    if ((mCurrentPhase & 1) == 0)
+    {
+        for (int input = 0; input < mNumInputs; ++input)
         {
-            /* Buffer 'C' */
-            FLOAT_TYPE *cr = mBuffersReal[2]->getWritePointer(0);
-            memcpy(cr + Q, input, mNumSamplesBaseTimePeriod * sizeof(FLOAT_TYPE));
-            
-            FLOAT_TYPE *ci = mBuffersImag[2]->getWritePointer(0);
-            forwardDecomposition(cr, ci, 2 * partitionSize, 2);
-
-            /* Buffer 'B' */
-            FLOAT_TYPE *br = mBuffersReal[1]->getWritePointer(0);
-            FLOAT_TYPE *bi = mBuffersImag[1]->getWritePointer(0);
-            FLOAT_TYPE *rex0 = mInputReal[mCurrentInputIndex]->getWritePointer(0);
-            FLOAT_TYPE *imx0 = mInputImag[mCurrentInputIndex]->getWritePointer(0);
-
-            fft(br + partitionSize, bi + partitionSize, partitionSize);
-            memcpy(rex0 + partitionSize, br + partitionSize, partitionSize * sizeof(FLOAT_TYPE));
-            memcpy(imx0 + partitionSize, bi + partitionSize, partitionSize * sizeof(FLOAT_TYPE));
-            performConvolutions(1, 0);
-            
-            /* Buffer 'A' */
-            FLOAT_TYPE *ar = mBuffersReal[0]->getWritePointer(0);
-            FLOAT_TYPE *ai = mBuffersImag[0]->getWritePointer(0);
-            
-            inverseDecomposition(ar, ai, 2 * partitionSize, 2);
-            prepareOutput();
-            break;
+            forwardTransform(mBuffers[1], group, input);
+            storeSpectrum(mBuffers[1], group, -1, input);
         }
-        case kPhase3:
+        performConvolutions(group, 0);
+    }
+    else
+    {
+        performConvolutions(group, 1);
+
+        for (int output = 0; output < mNumOutputs; ++output)
         {
-            /* Buffer 'C' */
-            FLOAT_TYPE *cr = mBuffersReal[2]->getWritePointer(0);
-            memcpy(cr + Q, input, mNumSamplesBaseTimePeriod * sizeof(FLOAT_TYPE));
-            
-            FLOAT_TYPE *ci = mBuffersImag[2]->getWritePointer(0);
-            forwardDecomposition(cr, ci, 2 * partitionSize, 3);
-
-            /* Buffer 'B' */
-            FLOAT_TYPE *br = mBuffersReal[1]->getWritePointer(0);
-            FLOAT_TYPE *bi = mBuffersImag[1]->getWritePointer(0);
-            performConvolutions(1, 1);
-            ifft(br + partitionSize, bi + partitionSize, partitionSize);    /* Y(2k+1) sub-ifft */
-            
-            /* Buffer 'A' */
-            FLOAT_TYPE *ar = mBuffersReal[0]->getWritePointer(0);
-            FLOAT_TYPE *ai = mBuffersImag[0]->getWritePointer(0);
-
-            inverseDecomposition(ar, ai, 2 * partitionSize, 3);
-            
-            prepareOutput();
-            break;
+            inverseTransform(mBuffers[1], group, output);
         }
     }
+
+    /* Buffer 'A' */
+    for (int output = 0; output < mNumOutputs; ++output)
+    {
+        prepareOutput(output);
+    }
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::prepareOutput()
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::prepareOutput(int channel)
 {
-    FLOAT_TYPE *out = mOutputReal->getWritePointer(0);
-    FLOAT_TYPE *ar = mBuffersReal[0]->getWritePointer(0);
-    FLOAT_TYPE *tail = mPreviousTail->getWritePointer(0);
-    int partitionSize = 4 * mNumSamplesBaseTimePeriod;
-    int startIndex = mCurrentPhase * mNumSamplesBaseTimePeriod;
-    
-    for (int i = 0; i < mNumSamplesBaseTimePeriod; ++i)
+    juce::AudioBuffer<FLOAT_TYPE> *a = mBuffers[0];
+    FLOAT_TYPE *out = mOutputReal.getWritePointer(channel);
+    FLOAT_TYPE *tail = mPreviousTail.getWritePointer(channel);
+    FLOAT_TYPE *head = mRecombined.getWritePointer(0);
+    FLOAT_TYPE *next = mRecombined.getWritePointer(1);
+    const int baseTimePeriod = getBaseTimePeriod();
+    const int numGroups = getNumGroups();
+    const int startIndex = mCurrentPhase * baseTimePeriod;
+    const int offset = (mCurrentPhase & 1) * baseTimePeriod;
+
+    /* Output sample j = n + 2bm, for n < 2b, and sample j + Cb of the next partition's
+       overlap, which falls in block m + C/2:
+       y(j) = (1/C) (w0(n) + (-1)^m v(n) + 2 Re(sum over r of W_C^-rm g_r(n))) */
+    const int m = mCurrentPhase / 2;
+    const int mNext = m + numGroups;
+    const FLOAT_TYPE scale = (FLOAT_TYPE)1 / mNumPhases;
+    const FLOAT_TYPE oddScale = (m & 1) ? -scale : scale;
+    const FLOAT_TYPE oddScaleNext = (mNext & 1) ? -scale : scale;
+
+    const FLOAT_TYPE *w0 = getSlotReal(a, 0, channel) + offset;
+    const FLOAT_TYPE *v = getSlotReal(a, numGroups, channel) + offset;
+
+    for (int i = 0; i < baseTimePeriod; ++i)
+    {
+        head[i] = scale * w0[i] + oddScale * v[i];
+        next[i] = scale * w0[i] + oddScaleNext * v[i];
+    }
+
+    for (int r = 1; r < numGroups; ++r)
+    {
+        const FLOAT_TYPE *gr = getSlotReal(a, r, channel) + offset;
+        const FLOAT_TYPE *gi = getSlotImag(a, r, channel) + offset;
+
+        /* Re(conj(W_C^rm) g) = Re(W) Re(g) + Im(W) Im(g) */
+        const FLOAT_TYPE hr = 2 * scale * mFoldReal[r * mNumPhases + m];
+        const FLOAT_TYPE hi = 2 * scale * mFoldImag[r * mNumPhases + m];
+        const FLOAT_TYPE nr = 2 * scale * mFoldReal[r * mNumPhases + mNext];
+        const FLOAT_TYPE ni = 2 * scale * mFoldImag[r * mNumPhases + mNext];
+
+        for (int i = 0; i < baseTimePeriod; ++i)
+        {
+            head[i] += hr * gr[i] + hi * gi[i];
+            next[i] += nr * gr[i] + ni * gi[i];
+        }
+    }
+
+    for (int i = 0; i < baseTimePeriod; ++i)
     {
         int j = startIndex + i;
-        out[j] = ar[j] + tail[j];
-        tail[j] = ar[j + partitionSize];
+        out[j] = head[i] + tail[j];
+        tail[j] = next[i];
     }
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::promoteBuffers()
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::promoteBuffers()
 {
-    ReferenceCountedObjectPtr<RefCountedAudioBuffer<FLOAT_TYPE> > temp = mBuffersReal[0];
-    mBuffersReal[0] = mBuffersReal[1];
-    mBuffersReal[1] = mBuffersReal[2];
-    mBuffersReal[2] = temp;
-    
-    temp = mBuffersImag[0];
-    mBuffersImag[0] = mBuffersImag[1];
-    mBuffersImag[1] = mBuffersImag[2];
-    mBuffersImag[2] = temp;
-    
-    mCurrentInputIndex = trueMod((mCurrentInputIndex + 1), mNumPartitions);
+    juce::AudioBuffer<FLOAT_TYPE> *temp = mBuffers[0];
+    mBuffers[0] = mBuffers[1];
+    mBuffers[1] = mBuffers[2];
+    mBuffers[2] = temp;
+
+    mDelayLine->advance();
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::forwardDecomposition(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int length, int whichQuarter)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::forwardDecomposition(juce::AudioBuffer<FLOAT_TYPE> *buffer, const FLOAT_TYPE *input, int phase,
+                                                                               int channel)
 {
-    if (whichQuarter > 3)
+    const int baseTimePeriod = getBaseTimePeriod();
+    const int numGroups = getNumGroups();
+    const int m = phase / 2;
+    const int offset = (phase & 1) * baseTimePeriod;
+
+    /* The first block of 2b samples initialises the cosets, later ones add to them */
+    const bool first = (m == 0);
+
+    FLOAT_TYPE *x0 = getSlotReal(buffer, 0, channel) + offset;
+    FLOAT_TYPE *v = getSlotReal(buffer, numGroups, channel) + offset;
+    const FLOAT_TYPE sign = (m & 1) ? -1 : 1;
+
+    for (int i = 0; i < baseTimePeriod; ++i)
     {
-        throw std::invalid_argument("Parameter \"whichQuarter\" must be between 0 and 3");
+        x0[i] = (first ? 0 : x0[i]) + input[i];
+        v[i] = (first ? 0 : v[i]) + sign * input[i];
     }
-    
-    int N = length;
-    FLOAT_TYPE *re = rex;
-    FLOAT_TYPE *im = imx;
-    
-    int N8 = N >> 3;
-    int N2 = N >> 1;
-    int Q = whichQuarter * N8;
-    
-    for (int i = 0; i < N8; ++i)
+
+    for (int r = 1; r < numGroups; ++r)
     {
-        int j = i + Q;
-        FLOAT_TYPE frac = j / (float)N;
-        FLOAT_TYPE zr = cos(TWOPI * frac);  /* Twiddle factor real part */
-        FLOAT_TYPE zi = sin(NTWOPI * frac); /* Twiddle factor imag part */
-        FLOAT_TYPE rea;     /* an real part */
-        FLOAT_TYPE ima;     /* an imag part */
-        FLOAT_TYPE reb;     /* bn real part */
-        FLOAT_TYPE imb;     /* bn imag part */
-        
-        rea = re[j] + re[j+N2];
-        ima = im[j] + im[j+N2];
-        reb = re[j] - re[j+N2];
-        imb = im[j] - im[j+N2];
-        
-        re[j] = rea;
-        im[j] = ima;
-        re[j+N2] = (reb * zr) - (imb * zi);
-        im[j+N2] = (reb * zi) - (imb * zr);
+        FLOAT_TYPE *ur = getSlotReal(buffer, r, channel) + offset;
+        FLOAT_TYPE *ui = getSlotImag(buffer, r, channel) + offset;
+        const FLOAT_TYPE wr = mFoldReal[r * mNumPhases + m];
+        const FLOAT_TYPE wi = mFoldImag[r * mNumPhases + m];
+
+        for (int i = 0; i < baseTimePeriod; ++i)
+        {
+            ur[i] = (first ? 0 : ur[i]) + wr * input[i];
+            ui[i] = (first ? 0 : ui[i]) + wi * input[i];
+        }
     }
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::forwardDecompositionComplete(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int length)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::forwardTransform(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int channel)
 {
-    for (int i = 0; i < 4; ++i)
+    if (group == 0)
     {
-        forwardDecomposition(rex, imx, length, i);
+        const int numGroups = getNumGroups();
+        mRealFFTPlan->rfft(getSlotReal(buffer, 0, channel), getSlotImag(buffer, 0, channel));                     /* X(Ck) */
+        mRealFFTPlan->rfft_odd(getSlotReal(buffer, numGroups, channel), getSlotImag(buffer, numGroups, channel)); /* X(Ck + C/2) */
+        return;
     }
-}
 
+    /* X(Ck + r) is the FFT of W_2Cb^rn times the folded input */
+    const int cosetSize = getCosetSize();
+    FLOAT_TYPE *re = getSlotReal(buffer, group, channel);
+    FLOAT_TYPE *im = getSlotImag(buffer, group, channel);
+    const FLOAT_TYPE *wr = mCosetReal + (group * cosetSize);
+    const FLOAT_TYPE *wi = mCosetImag + (group * cosetSize);
+
+    for (int n = 0; n < cosetSize; ++n)
+    {
+        FLOAT_TYPE xr = re[n];
+        FLOAT_TYPE xi = im[n];
+        re[n] = xr * wr[n] - xi * wi[n];
+        im[n] = xr * wi[n] + xi * wr[n];
+    }
+
+    mComplexFFTPlan->fft(re, im);
+}
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::inverseDecomposition(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int N, int whichQuarter)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::inverseTransform(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int channel)
 {
-    if (whichQuarter > 3)
+    if (group == 0)
     {
-        throw std::invalid_argument("Parameter \"whichQuarter\" must be between 0 and 3");
+        const int numGroups = getNumGroups();
+        mRealFFTPlan->irfft(getSlotReal(buffer, 0, channel), getSlotImag(buffer, 0, channel));
+        mRealFFTPlan->irfft_odd(getSlotReal(buffer, numGroups, channel), getSlotImag(buffer, numGroups, channel));
+        return;
     }
-    
-    FLOAT_TYPE *re = rex;
-    FLOAT_TYPE *im = imx;
-    
-    int N8 = N >> 3;
-    int N2 = N >> 1;
-    int Q = whichQuarter * N8;
-        
-    for (int i = 0; i < N8; ++i)
+
+    const int cosetSize = getCosetSize();
+    FLOAT_TYPE *re = getSlotReal(buffer, group, channel);
+    FLOAT_TYPE *im = getSlotImag(buffer, group, channel);
+    const FLOAT_TYPE *wr = mCosetReal + (group * cosetSize);
+    const FLOAT_TYPE *wi = mCosetImag + (group * cosetSize);
+
+    mComplexFFTPlan->ifft(re, im);
+
+    /* Multiply by conj(W_2Cb^rn) */
+    for (int n = 0; n < cosetSize; ++n)
     {
-        int j = i + Q;
-        FLOAT_TYPE frac = j / (float)N;
-        FLOAT_TYPE twr = cos(TWOPI * frac);
-        FLOAT_TYPE twi = sin(TWOPI * frac);
-        FLOAT_TYPE rea = re[j];
-        FLOAT_TYPE ima = im[j];
-        FLOAT_TYPE reb = (re[j + N2] * twr) - (im[j + N2] * twi);
-        FLOAT_TYPE imb = (re[j + N2] * twi) + (im[j + N2] * twr);
-        re[j] = (rea + reb) * 0.5;
-        im[j] = (ima + imb) * 0.5;
-        re[j+N2] = (rea - reb) * 0.5;
-        im[j+N2] = (ima - imb) * 0.5;
+        FLOAT_TYPE zr = re[n];
+        FLOAT_TYPE zi = im[n];
+        re[n] = zr * wr[n] + zi * wi[n];
+        im[n] = zi * wr[n] - zr * wi[n];
     }
 }
 
-
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::inverseDecompositionComplete(FLOAT_TYPE *rex, FLOAT_TYPE *imx, int length)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+int TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::getSpectrumIndex(int slot) const
 {
-    for (int i = 0; i < 4; ++i)
+    const int baseTimePeriod = getBaseTimePeriod();
+
+    if (slot == 0)
+    {
+        return 0;
+    }
+
+    if (slot == getNumGroups())
     {
-        inverseDecomposition(rex, imx, length, i);
+        return baseTimePeriod + 1;
     }
+
+    return (2 * baseTimePeriod + 1) + ((slot - 1) * getCosetSize());
 }
 
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::performConvolutions(int subArray, int whichHalf)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::storeSpectrum(juce::AudioBuffer<FLOAT_TYPE> *buffer, int group, int partition, int channel)
 {
-    int N = 2 * mNumSamplesBaseTimePeriod;
-    int startIndex = (subArray * 2 * N) + (whichHalf * N);
-
-    FLOAT_TYPE *rex = nullptr;
-    FLOAT_TYPE *imx = nullptr;
-    
-    FLOAT_TYPE *rey = mBuffersReal[1]->getWritePointer(0) + startIndex;
-    FLOAT_TYPE *imy = mBuffersImag[1]->getWritePointer(0) + startIndex;
-    FLOAT_TYPE *reh = nullptr;
-    FLOAT_TYPE *imh = nullptr;
-    
-    memset(rey, 0, N * sizeof(FLOAT_TYPE));
-    memset(imy, 0, N * sizeof(FLOAT_TYPE));
-    
-    for (int i = 0; i < mNumPartitions; ++i)
+    const int baseTimePeriod = getBaseTimePeriod();
+    const int numGroups = getNumGroups();
+
+    /* The slots of the group and their number of bins */
+    const int slots[2] = { group, numGroups };
+    const int numBins[2] = { (group == 0) ? (baseTimePeriod + 1) : getCosetSize(), baseTimePeriod };
+    const int numSlots = (group == 0) ? 2 : 1;
+
+    for (int i = 0; i < numSlots; ++i)
     {
-        int k = trueMod((mCurrentInputIndex - i), mNumPartitions);
-       
-        rex = mInputReal[k]->getWritePointer(0) + startIndex;
-        imx = mInputImag[k]->getWritePointer(0) + startIndex;
-        reh = mImpulsePartitionsReal[i]->getWritePointer(0) + startIndex;
-        imh = mImpulsePartitionsImag[i]->getWritePointer(0) + startIndex;
-
-        for (int j = 0; j < N; ++j)
+        const FLOAT_TYPE *re = getSlotReal(buffer, slots[i], channel);
+        const FLOAT_TYPE *im = getSlotImag(buffer, slots[i], channel);
+        const int spectrumIndex = getSpectrumIndex(slots[i]);
+
+        if (partition < 0)
         {
-            rey[j] += (rex[j] * reh[j]) - (imx[j] * imh[j]);
-            imy[j] += (rex[j] * imh[j]) + (imx[j] * reh[j]);
+            mDelayLine->setNewestInput(spectrumIndex, re, im, numBins[i], channel);
+        }
+        else
+        {
+            mDelayLine->setImpulse(partition, spectrumIndex, re, im, numBins[i], channel);
         }
     }
 }
 
-/**
- This function computes the FFT with the frequency domain bins arranged in
- the specific order needed for the frequency domain convolutions 
- */
-template <typename FLOAT_TYPE>
-void TimeDistributedFFTConvolver<FLOAT_TYPE>::fft_priv(FLOAT_TYPE *rex, FLOAT_TYPE *imx, FLOAT_TYPE *trx, FLOAT_TYPE *tix, int N)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::performConvolutions(int group, int whichHalf)
 {
-    forwardDecompositionComplete(rex, imx, N);
-    int N2 = N >> 1;
-    
-    fft(rex, imx, N2);
-    fft(rex+N2, imx+N2, N2);
-}
+    const int baseTimePeriod = getBaseTimePeriod();
+    juce::AudioBuffer<FLOAT_TYPE> *b = mBuffers[1];
+    int slot, startBin, numBins;
+
+    if (group == 0)
+    {
+        /* Coset 0, then coset C/2 */
+        slot = (whichHalf == 0) ? 0 : getNumGroups();
+        startBin = 0;
+        numBins = (whichHalf == 0) ? (baseTimePeriod + 1) : baseTimePeriod;
+    }
+    else
+    {
+        slot = group;
+        startBin = whichHalf * baseTimePeriod;
+        numBins = baseTimePeriod;
+    }
 
+    /* The input spectra are stored, so the outputs' spectra can take their place */
+    for (int output = 0; output < mNumOutputs; ++output)
+    {
+        mSpectrumReal[output] = getSlotReal(b, slot, output) + startBin;
+        mSpectrumImag[output] = getSlotImag(b, slot, output) + startBin;
+    }
+
+    mDelayLine->multiplyAccumulate(mSpectrumReal, mSpectrumImag, getSpectrumIndex(slot) + startBin, numBins);
+}
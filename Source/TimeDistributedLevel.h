@@ -0,0 +1,166 @@
+//
+//  TimeDistributedLevel.h
+//  RTConvolve
+//
+
+#ifndef TimeDistributedLevel_h
+#define TimeDistributedLevel_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "TimeDistributedFFTConvolver.h"
+#include "SampleDelayLine.h"
+#include "PartitionPlanner.h"
+#include "util/util.h"
+
+/**
+ One level of a non-uniformly partitioned convolution, processed one host buffer at
+ a time: the convolution of the inputs with a segment of the impulse responses that
+ starts some way into them, for every path of a ConvolutionMatrix.
+ */
+template <typename FLOAT_TYPE>
+class ConvolutionLevel
+{
+public:
+    virtual ~ConvolutionLevel() {}
+
+    /**
+     Process one host buffer per input. Its contribution to the outputs will appear
+     in the output buffers of this and later calls.
+     */
+    virtual void processInput(const FLOAT_TYPE *const *inputs) = 0;
+
+    /**
+     @returns
+        This level's contribution to an output for the most recent input buffers.
+     */
+    virtual const FLOAT_TYPE *getOutputBuffer(int output) const = 0;
+
+    virtual const FrequencyDomainDelayLine<FLOAT_TYPE> &getDelayLine() const = 0;
+};
+
+/**
+ A ConvolutionLevel computed by a TimeDistributedFFTConvolver whose base time period
+ is the host buffer size, and whose depth spreads the work of each partition over
+ as many buffers as the partition size is a multiple of it.
+
+ The time-distributed convolver delays its output by two partitions. Impulse response
+ segments that start later than this delay get the difference as a SampleDelayLine in
+ front of the convolver.
+
+ If BLOCK_SIZE is non-zero, it is the buffer size, as in TimeDistributedFFTConvolver.
+ */
+template <typename FLOAT_TYPE, int BLOCK_SIZE = 0>
+class TimeDistributedLevel : public ConvolutionLevel<FLOAT_TYPE>
+{
+public:
+    /**
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param impulseResponses
+        For each path, the segment of its impulse response convolved by this level.
+     @param numSamples
+        The length of the segments.
+     @param start
+        The position of the segment in the whole impulse response. It must be at least
+        PartitionLevel::getDelay().
+     @param bufferSize
+        The host audio application's buffer size.
+     @param partitionSize
+        'bufferSize' times a power of two from 2 to 2^PartitionLevel::kMaxDepth.
+     @param prepareInBackground
+        See TimeDistributedFFTConvolver.
+     @param arena
+        The arena to take the buffers and spectra from, with getArenaSize() bytes to
+        spare for them, which must outlive the level. nullptr for an arena of the
+        level's own.
+     */
+    TimeDistributedLevel(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples, int start,
+                         int bufferSize, int partitionSize,
+                         double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                         SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                         SpectrumPrecision inputPrecision = kSpectrumFloat,
+                         bool prepareInBackground = false, ConvolutionArena *arena = nullptr)
+    : mBufferSize(bufferSize)
+    {
+        PartitionLevel level = { partitionSize, 1, true };
+        const int delay = level.getDelay();
+        const int depth = level.getDepth(bufferSize);
+
+        if ((bufferSize << depth) != partitionSize || depth < 1 || depth > PartitionLevel::kMaxDepth || start < delay)
+        {
+            throw std::invalid_argument("The level must start after its delay, with a partition size of 2 to 2^kMaxDepth buffers");
+        }
+
+        if (arena == nullptr)
+        {
+            mOwnArena = new ConvolutionArena(getArenaSize(matrix, numSamples, start, bufferSize, partitionSize, impulsePrecision,
+                                                          inputPrecision, prepareInBackground));
+            checkNull(mOwnArena);
+            arena = mOwnArena;
+        }
+
+        mConvolver = new TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>(matrix, impulseResponses, numSamples, bufferSize,
+                                                                             silenceThresholdDecibels, impulsePrecision, inputPrecision,
+                                                                             depth, prepareInBackground, arena);
+        checkNull(mConvolver);
+
+        if (start > delay)
+        {
+            mInputDelay = new SampleDelayLine<FLOAT_TYPE>(start - delay, bufferSize, matrix.numInputs, arena);
+            checkNull(mInputDelay);
+
+            arena->allocateBuffer(mInput, matrix.numInputs, bufferSize);
+        }
+    }
+
+    /** @returns The number of bytes the constructor takes from an arena for the same arguments. */
+    static size_t getArenaSize(const ConvolutionMatrix &matrix, int numSamples, int start, int bufferSize, int partitionSize,
+                               SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                               SpectrumPrecision inputPrecision = kSpectrumFloat,
+                               bool prepareInBackground = false)
+    {
+        PartitionLevel level = { partitionSize, 1, true };
+        const int delay = level.getDelay();
+
+        size_t size = TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE>::getArenaSize(matrix, numSamples, bufferSize, impulsePrecision,
+                                                                                        inputPrecision, level.getDepth(bufferSize),
+                                                                                        prepareInBackground);
+        if (start > delay)
+        {
+            size += SampleDelayLine<FLOAT_TYPE>::getArenaSize(start - delay, bufferSize, matrix.numInputs)
+                  + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(matrix.numInputs, bufferSize);
+        }
+        return size;
+    }
+
+    void processInput(const FLOAT_TYPE *const *inputs) override
+    {
+        if (mInputDelay != nullptr)
+        {
+            mInputDelay->process(inputs, mInput.getArrayOfWritePointers(), mBufferSize);
+            inputs = mInput.getArrayOfReadPointers();
+        }
+
+        mConvolver->processInput(inputs);
+    }
+
+    const FLOAT_TYPE *getOutputBuffer(int output) const override
+    {
+        return mConvolver->getOutputBuffer(output);
+    }
+
+    const FrequencyDomainDelayLine<FLOAT_TYPE> &getDelayLine() const override
+    {
+        return mConvolver->getDelayLine();
+    }
+
+private:
+    /* Declared first to be deleted after everything in it */
+    juce::ScopedPointer<ConvolutionArena> mOwnArena;
+    int mBufferSize;
+    juce::ScopedPointer<TimeDistributedFFTConvolver<FLOAT_TYPE, BLOCK_SIZE> > mConvolver;
+    juce::ScopedPointer<SampleDelayLine<FLOAT_TYPE> > mInputDelay;
+    juce::AudioBuffer<FLOAT_TYPE> mInput;
+};
+
+#endif /* TimeDistributedLevel_h */
@@ -11,12 +11,30 @@
 
 #include <stdio.h>
 #include "../JuceLibraryCode/JuceHeader.h"
+#include "util/fft.hpp"
+#include "util/complex_mac.hpp"
+#include "FrequencyDomainDelayLine.h"
+#include "ConvolutionScheduler.h"
 
 /**
  The UPConvolver class computes the convolution via FFT of the input 
  with some impulse response using the uniform-partition method.
+ 
+ It can convolve several inputs into several outputs at once, as routed by a
+ ConvolutionMatrix. Each input is transformed once, whatever the number of paths it
+ feeds, the paths into an output are summed in the frequency domain by the
+ FrequencyDomainDelayLine, and each output is transformed back once.
+ 
+ Convolvers of the same impulse responses at the same buffer size share their
+ impulse response spectra through the ImpulseSpectrumCache, wherever they are in
+ the process: only the first one transforms them.
+ 
+ If BLOCK_SIZE is non-zero, the buffer size is fixed at compile time: every
+ FFT size, loop bound and index computation is then a constant. Such an object
+ can only be constructed with a 'bufferSize' equal to BLOCK_SIZE. With the
+ default of zero, the buffer size is taken from the constructor at runtime.
  */
-template <typename FLOAT_TYPE>
+template <typename FLOAT_TYPE, int BLOCK_SIZE = 0>
 class UPConvolver
 {
 public:
@@ -33,8 +51,54 @@ public:
         The maximum number of partitions to use. If the full impulse response
         requires a number of partions greater than 'maxPartitions', only the first
         'maxPartitions' sections of the IR will be used.
+     @param silenceThresholdDecibels
+        Partitions whose energy is lower than that of the strongest partition by
+        more than this are treated as silent and skipped.
+     @param impulsePrecision
+        The storage format of the impulse response spectra.
+     @param inputPrecision
+        The storage format of the input spectra, see FrequencyDomainDelayLine::create().
+     @param prepareInBackground
+        If true, the impulse response partitions are transformed in the background by
+        the ConvolutionScheduler, and each one contributes to the output as soon as it
+        is ready, nothing until then. Otherwise they are all transformed before the
+        constructor returns.
+     @param arena
+        The arena to take the buffers and spectra from, with getArenaSize() bytes to
+        spare for them, which must outlive the convolver. nullptr for an arena of the
+        convolver's own.
      */
-    UPConvolver(FLOAT_TYPE *impulseResponse, int numSamples, int bufferSize, int maxPartitions);
+    UPConvolver(FLOAT_TYPE *impulseResponse, int numSamples, int bufferSize, int maxPartitions,
+                double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                SpectrumPrecision impulsePrecision = kSpectrumFloat, SpectrumPrecision inputPrecision = kSpectrumFloat,
+                bool prepareInBackground = false, ConvolutionArena *arena = nullptr)
+    : UPConvolver(ConvolutionMatrix::diagonal(1), &impulseResponse, numSamples, bufferSize, maxPartitions,
+                  silenceThresholdDecibels, impulsePrecision, inputPrecision, prepareInBackground, arena)
+    {
+    }
+    
+    /**
+     Construct a UPConvolver object for several inputs and outputs. The other
+     parameters are as for a single channel.
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param impulseResponses
+        One impulse response of 'numSamples' samples per path.
+     */
+    UPConvolver(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                int bufferSize, int maxPartitions,
+                double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                SpectrumPrecision impulsePrecision = kSpectrumFloat, SpectrumPrecision inputPrecision = kSpectrumFloat,
+                bool prepareInBackground = false, ConvolutionArena *arena = nullptr);
+    
+    /**
+     @returns
+        The number of bytes the constructor takes from an arena for the same arguments.
+     */
+    static size_t getArenaSize(const ConvolutionMatrix &matrix, int numSamples, int bufferSize, int maxPartitions,
+                               SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                               SpectrumPrecision inputPrecision = kSpectrumFloat,
+                               bool prepareInBackground = false);
     
     /**
      Perform one base time period's worth of work for the convolution.
@@ -42,34 +106,92 @@ public:
      The input is expected to hold a number of samples equal to the 'bufferSize'
      specified in the constructor.
      */
-    void processInput(FLOAT_TYPE *input);
+    void processInput(const FLOAT_TYPE *input)
+    {
+        processInput(&input);
+    }
+    
+    /**
+     Perform one base time period's worth of work for the convolution of every
+     input.
+     @param inputs
+        One buffer of 'bufferSize' samples per input.
+     */
+    void processInput(const FLOAT_TYPE *const *inputs);
     
     /**
      @returns
-        A pointer to the output buffer
+        A pointer to the output buffer of an output
      */
-    const FLOAT_TYPE *getOutputBuffer() const
+    const FLOAT_TYPE *getOutputBuffer(int output = 0) const
     {
-        return mOutputReal->getReadPointer(0);
+        return mOutputReal.getReadPointer(output);
     };
     
+    const ConvolutionMatrix &getMatrix() const
+    {
+        return mDelayLine->getMatrix();
+    }
+    
+    /**
+     @returns
+        The spectra of this convolver, e.g. to query their storage size and precision.
+     */
+    const FrequencyDomainDelayLine<FLOAT_TYPE> &getDelayLine() const
+    {
+        return *mDelayLine;
+    }
+    
 private:
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mImpulsePartitionsReal;
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mImpulsePartitionsImag;
+    /* The arena the buffers and spectra below are taken from if none was given,
+       declared first to be deleted after everything in it */
+    juce::ScopedPointer<ConvolutionArena> mOwnArena;
     
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mInputReal;
-    juce::OwnedArray<juce::AudioBuffer<FLOAT_TYPE> > mInputImag;
+    /* Only the mNumBins = bufferSize + 1 non-redundant bins of each real-input
+       spectrum are stored. */
+    juce::ScopedPointer<FrequencyDomainDelayLine<FLOAT_TYPE> > mDelayLine;
 
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mPreviousOutputTail;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutputReal;
-    juce::ScopedPointer<juce::AudioBuffer<FLOAT_TYPE> > mOutputImag;
+    juce::AudioBuffer<FLOAT_TYPE> mPreviousOutputTail;
+    juce::AudioBuffer<FLOAT_TYPE> mOutputReal;
+    juce::AudioBuffer<FLOAT_TYPE> mOutputImag;
+    juce::AudioBuffer<FLOAT_TYPE> mTransformReal;
+    juce::AudioBuffer<FLOAT_TYPE> mTransformImag;
+    juce::ScopedPointer<FFTPlan<FLOAT_TYPE, 2 * BLOCK_SIZE> > mFFTPlan;
     
     int mBufferSize;
+    int mNumBins;
     int mNumPartitions;
+    int mNumInputs;
+    int mNumOutputs;
+    int mNumPaths;
+    
+    /* The copy of the impulse response transformed in the background, and the loop
+       transforming it, declared last to be stopped before anything it uses is deleted */
+    juce::AudioBuffer<FLOAT_TYPE> mPendingImpulse;
+    juce::ScopedPointer<ConvolutionScheduler::BackgroundLoop> mPreparation;
     
-    int mCurrentInputSegment;
+    int getBufferSize() const
+    {
+        return (BLOCK_SIZE != 0) ? BLOCK_SIZE : mBufferSize;
+    }
+    
+    static int getNumPartitions(int numSamples, int bufferSize, int maxPartitions)
+    {
+        return std::min((numSamples / bufferSize) + !!(numSamples % bufferSize), maxPartitions);
+    }
     
     void process();
+    
+    /** @returns What the impulse response spectra are computed from, see FrequencyDomainDelayLine::create(). */
+    static ImpulseSpectrumKey getImpulseSpectrumKey(const FLOAT_TYPE *const *impulseResponses, int numSamples, int bufferSize,
+                                                    int numPartitions, int numPaths);
+    
+    /**
+     Store the spectra of impulse response partitions 'first' ... 'end' - 1 of every
+     path and mark them ready, skipping those claimed by another convolver sharing
+     the spectra. Disjoint ranges may be transformed concurrently.
+     */
+    void transformImpulse(const FLOAT_TYPE *const *impulseResponses, int numSamples, int first, int end);
 
 };
 
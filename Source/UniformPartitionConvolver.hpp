@@ -7,120 +7,209 @@
 //
 
 #include "util/util.h"
-#include "util/fft.hpp"
 #include <stdexcept>
 
-template <typename FLOAT_TYPE>
-UPConvolver<FLOAT_TYPE>::UPConvolver(FLOAT_TYPE *impulseResponse, int numSamples, int bufferSize, int maxPartitions)
-: mCurrentInputSegment(0)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::UPConvolver(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                                                 int bufferSize, int maxPartitions,
+                                                 double silenceThresholdDecibels, SpectrumPrecision impulsePrecision,
+                                                 SpectrumPrecision inputPrecision, bool prepareInBackground,
+                                                 ConvolutionArena *arena)
 {
     if (isPowerOfTwo(bufferSize) == false)
     {
         throw std::invalid_argument("bufferSize must be a power of 2");
     }
     
-    int numPartitions = (numSamples / bufferSize) + !!(numSamples % bufferSize);
-
-    if (numPartitions > maxPartitions)
+    if (BLOCK_SIZE != 0 && bufferSize != BLOCK_SIZE)
     {
-        numPartitions = maxPartitions;
+        throw std::invalid_argument("bufferSize must match the BLOCK_SIZE template argument");
     }
+    
+    const int numPartitions = getNumPartitions(numSamples, bufferSize, maxPartitions);
 
     mNumPartitions = numPartitions;
     mBufferSize = bufferSize;
-
-    for (int i = 0; i < numPartitions; ++i)
+    mNumBins = mBufferSize + 1;
+    mNumInputs = matrix.numInputs;
+    mNumOutputs = matrix.numOutputs;
+    mNumPaths = matrix.getNumPaths();
+    
+    if (arena == nullptr)
     {
-        int samplesToCopy = std::min((numSamples - (i * mBufferSize)), mBufferSize);
-
-        /* Allocate and fill real array */
-        
-        mImpulsePartitionsReal.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize));
-        checkNull(mImpulsePartitionsReal[i]);
-        mImpulsePartitionsReal[i]->clear();
-        
-        FLOAT_TYPE *partition = mImpulsePartitionsReal[i]->getWritePointer(0);
-        memcpy(partition, impulseResponse + (i * mBufferSize), samplesToCopy * sizeof(FLOAT_TYPE));
-        
-        /* Allocate imag array */
-        
-        mImpulsePartitionsImag.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize));
-        checkNull(mImpulsePartitionsReal[i]);
-        
-        mImpulsePartitionsImag[i]->clear();
-        FLOAT_TYPE *partitionImag = mImpulsePartitionsImag[i]->getWritePointer(0);
-        
-        /* Calculate transform */
-        fft(partition, partitionImag, 2 * mBufferSize);
-        
-        /* Allocate an input buffer */
-        mInputReal.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize));
-        mInputImag.add(new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize));
-        mInputReal[i]->clear();
-        mInputImag[i]->clear();
+        mOwnArena = new ConvolutionArena(getArenaSize(matrix, numSamples, bufferSize, maxPartitions, impulsePrecision,
+                                                      inputPrecision, prepareInBackground));
+        checkNull(mOwnArena);
+        arena = mOwnArena;
+    }
+    
+    mFFTPlan = new FFTPlan<FLOAT_TYPE, 2 * BLOCK_SIZE>(2 * mBufferSize);
+    checkNull(mFFTPlan);
+    
+    arena->allocateBuffer(mTransformReal, 1, 2 * mBufferSize);
+    arena->allocateBuffer(mTransformImag, 1, mNumBins);
+    
+    /* Convolvers of the same impulse responses and buffer size share their spectra */
+    const ImpulseSpectrumKey key = getImpulseSpectrumKey(impulseResponses, numSamples, bufferSize, numPartitions, mNumPaths);
+    mDelayLine = FrequencyDomainDelayLine<FLOAT_TYPE>::create(numPartitions, mNumBins, impulsePrecision, inputPrecision, matrix, arena, &key);
+    checkNull(mDelayLine);
+    
+    if (! prepareInBackground)
+    {
+        /* The partitions are transformed on all cores, less any another convolver has done */
+        ConvolutionScheduler::getInstance().parallelFor(numPartitions, [&](int first, int end)
+        {
+            transformImpulse(impulseResponses, numSamples, first, end);
+        });
+        mDelayLine->waitUntilReady();
     }
     
-    mOutputReal = new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize);
-    checkNull(mOutputReal);
+    mDelayLine->findActivePartitions(silenceThresholdDecibels);
     
-    mOutputImag = new juce::AudioBuffer<FLOAT_TYPE>(1, 2 * mBufferSize);
-    checkNull(mOutputImag);
-    mOutputImag->clear();
+    arena->allocateBuffer(mOutputReal, mNumOutputs, 2 * mBufferSize);
+    arena->allocateBuffer(mOutputImag, mNumOutputs, mNumBins);
+    arena->allocateBuffer(mPreviousOutputTail, mNumOutputs, mBufferSize);
     
-    mPreviousOutputTail = new juce::AudioBuffer<FLOAT_TYPE>(1, mBufferSize);
-    checkNull(mPreviousOutputTail);
-    mPreviousOutputTail->clear();
+    if (prepareInBackground && mDelayLine->getNumReadyPartitions() < numPartitions)
+    {
+        /* The caller's impulse responses may be gone by the time a partition's turn comes */
+        numSamples = std::min(numSamples, numPartitions * mBufferSize);
+        arena->allocateBuffer(mPendingImpulse, mNumPaths, std::max(numSamples, 1));
+        
+        for (int path = 0; path < mNumPaths; ++path)
+        {
+            memcpy(mPendingImpulse.getWritePointer(path), impulseResponses[path], numSamples * sizeof(FLOAT_TYPE));
+        }
+        
+        const FLOAT_TYPE *const *irs = mPendingImpulse.getArrayOfReadPointers();
+        mPreparation = new ConvolutionScheduler::BackgroundLoop(ConvolutionScheduler::getInstance(), numPartitions,
+                                                                [this, irs, numSamples](int first, int end)
+        {
+            transformImpulse(irs, numSamples, first, end);
+        });
+        checkNull(mPreparation);
+    }
 }
 
-template <typename FLOAT_TYPE>
-void UPConvolver<FLOAT_TYPE>::processInput(FLOAT_TYPE *input)
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+size_t UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::getArenaSize(const ConvolutionMatrix &matrix, int numSamples, int bufferSize,
+                                                         int maxPartitions, SpectrumPrecision impulsePrecision,
+                                                         SpectrumPrecision inputPrecision, bool prepareInBackground)
 {
-    FLOAT_TYPE *currentSegmentReal = mInputReal[mCurrentInputSegment]->getWritePointer(0);
-    FLOAT_TYPE *currentSegmentImag = mInputImag[mCurrentInputSegment]->getWritePointer(0);
+    const int numPartitions = getNumPartitions(numSamples, bufferSize, maxPartitions);
+    const int numBins = bufferSize + 1;
+    const int numOutputs = matrix.numOutputs;
     
-    mInputReal[mCurrentInputSegment]->clear();
-    mInputImag[mCurrentInputSegment]->clear();
+    size_t size = FrequencyDomainDelayLine<FLOAT_TYPE>::getArenaSize(numPartitions, numBins, impulsePrecision, inputPrecision, matrix)
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(1, 2 * bufferSize)
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(1, numBins)
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, 2 * bufferSize)
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, numBins)
+                + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, bufferSize);
     
-    memcpy(currentSegmentReal, input, mBufferSize * sizeof(FLOAT_TYPE));
-    fft(currentSegmentReal, currentSegmentImag, 2 * mBufferSize);
-    
-    process();
+    if (prepareInBackground)
+    {
+        const int numPendingSamples = std::max(std::min(numSamples, numPartitions * bufferSize), 1);
+        size += ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(matrix.getNumPaths(), numPendingSamples);
+    }
+    return size;
 }
 
-
-template <typename FLOAT_TYPE>
-void UPConvolver<FLOAT_TYPE>::process()
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+ImpulseSpectrumKey UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::getImpulseSpectrumKey(const FLOAT_TYPE *const *impulseResponses, int numSamples,
+                                                                             int bufferSize, int numPartitions, int numPaths)
 {
-    mOutputReal->clear();
-    mOutputImag->clear();
+    const char kind[] = "UPConvolver";
+    const int numSamplesUsed = std::max(std::min(numSamples, numPartitions * bufferSize), 0);
+    ImpulseSpectrumKey key;
     
-    FLOAT_TYPE *rey = mOutputReal->getWritePointer(0);
-    FLOAT_TYPE *imy = mOutputImag->getWritePointer(0);
+    key.add(kind, sizeof(kind));
+    key.add((int64_t)bufferSize);
     
-    for (int j = 0; j < mNumPartitions; ++j)
+    for (int path = 0; path < numPaths; ++path)
     {
-        int k = trueMod(mCurrentInputSegment - j, mNumPartitions);
+        key.add(impulseResponses[path], numSamplesUsed * sizeof(FLOAT_TYPE));
+    }
+    return key;
+}
 
-        const FLOAT_TYPE *rex = mInputReal[k]->getReadPointer(0);
-        const FLOAT_TYPE *imx = mInputImag[k]->getReadPointer(0);
-        const FLOAT_TYPE *reh = mImpulsePartitionsReal[j]->getReadPointer(0);
-        const FLOAT_TYPE *imh = mImpulsePartitionsImag[j]->getReadPointer(0);
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::transformImpulse(const FLOAT_TYPE *const *impulseResponses, int numSamples, int first, int end)
+{
+    juce::AudioBuffer<FLOAT_TYPE> transformReal(1, 2 * mBufferSize);
+    juce::AudioBuffer<FLOAT_TYPE> transformImag(1, mNumBins);
+    FLOAT_TYPE *tr = transformReal.getWritePointer(0);
+    FLOAT_TYPE *ti = transformImag.getWritePointer(0);
+    
+    for (int i = first; i < end; ++i)
+    {
+        if (! mDelayLine->claimPartition(i))
+        {
+            continue;
+        }
+        
+        int samplesToCopy = std::min((numSamples - (i * mBufferSize)), mBufferSize);
         
-        for (int i = 0; i < (2 * mBufferSize); ++i)
+        for (int path = 0; path < mNumPaths; ++path)
         {
-            rey[i] += (rex[i] * reh[i]) - (imx[i] * imh[i]);
-            imy[i] += (rex[i] * imh[i]) + (imx[i] * reh[i]);
+            /* Calculate transform of the zero-padded partition. rfft() leaves bins in
+               'tr', and AudioBuffer::clear() skips a buffer it thinks is still clear. */
+            memset(tr, 0, 2 * mBufferSize * sizeof(FLOAT_TYPE));
+            memcpy(tr, impulseResponses[path] + (i * mBufferSize), samplesToCopy * sizeof(FLOAT_TYPE));
+            mFFTPlan->rfft(tr, ti);
+            
+            /* Keep the non-redundant bins */
+            mDelayLine->setImpulse(i, 0, tr, ti, mNumBins, path);
         }
+        
+        mDelayLine->setPartitionReady(i);
     }
+}
+
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::processInput(const FLOAT_TYPE *const *inputs)
+{
+    const int bufferSize = getBufferSize();
+    const int numBins = bufferSize + 1;
+    FLOAT_TYPE *tr = mTransformReal.getWritePointer(0);
+    FLOAT_TYPE *ti = mTransformImag.getWritePointer(0);
     
-    ifft(rey, imy, 2 * mBufferSize);
-    FLOAT_TYPE *tail = mPreviousOutputTail->getWritePointer(0);
+    mDelayLine->advance();
     
-    for (int i = 0; i < mBufferSize; ++i)
+    /* Each input is transformed once, however many paths it feeds */
+    for (int input = 0; input < mNumInputs; ++input)
     {
-        rey[i] += tail[i];
-        tail[i] = rey[i + mBufferSize];
+        memcpy(tr, inputs[input], bufferSize * sizeof(FLOAT_TYPE));
+        memset(tr + bufferSize, 0, bufferSize * sizeof(FLOAT_TYPE));
+        mFFTPlan->rfft(tr, ti);
+        
+        mDelayLine->setNewestInput(0, tr, ti, numBins, input);
     }
     
-    mCurrentInputSegment = (mCurrentInputSegment + 1) % mNumPartitions;
+    process();
+}
+
+
+template <typename FLOAT_TYPE, int BLOCK_SIZE>
+void UPConvolver<FLOAT_TYPE, BLOCK_SIZE>::process()
+{
+    const int bufferSize = getBufferSize();
+    const int numBins = bufferSize + 1;
+    
+    /* The spectrum of each output, summed over the paths into it */
+    mDelayLine->multiplyAccumulate(mOutputReal.getArrayOfWritePointers(), mOutputImag.getArrayOfWritePointers(), 0, numBins);
+    
+    for (int output = 0; output < mNumOutputs; ++output)
+    {
+        FLOAT_TYPE *rey = mOutputReal.getWritePointer(output);
+        
+        mFFTPlan->irfft(rey, mOutputImag.getWritePointer(output));
+        FLOAT_TYPE *tail = mPreviousOutputTail.getWritePointer(output);
+        
+        for (int i = 0; i < bufferSize; ++i)
+        {
+            rey[i] += tail[i];
+            tail[i] = rey[i + bufferSize];
+        }
+    }
 }
@@ -0,0 +1,388 @@
+//
+//  WorkerLevel.h
+//  RTConvolve
+//
+
+#ifndef WorkerLevel_h
+#define WorkerLevel_h
+
+#include "../JuceLibraryCode/JuceHeader.h"
+#include "ConvolutionScheduler.h"
+#include "UniformPartitionConvolver.h"
+#include "TimeDistributedLevel.h"
+#include "SampleDelayLine.h"
+#include "util/util.h"
+#include <atomic>
+#include <cstdint>
+
+/**
+ A ConvolutionLevel whose convolution is computed by a ConvolutionScheduler.
+
+ The level collects the input into blocks of one partition of P samples, and
+ convolves each block with a UPConvolver whose buffer size is P on a worker
+ thread. The output of a block is played out from two blocks after the block's
+ input started, a delay of 2P, like a TimeDistributedLevel of the same partition
+ size, so the level fits the same partition plans. The worker thus has the
+ duration of one whole block to compute it: the deadline of a block is one block
+ duration, as measured between the last two blocks, after its input is complete.
+ Measuring it keeps the deadlines right for any sample rate, and when rendering
+ faster than real time.
+
+ Blocks go to and from the workers through lock-free single-producer,
+ single-consumer queues. The audio thread never waits for the workers:
+
+ - If the output of a block is not ready when it should start playing, the level
+   plays silence until it arrives, then plays the rest of the block. A block that
+   arrives after its time is discarded. Every such block counts as a deadline miss.
+ - If the worker has fallen so far behind that the input queue is full, the block
+   is dropped. The worker convolves silence in its place, so the output stays
+   aligned with the input.
+ */
+template <typename FLOAT_TYPE>
+class WorkerLevel : public ConvolutionLevel<FLOAT_TYPE>, public ConvolutionScheduler::Job
+{
+public:
+    /**
+     @param matrix
+        The inputs, outputs and paths of the convolution.
+     @param impulseResponses
+        For each path, the segment of its impulse response convolved by this level.
+     @param numSamples
+        The length of the segments.
+     @param start
+        The position of the segment in the whole impulse response, at least twice
+        'partitionSize'.
+     @param bufferSize
+        The host audio application's buffer size.
+     @param partitionSize
+        A multiple of 'bufferSize'.
+     @param scheduler
+        The pool that convolves the blocks, usually ConvolutionScheduler::getInstance().
+        The level adds itself to its jobs, and removes itself when deleted.
+     @param prepareInBackground
+        See UPConvolver.
+     @param arena
+        The arena to take the buffers and spectra from, with getArenaSize() bytes to
+        spare for them, which must outlive the level. nullptr for an arena of the
+        level's own.
+     */
+    WorkerLevel(const ConvolutionMatrix &matrix, const FLOAT_TYPE *const *impulseResponses, int numSamples, int start,
+                int bufferSize, int partitionSize, ConvolutionScheduler &scheduler,
+                double silenceThresholdDecibels = DEFAULT_SILENCE_THRESHOLD_DB,
+                SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                SpectrumPrecision inputPrecision = kSpectrumFloat,
+                bool prepareInBackground = false, ConvolutionArena *arena = nullptr)
+    : mScheduler(scheduler)
+    , mNumInputs(matrix.numInputs)
+    , mNumOutputs(matrix.numOutputs)
+    , mBufferSize(bufferSize)
+    , mPartitionSize(partitionSize)
+    , mPosition(0)
+    , mNextSequence(0)
+    , mPlayingSequence(-1)
+    , mPlaying(false)
+    , mHasSent(false)
+    , mWorkerSequence(0)
+    , mInputQueue(kQueueSize)
+    , mOutputQueue(kQueueSize)
+    , mNumDeadlineMisses(0)
+    {
+        const int delay = 2 * partitionSize;
+
+        if (partitionSize % bufferSize != 0 || start < delay)
+        {
+            throw std::invalid_argument("The level must start after its delay, in whole buffers");
+        }
+
+        if (arena == nullptr)
+        {
+            mOwnArena = new ConvolutionArena(getArenaSize(matrix, numSamples, start, bufferSize, partitionSize, impulsePrecision,
+                                                          inputPrecision, prepareInBackground));
+            checkNull(mOwnArena);
+            arena = mOwnArena;
+        }
+
+        const int numPartitions = getNumPartitions(numSamples, partitionSize);
+        mConvolver = new UPConvolver<FLOAT_TYPE>(matrix, impulseResponses, numSamples, partitionSize, numPartitions,
+                                                 silenceThresholdDecibels, impulsePrecision, inputPrecision, prepareInBackground,
+                                                 arena);
+        checkNull(mConvolver);
+
+        if (start > delay)
+        {
+            mInputDelay = new SampleDelayLine<FLOAT_TYPE>(start - delay, bufferSize, mNumInputs, arena);
+            checkNull(mInputDelay);
+        }
+
+        arena->allocateBuffer(mCollecting, mNumInputs, partitionSize);
+        mCollectingPointers = arena->allocate<FLOAT_TYPE *>(mNumInputs);
+        arena->allocateBuffer(mPlayBlock, mNumOutputs, partitionSize);
+
+        /* Silent input for dropped blocks, and silent output for late ones */
+        arena->allocateBuffer(mSilence, std::max(mNumInputs, mNumOutputs), partitionSize);
+
+        /* Row slot * I + i holds input i of the block in 'slot', and likewise for the outputs */
+        arena->allocateBuffer(mInputBlocks, kQueueSize * mNumInputs, partitionSize);
+        arena->allocateBuffer(mOutputBlocks, kQueueSize * mNumOutputs, partitionSize);
+
+        mOutputBlock = &mSilence;
+        mOutputPosition = 0;
+        scheduler.addJob(this);
+    }
+
+    ~WorkerLevel()
+    {
+        mScheduler.removeJob(this);
+    }
+
+    /** @returns The number of bytes the constructor takes from an arena for the same arguments. */
+    static size_t getArenaSize(const ConvolutionMatrix &matrix, int numSamples, int start, int bufferSize, int partitionSize,
+                               SpectrumPrecision impulsePrecision = kSpectrumFloat,
+                               SpectrumPrecision inputPrecision = kSpectrumFloat,
+                               bool prepareInBackground = false)
+    {
+        const int numInputs = matrix.numInputs;
+        const int numOutputs = matrix.numOutputs;
+        const int delay = 2 * partitionSize;
+
+        size_t size = UPConvolver<FLOAT_TYPE>::getArenaSize(matrix, numSamples, partitionSize, getNumPartitions(numSamples, partitionSize),
+                                                            impulsePrecision, inputPrecision, prepareInBackground)
+                    + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numInputs, partitionSize)
+                    + ConvolutionArena::getAllocationSize<FLOAT_TYPE *>(numInputs)
+                    + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(numOutputs, partitionSize)
+                    + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(std::max(numInputs, numOutputs), partitionSize)
+                    + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(kQueueSize * numInputs, partitionSize)
+                    + ConvolutionArena::getBufferAllocationSize<FLOAT_TYPE>(kQueueSize * numOutputs, partitionSize);
+
+        if (start > delay)
+        {
+            size += SampleDelayLine<FLOAT_TYPE>::getArenaSize(start - delay, bufferSize, numInputs);
+        }
+        return size;
+    }
+
+    void processInput(const FLOAT_TYPE *const *inputs) override
+    {
+        for (int input = 0; input < mNumInputs; ++input)
+        {
+            mCollectingPointers[input] = mCollecting.getWritePointer(input) + mPosition;
+        }
+
+        if (mInputDelay != nullptr)
+        {
+            mInputDelay->process(inputs, mCollectingPointers, mBufferSize);
+        }
+        else
+        {
+            for (int input = 0; input < mNumInputs; ++input)
+            {
+                memcpy(mCollectingPointers[input], inputs[input], mBufferSize * sizeof(FLOAT_TYPE));
+            }
+        }
+
+        /* Block k plays while block k + 2 is collected */
+        if (mPosition == 0)
+        {
+            mPlayingSequence = mNextSequence - 2;
+            mPlaying = false;
+        }
+
+        if (! mPlaying && mPlayingSequence >= 0)
+        {
+            mPlaying = receiveOutput();
+
+            if (! mPlaying && mPosition == 0)
+            {
+                mNumDeadlineMisses.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        mOutputBlock = mPlaying ? &mPlayBlock : &mSilence;
+        mOutputPosition = mPosition;
+        mPosition += mBufferSize;
+
+        if (mPosition == mPartitionSize)
+        {
+            sendInput();
+            mPosition = 0;
+        }
+    }
+
+    const FLOAT_TYPE *getOutputBuffer(int output) const override
+    {
+        return mOutputBlock->getReadPointer(output) + mOutputPosition;
+    }
+
+    const FrequencyDomainDelayLine<FLOAT_TYPE> &getDelayLine() const override
+    {
+        return mConvolver->getDelayLine();
+    }
+
+    /** @returns The number of blocks whose output was not ready in time. */
+    int getNumDeadlineMisses() const
+    {
+        return mNumDeadlineMisses.load(std::memory_order_relaxed);
+    }
+
+    int64_t getNextDeadline() const override
+    {
+        int start1, size1, start2, size2;
+        mInputQueue.prepareToRead(1, start1, size1, start2, size2);
+
+        return (size1 != 0) ? mInputDeadline[start1].load(std::memory_order_relaxed) : ConvolutionScheduler::getNoDeadline();
+    }
+
+    bool processPending() override
+    {
+        int start1, size1, start2, size2;
+        mInputQueue.prepareToRead(1, start1, size1, start2, size2);
+
+        if (size1 == 0)
+            return false;
+
+        /* Blocks dropped by the audio thread are convolved as silence */
+        const int64_t sequence = mInputSequence[start1];
+
+        while (mWorkerSequence < sequence)
+        {
+            mConvolver->processInput(mSilence.getArrayOfReadPointers());
+            ++mWorkerSequence;
+        }
+
+        mConvolver->processInput(mInputBlocks.getArrayOfReadPointers() + (start1 * mNumInputs));
+        mInputQueue.finishedRead(1);
+        ++mWorkerSequence;
+
+        mOutputQueue.prepareToWrite(1, start1, size1, start2, size2);
+
+        if (size1 != 0)
+        {
+            for (int output = 0; output < mNumOutputs; ++output)
+            {
+                memcpy(mOutputBlocks.getWritePointer(start1 * mNumOutputs + output), mConvolver->getOutputBuffer(output),
+                       mPartitionSize * sizeof(FLOAT_TYPE));
+            }
+            mOutputSequence[start1] = sequence;
+            mOutputQueue.finishedWrite(1);
+        }
+        return true;
+    }
+
+private:
+    /** Blocks in flight in each direction, plus the slot that AbstractFifo keeps free */
+    enum { kQueueSize = 8 };
+
+    /* The arena the buffers and spectra below are taken from if none was given,
+       declared first to be deleted after everything in it */
+    juce::ScopedPointer<ConvolutionArena> mOwnArena;
+
+    ConvolutionScheduler &mScheduler;
+    int mNumInputs;
+    int mNumOutputs;
+    int mBufferSize;
+    int mPartitionSize;
+
+    /* Audio thread */
+    int mPosition;
+    int64_t mNextSequence;
+    int64_t mPlayingSequence;
+    bool mPlaying;
+    bool mHasSent;
+    ConvolutionScheduler::Clock::time_point mLastSent;
+    const juce::AudioBuffer<FLOAT_TYPE> *mOutputBlock;
+    int mOutputPosition;
+    juce::ScopedPointer<SampleDelayLine<FLOAT_TYPE> > mInputDelay;
+    juce::AudioBuffer<FLOAT_TYPE> mCollecting;
+    FLOAT_TYPE **mCollectingPointers;
+    juce::AudioBuffer<FLOAT_TYPE> mPlayBlock;
+
+    /* Worker thread */
+    int64_t mWorkerSequence;
+    juce::ScopedPointer<UPConvolver<FLOAT_TYPE> > mConvolver;
+
+    /* Shared, through the queues */
+    juce::AbstractFifo mInputQueue;
+    juce::AbstractFifo mOutputQueue;
+    juce::AudioBuffer<FLOAT_TYPE> mInputBlocks;
+    juce::AudioBuffer<FLOAT_TYPE> mOutputBlocks;
+    int64_t mInputSequence[kQueueSize];
+    std::atomic<int64_t> mInputDeadline[kQueueSize];
+    int64_t mOutputSequence[kQueueSize];
+    juce::AudioBuffer<FLOAT_TYPE> mSilence;
+    std::atomic<int> mNumDeadlineMisses;
+
+    static int getNumPartitions(int numSamples, int partitionSize)
+    {
+        return (numSamples / partitionSize) + !!(numSamples % partitionSize);
+    }
+
+    /** Queue the completed input block, or drop it if the queue is full */
+    void sendInput()
+    {
+        /* Until the block duration is known, the first block is due at once */
+        const ConvolutionScheduler::Clock::time_point now = ConvolutionScheduler::Clock::now();
+        const ConvolutionScheduler::Clock::duration blockDuration = mHasSent ? now - mLastSent : ConvolutionScheduler::Clock::duration(0);
+        mLastSent = now;
+        mHasSent = true;
+
+        int start1, size1, start2, size2;
+        mInputQueue.prepareToWrite(1, start1, size1, start2, size2);
+
+        if (size1 != 0)
+        {
+            for (int input = 0; input < mNumInputs; ++input)
+            {
+                memcpy(mInputBlocks.getWritePointer(start1 * mNumInputs + input), mCollecting.getReadPointer(input),
+                       mPartitionSize * sizeof(FLOAT_TYPE));
+            }
+            mInputSequence[start1] = mNextSequence;
+            mInputDeadline[start1].store((now + blockDuration).time_since_epoch().count(), std::memory_order_relaxed);
+            mInputQueue.finishedWrite(1);
+        }
+
+        ++mNextSequence;
+        mScheduler.notify(*this);
+    }
+
+    /**
+     Take the output of the block to play from the queue, discarding any late ones
+     before it.
+     @returns
+        false if it is not ready yet.
+     */
+    bool receiveOutput()
+    {
+        int start1, size1, start2, size2;
+
+        for (;;)
+        {
+            mOutputQueue.prepareToRead(1, start1, size1, start2, size2);
+
+            if (size1 == 0)
+                return false;
+
+            const int64_t sequence = mOutputSequence[start1];
+
+            /* The block to play was dropped: the next one is still to come */
+            if (sequence > mPlayingSequence)
+                return false;
+
+            if (sequence == mPlayingSequence)
+            {
+                for (int output = 0; output < mNumOutputs; ++output)
+                {
+                    memcpy(mPlayBlock.getWritePointer(output), mOutputBlocks.getReadPointer(start1 * mNumOutputs + output),
+                           mPartitionSize * sizeof(FLOAT_TYPE));
+                }
+            }
+
+            mOutputQueue.finishedRead(1);
+
+            if (sequence == mPlayingSequence)
+                return true;
+        }
+    }
+};
+
+
+#endif /* WorkerLevel_h */
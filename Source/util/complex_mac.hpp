@@ -0,0 +1,106 @@
+/* Vectorized complex multiply-accumulate for partitioned convolution.
+ *
+ * Every partitioned convolver spends most of its time summing the products of
+ * the spectra of its input partitions and impulse response partitions. The
+ * kernel in complex_mac_kernel.hpp does this with the vector types of
+ * fft_simd.hpp, and is compiled for the same instruction sets as the FFT
+ * kernels: scalar, SSE2, AVX2/FMA and AVX-512. The best one the running CPU
+ * supports is chosen at runtime by getFFTInstructionSet().
+ *
+ * With FMA the products are rounded once instead of twice, so results may
+ * differ from the scalar kernel in the last bit.
+ *
+ * For T = float, X and H may also be stored in the 16-bit formats of
+ * reduced_precision.hpp, which halves the memory traffic of the kernel. */
+
+#ifndef __COMPLEX_MAC__
+#define __COMPLEX_MAC__
+
+#include "fft_simd.hpp"
+
+namespace fft_scalar
+{
+	#include "complex_mac_kernel.hpp"
+}
+
+#if RTCONVOLVE_FFT_SIMD
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("sse2")
+#endif
+namespace fft_sse2
+{
+	#include "complex_mac_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("avx2,fma")
+#endif
+namespace fft_avx2
+{
+	#include "complex_mac_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("avx512f,avx2,fma")
+#endif
+namespace fft_avx512
+{
+	#include "complex_mac_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#endif /* RTCONVOLVE_FFT_SIMD */
+
+/* Y = sum of X[p] * H[p] over p < numPartitions, for the numBins complex bins
+ * starting at firstBin, using the best kernel for the running CPU. XR/XI and
+ * HR/HI hold one pointer to the real and imaginary parts of each partition's
+ * spectrum. Y is overwritten, starting at Y(0), and must not alias any of the
+ * partitions. XS and HS are the storage types of X and H. */
+template <typename T, typename XS, typename HS>
+inline void complexMultiplyAccumulate(T *YR, T *YI, const XS *const *XR, const XS *const *XI,
+                                      const HS *const *HR, const HS *const *HI, unsigned int numPartitions,
+                                      unsigned int firstBin, unsigned int numBins)
+{
+	switch (getFFTInstructionSet()) {
+#if RTCONVOLVE_FFT_SIMD
+	case kFFTAVX512:
+		fft_avx512::complexMultiplyAccumulate(YR, YI, XR, XI, HR, HI, numPartitions, firstBin, numBins);
+		break;
+	case kFFTAVX2:
+		fft_avx2::complexMultiplyAccumulate(YR, YI, XR, XI, HR, HI, numPartitions, firstBin, numBins);
+		break;
+	case kFFTSSE2:
+		fft_sse2::complexMultiplyAccumulate(YR, YI, XR, XI, HR, HI, numPartitions, firstBin, numBins);
+		break;
+#endif
+	default:
+		fft_scalar::complexMultiplyAccumulate(YR, YI, XR, XI, HR, HI, numPartitions, firstBin, numBins);
+		break;
+	}
+}
+
+#endif
@@ -0,0 +1,92 @@
+/* Complex multiply-accumulate of partitioned spectra.
+ *
+ * Like fft_radix4.hpp, this file intentionally has no include guard. It is
+ * included once per instruction set by complex_mac.hpp, inside the namespaces
+ * of fft_simd.hpp that define Vec<float> and Vec<double>.
+ *
+ * The input spectra X and impulse response spectra H may each be stored as T
+ * or, for T = float, in one of the 16-bit formats of reduced_precision.hpp
+ * (XS and HS). Vec<float>::load() widens those to float in registers, so the
+ * accumulation is always done in T. */
+
+/* One pass of the multiply-accumulate over NUM_PARTITIONS partitions. The
+ * partial sums of a vector of bins are kept in registers across all of the
+ * partitions of the pass, so Y is read and written once per pass rather than
+ * once per partition. The first pass (FIRST) overwrites Y instead of adding to it. */
+template <int NUM_PARTITIONS, bool FIRST, typename T, typename XS, typename HS>
+inline void complexMultiplyAccumulatePass(T *YR, T *YI, const XS *const *XR, const XS *const *XI,
+                                          const HS *const *HR, const HS *const *HI, unsigned int firstBin, unsigned int numBins)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	unsigned int i;
+	int p;
+
+	for (i = 0; i + W <= numBins; i += W) {
+		VT yr = FIRST ? V::zero() : V::load(YR + i);
+		VT yi = FIRST ? V::zero() : V::load(YI + i);
+
+		for (p = 0; p < NUM_PARTITIONS; ++p) {
+			const unsigned int j = firstBin + i;
+			VT xr = V::load(XR[p] + j), xi = V::load(XI[p] + j);
+			VT hr = V::load(HR[p] + j), hi = V::load(HI[p] + j);
+
+			yr = V::muladd(xr, hr, yr);
+			yr = V::nmuladd(xi, hi, yr);
+			yi = V::muladd(xr, hi, yi);
+			yi = V::muladd(xi, hr, yi);
+		}
+
+		V::store(YR + i, yr);
+		V::store(YI + i, yi);
+	}
+
+	for (; i < numBins; ++i) {
+		T yr = FIRST ? 0 : YR[i];
+		T yi = FIRST ? 0 : YI[i];
+
+		for (p = 0; p < NUM_PARTITIONS; ++p) {
+			const unsigned int j = firstBin + i;
+			const T xr = (T)XR[p][j], xi = (T)XI[p][j];
+			const T hr = (T)HR[p][j], hi = (T)HI[p][j];
+			yr += (xr * hr) - (xi * hi);
+			yi += (xr * hi) + (xi * hr);
+		}
+
+		YR[i] = yr;
+		YI[i] = yi;
+	}
+}
+
+/* Y = sum of X[p] * H[p] over p < numPartitions, for the numBins complex bins
+ * of every spectrum starting at firstBin, with real and imaginary parts in
+ * separate arrays. Y(0) is the sum for bin firstBin. Partitions are accumulated
+ * four per pass. */
+template <typename T, typename XS, typename HS>
+void complexMultiplyAccumulate(T *YR, T *YI, const XS *const *XR, const XS *const *XI,
+                               const HS *const *HR, const HS *const *HI, unsigned int numPartitions,
+                               unsigned int firstBin, unsigned int numBins)
+{
+	unsigned int p = 0;
+
+	if (numPartitions == 0) {
+		for (unsigned int i = 0; i < numBins; ++i)
+			YR[i] = YI[i] = 0;
+		return;
+	}
+
+	if (numPartitions >= 4) {
+		complexMultiplyAccumulatePass<4, true>(YR, YI, XR, XI, HR, HI, firstBin, numBins);
+		p = 4;
+	} else {
+		complexMultiplyAccumulatePass<1, true>(YR, YI, XR, XI, HR, HI, firstBin, numBins);
+		p = 1;
+	}
+
+	for (; p + 4 <= numPartitions; p += 4)
+		complexMultiplyAccumulatePass<4, false>(YR, YI, XR + p, XI + p, HR + p, HI + p, firstBin, numBins);
+
+	for (; p < numPartitions; ++p)
+		complexMultiplyAccumulatePass<1, false>(YR, YI, XR + p, XI + p, HR + p, HI + p, firstBin, numBins);
+}
@@ -3,93 +3,254 @@
 #ifndef __FFT__
 #define __FFT__
 
-/* Fast Fourier Transform */
 #ifdef _WIN32
 #define _USE_MATH_DEFINES
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
-static double log2( double n )  
-{  
-    // log(n)/log(2) is log2.  
-    return log( n ) / log( 2 );  
-}
 #endif
 #include <cmath>
-template <typename T>
-void fft(T *REX, T *IMX, unsigned int N)
+#include <vector>
+#include <stdexcept>
+#include "fft_backend.hpp"
+
+/* Precomputed Fast Fourier Transform plan.
+ * A plan is created once for a real transform length N (a power of 2) and owns
+ * every table needed by the transforms of that length: the twiddles that
+ * separate the real-input spectrum, the twiddles of the odd-bin transform, and
+ * the FFTBackend that computes the underlying N/2-point complex FFT. None of the
+ * transform methods call cos(), sin() or pow(), allocate memory, or modify the
+ * plan, so a single plan may be shared by any number of transforms of the same
+ * length.
+ * The backend is the one registered under the name given to the constructor or,
+ * by default, the fastest one for this size on this machine (see fft_backend.hpp).
+ * If SIZE is non-zero, the transform length is a compile-time constant and the
+ * plan may only be created with N equal to SIZE. */
+template <typename T, unsigned int SIZE = 0>
+class FFTPlan
 {
-	const unsigned int NM1 = N - 1;
-	const unsigned int ND2 = N / 2;
-	const unsigned int M = (unsigned int)log2((float)N);
-	unsigned int k;
-	unsigned int LE, LE2;
-	unsigned int IP;
-	int j = ND2;
-	int i, l;	/* Loop counters */
-	int jm1;
-	T TR, TI, UR, UI, SR, SI;
-
-	/* Bit reversal sorting */
-	for (i = 1; i < N - 1; ++i) {
-		if (i >= j)
-			goto SKIP;
-		TR = REX[j];
-		TI = IMX[j];
-		REX[j] = REX[i];
-		IMX[j] = IMX[i];
-		REX[i] = TR;
-		IMX[i] = TI;
-SKIP:
-		k = ND2;
-		while (k <= j) {
-			j = j-k;
-			k /= 2;
+public:
+	explicit FFTPlan(unsigned int N, const std::string &backendName = std::string())
+	: mN(N)
+	, mM(N / 2)
+	{
+		FFTBackendRegistry<T> &registry = FFTBackendRegistry<T>::getInstance();
+		const unsigned int M = mM;
+		unsigned int k;
+
+		if (SIZE != 0 && N != SIZE)
+			throw std::invalid_argument("N must match the SIZE template argument");
+
+		mBackendName = backendName.empty() ? registry.getFastest(M) : backendName;
+		mBackend.reset(registry.create(mBackendName, M));
+
+		if (mBackend == nullptr)
+			throw std::invalid_argument("Unknown FFT backend \"" + mBackendName + "\"");
+
+		/* Real spectrum separation twiddles exp(-2 pi i k / N), k <= M/2 */
+		mRealTwiddleReal.resize(M / 2 + 1);
+		mRealTwiddleImag.resize(M / 2 + 1);
+		for (k = 0; k <= M / 2; ++k) {
+			mRealTwiddleReal[k] = cos(M_PI * k / M);
+			mRealTwiddleImag[k] = -sin(M_PI * k / M);
+		}
+
+		/* Odd-bin transform twiddles exp(-i pi m / N), m < M */
+		mOddTwiddleReal.resize(M + 1);
+		mOddTwiddleImag.resize(M + 1);
+		for (k = 0; k < M; ++k) {
+			mOddTwiddleReal[k] = cos(M_PI * k / N);
+			mOddTwiddleImag[k] = -sin(M_PI * k / N);
 		}
-		j = j + k;
 	}
-	
-	for (l = 1; l <= M; ++l) {
-		LE = pow(2.0, l);
-		LE2 = LE / 2;
-		UR = 1;
-		UI = 0;
-		SR = cos(M_PI / LE2);
-		SI = sin(M_PI / LE2);
-		for (j = 1; j <= LE2; ++j) {
-			jm1 = j - 1;
-			for (i = jm1; i <= NM1; i += LE) {
-				IP = i + LE2;
-				TR = REX[IP] * UR - IMX[IP] * UI;
-				TI = REX[IP] * UI + IMX[IP] * UR;
-				REX[IP] = REX[i] - TR;
-				IMX[IP] = IMX[i] - TI;
-				REX[i] = REX[i] + TR;
-				IMX[i] = IMX[i] + TI;
-			}
-			TR = UR;
-			UR = TR * SR - UI * SI;
-			UI = TR * SI + UI * SR;
+
+	/* The name of the backend computing this plan's complex FFTs. */
+	const std::string &getBackendName() const { return mBackendName; }
+
+	/* The real transform length N this plan was created for. */
+	unsigned int getSize() const { return (SIZE != 0) ? SIZE : mN; }
+
+	/* The length N/2 of the underlying complex transform. */
+	unsigned int getHalfSize() const { return (SIZE != 0) ? SIZE / 2 : mM; }
+
+	/* Forward complex FFT of the N/2 points held in REX and IMX. */
+	void fft(T *REX, T *IMX) const
+	{
+		mBackend->fft(REX, IMX);
+	}
+
+	/* Inverse complex FFT of the N/2 points held in REX and IMX, scaled by 2/N. */
+	void ifft(T *REX, T *IMX) const
+	{
+		const unsigned int M = getHalfSize();
+		const T scale = (T)1 / M;
+		unsigned int i;
+
+		/* Swapping the real and imaginary parts turns the forward transform into the inverse */
+		fft(IMX, REX);
+
+		for (i = 0; i < M; ++i) {
+			REX[i] *= scale;
+			IMX[i] *= scale;
 		}
 	}
-}
 
+	/* Real-input Fast Fourier Transform.
+	 * On input REX holds N real samples (IMX is used as scratch space).
+	 * On output REX and IMX hold the N/2+1 non-redundant frequency bins
+	 * X(0) ... X(N/2). Both arrays must hold at least N/2+1 elements.
+	 * The transform is computed as one complex FFT of size N/2 whose real and
+	 * imaginary inputs are the even and odd samples of the input. */
+	void rfft(T *REX, T *IMX) const
+	{
+		const unsigned int M = getHalfSize();
+		const T *cr = mRealTwiddleReal.data();
+		const T *ci = mRealTwiddleImag.data();
+		unsigned int k, m;
+		T zr, zi, wr, wi, fer, fei, For, foi, tr, ti;
 
-/* Inverse Fast Fourier Transform */
-template <typename T>
-void ifft(T *REX, T *IMX, unsigned int N)
-{
-	int i, k;
-
-	/* Change the sign of IMX[] */
-	for (k = 0; k < N; ++k)
-		IMX[k] *= -1;
-	
-    fft(REX, IMX, N);
-	
-	for (i=0; i < N; ++i) {
-		REX[i] = REX[i] / N;
-		IMX[i] = -1 * IMX[i] / N;
+		/* Pack the even samples into the real part and the odd samples into the imaginary part */
+		for (m = 0; m < M; ++m) {
+			IMX[m] = REX[2 * m + 1];
+			REX[m] = REX[2 * m];
+		}
+
+		fft(REX, IMX);
+
+		/* Separate the spectra of the even and odd samples and combine them */
+		zr = REX[0];
+		zi = IMX[0];
+		REX[0] = zr + zi;
+		IMX[0] = 0;
+		REX[M] = zr - zi;
+		IMX[M] = 0;
+
+		for (k = 1; k <= M / 2; ++k) {
+			zr = REX[k];
+			zi = IMX[k];
+			wr = REX[M - k];
+			wi = IMX[M - k];
+
+			fer = (zr + wr) * 0.5;
+			fei = (zi - wi) * 0.5;
+			For = (zi + wi) * 0.5;
+			foi = (wr - zr) * 0.5;
+
+			tr = For * cr[k] - foi * ci[k];
+			ti = For * ci[k] + foi * cr[k];
+
+			REX[k] = fer + tr;
+			IMX[k] = fei + ti;
+			REX[M - k] = fer - tr;
+			IMX[M - k] = ti - fei;
+		}
+	}
+
+	/* Inverse of rfft().
+	 * On input REX and IMX hold the N/2+1 frequency bins X(0) ... X(N/2) of a
+	 * real signal. On output REX holds the N real samples of the signal; the
+	 * contents of IMX are undefined. As with ifft(), the result is scaled by 1/N. */
+	void irfft(T *REX, T *IMX) const
+	{
+		const unsigned int M = getHalfSize();
+		const T *cr = mRealTwiddleReal.data();
+		const T *ci = mRealTwiddleImag.data();
+		int k, m;
+		T xr, xi, yr, yi, fer, fei, dr, di, For, foi;
+
+		/* Recombine the spectra of the even and odd samples */
+		xr = REX[0];
+		yr = REX[M];
+		REX[0] = (xr + yr) * 0.5;
+		IMX[0] = (xr - yr) * 0.5;
+
+		for (k = 1; k <= (int)M / 2; ++k) {
+			xr = REX[k];
+			xi = IMX[k];
+			yr = REX[M - k];
+			yi = IMX[M - k];
+
+			fer = (xr + yr) * 0.5;
+			fei = (xi - yi) * 0.5;
+			dr = (xr - yr) * 0.5;
+			di = (xi + yi) * 0.5;
+
+			/* Fo = D * conj(W^k) */
+			For = dr * cr[k] + di * ci[k];
+			foi = di * cr[k] - dr * ci[k];
+
+			REX[k] = fer - foi;
+			IMX[k] = fei + For;
+			REX[M - k] = fer + foi;
+			IMX[M - k] = For - fei;
+		}
+
+		ifft(REX, IMX);
+
+		/* Unpack the even and odd samples */
+		for (m = M - 1; m >= 0; --m) {
+			REX[2 * m + 1] = IMX[m];
+			REX[2 * m] = REX[m];
+		}
 	}
-}
+
+	/* Odd-bin Fast Fourier Transform of real input.
+	 * Computes the spectrum of N real samples at the half-integer frequencies
+	 * k + 1/2, which are exactly the odd bins of the 2N-point DFT of the input
+	 * padded with N zeros. Only every other one of these bins, C(r) = Y(2r) for
+	 * r = 0 ... N/2-1, is stored; the remaining ones are their complex conjugates.
+	 * Spectra in this representation can be multiplied bin-by-bin to convolve.
+	 * On input REX holds N real samples (IMX is used as scratch space).
+	 * On output REX and IMX hold the N/2 bins C(0) ... C(N/2-1). */
+	void rfft_odd(T *REX, T *IMX) const
+	{
+		const unsigned int M = getHalfSize();
+		const T *cr = mOddTwiddleReal.data();
+		const T *ci = mOddTwiddleImag.data();
+		unsigned int m;
+		T xr, xi;
+
+		/* c(m) = (x(m) - i x(m + N/2)) * exp(-i pi m / N) */
+		for (m = 0; m < M; ++m) {
+			xr = REX[m];
+			xi = -REX[m + M];
+			REX[m] = xr * cr[m] - xi * ci[m];
+			IMX[m] = xr * ci[m] + xi * cr[m];
+		}
+
+		fft(REX, IMX);
+	}
+
+	/* Inverse of rfft_odd().
+	 * On input REX and IMX hold the N/2 bins C(0) ... C(N/2-1).
+	 * On output REX holds the N real samples; the contents of IMX are undefined. */
+	void irfft_odd(T *REX, T *IMX) const
+	{
+		const unsigned int M = getHalfSize();
+		const T *cr = mOddTwiddleReal.data();
+		const T *ci = mOddTwiddleImag.data();
+		unsigned int m;
+		T zr, zi;
+
+		ifft(REX, IMX);
+
+		/* Multiply by conj(exp(-i pi m / N)) */
+		for (m = 0; m < M; ++m) {
+			zr = REX[m];
+			zi = IMX[m];
+			REX[m] = zr * cr[m] + zi * ci[m];
+			REX[m + M] = zr * ci[m] - zi * cr[m];
+		}
+	}
+
+private:
+	unsigned int mN;
+	unsigned int mM;
+	std::string mBackendName;
+	std::unique_ptr<FFTBackend<T> > mBackend;
+	std::vector<T> mRealTwiddleReal;
+	std::vector<T> mRealTwiddleImag;
+	std::vector<T> mOddTwiddleReal;
+	std::vector<T> mOddTwiddleImag;
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,378 @@
+/* Pluggable complex FFT backends.
+ *
+ * Every real-input transform in FFTPlan is built on one forward complex FFT
+ * of N/2 points. That FFT is delegated to an FFTBackend, chosen from the
+ * FFTBackendRegistry of the sample type:
+ *
+ *   "scalar"  portable radix-4 kernels
+ *   "sse2"    \
+ *   "avx2"     > vectorized radix-4 kernels (fft_simd.hpp), registered only
+ *   "avx512"  /  when the running CPU supports the instruction set
+ *   "fftw"    FFTW 3, registered when the project is built with
+ *             RTCONVOLVE_USE_FFTW defined to 1, in which case it must also
+ *             link against fftw3 (double) and fftw3f (float). Off by default.
+ *
+ * Further backends can be registered with FFTBackendRegistry::add() at startup.
+ * Since no single FFT is fastest on every machine and at every size, the
+ * registry can time every backend at a given size and remember the fastest
+ * one; FFTPlan uses this by default. */
+
+#ifndef __FFT_BACKEND__
+#define __FFT_BACKEND__
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include "fft_simd.hpp"
+
+/* Opt-in: finding <fftw3.h> does not mean the project links against FFTW */
+#ifndef RTCONVOLVE_USE_FFTW
+ #define RTCONVOLVE_USE_FFTW 0
+#endif
+
+#if RTCONVOLVE_USE_FFTW
+ #include <fftw3.h>
+#endif
+
+/* Interface of a forward complex FFT of a fixed size, in place, on split
+ * real and imaginary arrays. A backend is created for one size M and must
+ * not allocate memory or block in fft(). */
+template <typename T>
+class FFTBackend
+{
+public:
+	virtual ~FFTBackend() {}
+
+	/* Forward complex FFT of the M points held in REX and IMX, using the
+	 * exp(-2 pi i n k / M) kernel and no scaling. */
+	virtual void fft(T *REX, T *IMX) const = 0;
+};
+
+
+/* Backend running the radix-4 passes of fft_simd.hpp for the instruction
+ * set IS. A non-zero FIXED_M makes the transform size a compile-time constant. */
+template <typename T, FFTInstructionSet IS, unsigned int FIXED_M = 0>
+class Radix4FFTBackend : public FFTBackend<T>
+{
+public:
+	explicit Radix4FFTBackend(unsigned int M)
+	: mM(M)
+	{
+		unsigned int i, j, k, L, bits;
+
+		/* Bit reversal swaps */
+		bits = 0;
+		while ((1u << bits) < M)
+			++bits;
+
+		for (i = 0; i < M; ++i) {
+			j = 0;
+			for (k = 0; k < bits; ++k)
+				j |= ((i >> k) & 1u) << (bits - 1 - k);
+			if (i < j) {
+				mBitReverse.push_back(i);
+				mBitReverse.push_back(j);
+			}
+		}
+
+		/* Radix-4 twiddles w1 = W(2L)^j, w2 = W(4L)^j and w3 = W(4L)^3j, j < L,
+		   for each pass, stored one pass after another (see fft_radix4.hpp) */
+		for (L = (bits & 1) ? 2 : 1; 4 * L <= M; L *= 4) {
+			for (j = 0; j < L; ++j) {
+				mTwiddles[0].push_back(cos(M_PI * j / L));
+				mTwiddles[1].push_back(-sin(M_PI * j / L));
+				mTwiddles[2].push_back(cos(M_PI * j / (2 * L)));
+				mTwiddles[3].push_back(-sin(M_PI * j / (2 * L)));
+				mTwiddles[4].push_back(cos(M_PI * 3 * j / (2 * L)));
+				mTwiddles[5].push_back(-sin(M_PI * 3 * j / (2 * L)));
+			}
+		}
+
+		for (k = 0; k < 6; ++k)
+			mTwiddlePointers[k] = mTwiddles[k].data();
+	}
+
+	void fft(T *REX, T *IMX) const override
+	{
+		const unsigned int *swaps = mBitReverse.data();
+		const unsigned int numSwaps = (unsigned int)mBitReverse.size();
+		unsigned int i, j, s;
+		T TR, TI;
+
+		/* Bit reversal sorting */
+		for (s = 0; s < numSwaps; s += 2) {
+			i = swaps[s];
+			j = swaps[s + 1];
+			TR = REX[j];
+			TI = IMX[j];
+			REX[j] = REX[i];
+			IMX[j] = IMX[i];
+			REX[i] = TR;
+			IMX[i] = TI;
+		}
+
+		radix4PassesDispatch<FIXED_M>(IS, REX, IMX, mM, mTwiddlePointers);
+	}
+
+	/* Factory for the registry. The sizes used by the convolvers at the
+	 * common host buffer sizes get a backend specialized for that size. */
+	static FFTBackend<T> *create(unsigned int M)
+	{
+		switch (M) {
+		case 64:   return new Radix4FFTBackend<T, IS, 64>(M);
+		case 128:  return new Radix4FFTBackend<T, IS, 128>(M);
+		case 256:  return new Radix4FFTBackend<T, IS, 256>(M);
+		case 512:  return new Radix4FFTBackend<T, IS, 512>(M);
+		case 1024: return new Radix4FFTBackend<T, IS, 1024>(M);
+		default:   return new Radix4FFTBackend<T, IS, 0>(M);
+		}
+	}
+
+private:
+	unsigned int mM;
+	std::vector<unsigned int> mBitReverse;
+	std::vector<T> mTwiddles[6];
+	const T *mTwiddlePointers[6];
+};
+
+
+#if RTCONVOLVE_USE_FFTW
+
+/* FFTW's planner is not thread-safe, only fftw_execute is. */
+inline std::mutex &getFFTWPlannerLock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+template <typename T>
+class FFTWBackend;
+
+template <>
+class FFTWBackend<double> : public FFTBackend<double>
+{
+public:
+	explicit FFTWBackend(unsigned int M)
+	{
+		std::vector<double> re(M), im(M);
+		fftw_iodim dim = { (int)M, 1, 1 };
+		std::lock_guard<std::mutex> lock(getFFTWPlannerLock());
+		mPlan = fftw_plan_guru_split_dft(1, &dim, 0, nullptr, re.data(), im.data(), re.data(), im.data(),
+		                                 FFTW_MEASURE | FFTW_UNALIGNED);
+		if (mPlan == nullptr)
+			throw std::runtime_error("FFTW could not create a plan");
+	}
+
+	~FFTWBackend()
+	{
+		std::lock_guard<std::mutex> lock(getFFTWPlannerLock());
+		fftw_destroy_plan(mPlan);
+	}
+
+	void fft(double *REX, double *IMX) const override
+	{
+		fftw_execute_split_dft(mPlan, REX, IMX, REX, IMX);
+	}
+
+	static FFTBackend<double> *create(unsigned int M) { return new FFTWBackend(M); }
+
+private:
+	fftw_plan mPlan;
+};
+
+template <>
+class FFTWBackend<float> : public FFTBackend<float>
+{
+public:
+	explicit FFTWBackend(unsigned int M)
+	{
+		std::vector<float> re(M), im(M);
+		fftwf_iodim dim = { (int)M, 1, 1 };
+		std::lock_guard<std::mutex> lock(getFFTWPlannerLock());
+		mPlan = fftwf_plan_guru_split_dft(1, &dim, 0, nullptr, re.data(), im.data(), re.data(), im.data(),
+		                                  FFTW_MEASURE | FFTW_UNALIGNED);
+		if (mPlan == nullptr)
+			throw std::runtime_error("FFTW could not create a plan");
+	}
+
+	~FFTWBackend()
+	{
+		std::lock_guard<std::mutex> lock(getFFTWPlannerLock());
+		fftwf_destroy_plan(mPlan);
+	}
+
+	void fft(float *REX, float *IMX) const override
+	{
+		fftwf_execute_split_dft(mPlan, REX, IMX, REX, IMX);
+	}
+
+	static FFTBackend<float> *create(unsigned int M) { return new FFTWBackend(M); }
+
+private:
+	fftwf_plan mPlan;
+};
+
+#endif /* RTCONVOLVE_USE_FFTW */
+
+
+/* Process-wide list of the FFT backends available for sample type T. */
+template <typename T>
+class FFTBackendRegistry
+{
+public:
+	typedef FFTBackend<T> *(*Factory)(unsigned int M);
+
+	static FFTBackendRegistry &getInstance()
+	{
+		static FFTBackendRegistry registry;
+		return registry;
+	}
+
+	/* Register a backend. Intended to be called at startup, before any plans
+	 * are created. Registering invalidates previous benchmark results. */
+	void add(const std::string &name, Factory create)
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		mNames.push_back(name);
+		mFactories.push_back(create);
+		mFastest.clear();
+	}
+
+	size_t getNumBackends() const
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		return mNames.size();
+	}
+
+	std::string getName(size_t index) const
+	{
+		std::lock_guard<std::mutex> lock(mLock);
+		return mNames[index];
+	}
+
+	/* Create the backend registered as 'name' for size M, or nullptr if there is none. */
+	FFTBackend<T> *create(const std::string &name, unsigned int M) const
+	{
+		Factory factory = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			for (size_t i = 0; i < mNames.size(); ++i)
+				if (mNames[i] == name)
+					factory = mFactories[i];
+		}
+		return (factory != nullptr) ? factory(M) : nullptr;
+	}
+
+	/* Name of the fastest backend for size M on this machine. The first call
+	 * for a given size times every backend for a few milliseconds; the result
+	 * is remembered for the rest of the process. */
+	std::string getFastest(unsigned int M)
+	{
+		std::lock_guard<std::mutex> benchmarkLock(mBenchmarkLock);
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			typename std::map<unsigned int, std::string>::const_iterator it = mFastest.find(M);
+			if (it != mFastest.end())
+				return it->second;
+		}
+
+		std::vector<std::string> names;
+		std::vector<Factory> factories;
+		{
+			std::lock_guard<std::mutex> lock(mLock);
+			names = mNames;
+			factories = mFactories;
+		}
+
+		size_t fastest = 0;
+		double fastestTime = 0;
+		for (size_t i = 0; i < factories.size(); ++i) {
+			double t = benchmark(factories[i], M);
+			if (i == 0 || t < fastestTime) {
+				fastest = i;
+				fastestTime = t;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mLock);
+		mFastest[M] = names[fastest];
+		return names[fastest];
+	}
+
+	/* Create the fastest backend for size M (see getFastest()). */
+	FFTBackend<T> *createFastest(unsigned int M)
+	{
+		return create(getFastest(M), M);
+	}
+
+private:
+	FFTBackendRegistry()
+	{
+		const FFTInstructionSet supported = getFFTInstructionSet();
+
+		add("scalar", &Radix4FFTBackend<T, kFFTScalar>::create);
+#if RTCONVOLVE_FFT_SIMD
+		if (supported >= kFFTSSE2)
+			add("sse2", &Radix4FFTBackend<T, kFFTSSE2>::create);
+		if (supported >= kFFTAVX2)
+			add("avx2", &Radix4FFTBackend<T, kFFTAVX2>::create);
+		if (supported >= kFFTAVX512)
+			add("avx512", &Radix4FFTBackend<T, kFFTAVX512>::create);
+#endif
+		addFFTW();
+	}
+
+	void addFFTW();
+
+	/* Seconds per transform: the best of several timed runs of back-to-back
+	 * transforms of the same (reset) input. */
+	static double benchmark(Factory factory, unsigned int M)
+	{
+		const int numRuns = 5;
+		const int transformsPerRun = (int)std::max(1u, 16384u / std::max(M, 1u));
+		std::unique_ptr<FFTBackend<T> > backend(factory(M));
+		std::vector<T> inputReal(M), inputImag(M), re(M), im(M);
+		double best = 0;
+
+		for (unsigned int i = 0; i < M; ++i) {
+			inputReal[i] = (T)sin(0.1 * i);
+			inputImag[i] = (T)cos(0.3 * i);
+		}
+
+		for (int run = 0; run <= numRuns; ++run) {
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			for (int k = 0; k < transformsPerRun; ++k) {
+				memcpy(re.data(), inputReal.data(), M * sizeof(T));
+				memcpy(im.data(), inputImag.data(), M * sizeof(T));
+				backend->fft(re.data(), im.data());
+			}
+			double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			/* The first run only warms up caches and branch predictors */
+			if (run == 1 || (run > 1 && t < best))
+				best = t;
+		}
+		return best / transformsPerRun;
+	}
+
+	mutable std::mutex mLock;
+	std::mutex mBenchmarkLock;
+	std::vector<std::string> mNames;
+	std::vector<Factory> mFactories;
+	std::map<unsigned int, std::string> mFastest;
+};
+
+#if RTCONVOLVE_USE_FFTW
+template <> inline void FFTBackendRegistry<float>::addFFTW() { add("fftw", &FFTWBackend<float>::create); }
+template <> inline void FFTBackendRegistry<double>::addFFTW() { add("fftw", &FFTWBackend<double>::create); }
+#endif
+template <typename T> inline void FFTBackendRegistry<T>::addFFTW() {}
+
+#endif
@@ -0,0 +1,211 @@
+/* Batched Fast Fourier Transforms.
+ *
+ * A BatchFFTPlan transforms many independent signals of the same length at
+ * once. The signals are interleaved sample by sample, in a structure of arrays
+ * layout: sample n of signal v is at n * numLanes + v, and likewise for the
+ * bins of their spectra. The butterflies of fft_batch_kernel.hpp are then
+ * vectorized across the signals rather than within one, which keeps the
+ * vectors full for the short transforms of many small convolutions, and every
+ * twiddle is loaded once for the whole batch.
+ *
+ * The kernels are compiled for the same instruction sets as those of
+ * fft_simd.hpp, and the best one the running CPU supports is chosen at runtime
+ * by getFFTInstructionSet(). */
+
+#ifndef __FFT_BATCH__
+#define __FFT_BATCH__
+
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
+#include "fft_simd.hpp"
+
+/* The tables of a BatchFFTPlan used by the kernels. */
+template <typename T>
+struct BatchFFTTables
+{
+	/* The length of the complex transforms, N/2 */
+	unsigned int M;
+
+	/* Pairs of rows exchanged by the bit reversal */
+	const unsigned int *swaps;
+	unsigned int numSwaps;
+
+	/* Butterfly twiddles exp(-2 pi i k / M), k < M/2 */
+	const T *twiddleReal;
+	const T *twiddleImag;
+
+	/* Real spectrum separation twiddles exp(-2 pi i k / N), k <= M/2 */
+	const T *realTwiddleReal;
+	const T *realTwiddleImag;
+};
+
+namespace fft_scalar
+{
+	#include "fft_batch_kernel.hpp"
+}
+
+#if RTCONVOLVE_FFT_SIMD
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("sse2")
+#endif
+namespace fft_sse2
+{
+	#include "fft_batch_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("avx2,fma")
+#endif
+namespace fft_avx2
+{
+	#include "fft_batch_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+ #pragma clang attribute push (__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+ #pragma GCC push_options
+ #pragma GCC target("avx512f,avx2,fma")
+#endif
+namespace fft_avx512
+{
+	#include "fft_batch_kernel.hpp"
+}
+#if defined(__clang__)
+ #pragma clang attribute pop
+#elif defined(__GNUC__)
+ #pragma GCC pop_options
+#endif
+
+#endif /* RTCONVOLVE_FFT_SIMD */
+
+/* Precomputed plan of batched transforms of real length N (a power of 2).
+ * Like FFTPlan, the plan owns every table of its length, and its transforms
+ * neither allocate memory nor modify it, so it may be shared by any number of
+ * batches of any number of lanes. The transforms compute the same spectra as
+ * the ones of FFTPlan, for every lane. */
+template <typename T>
+class BatchFFTPlan
+{
+public:
+	explicit BatchFFTPlan(unsigned int N)
+	: mN(N)
+	{
+		const unsigned int M = N / 2;
+		unsigned int i, j, k, bits;
+
+		if (N < 2 || (N & (N - 1)) != 0)
+			throw std::invalid_argument("N must be a power of 2");
+
+		/* Bit reversal swaps */
+		bits = 0;
+		while ((1u << bits) < M)
+			++bits;
+
+		for (i = 0; i < M; ++i) {
+			j = 0;
+			for (k = 0; k < bits; ++k)
+				j |= ((i >> k) & 1u) << (bits - 1 - k);
+			if (i < j) {
+				mBitReverse.push_back(i);
+				mBitReverse.push_back(j);
+			}
+		}
+
+		for (k = 0; k < M / 2; ++k) {
+			mTwiddleReal.push_back(cos(2.0 * M_PI * k / M));
+			mTwiddleImag.push_back(-sin(2.0 * M_PI * k / M));
+		}
+
+		for (k = 0; k <= M / 2; ++k) {
+			mRealTwiddleReal.push_back(cos(M_PI * k / M));
+			mRealTwiddleImag.push_back(-sin(M_PI * k / M));
+		}
+
+		mTables.M = M;
+		mTables.swaps = mBitReverse.data();
+		mTables.numSwaps = (unsigned int)mBitReverse.size();
+		mTables.twiddleReal = mTwiddleReal.data();
+		mTables.twiddleImag = mTwiddleImag.data();
+		mTables.realTwiddleReal = mRealTwiddleReal.data();
+		mTables.realTwiddleImag = mRealTwiddleImag.data();
+	}
+
+	/* The real transform length N this plan was created for. */
+	unsigned int getSize() const { return mN; }
+
+	/* Forward complex FFTs of the N/2 points of each of the numLanes
+	 * interleaved transforms held in REX and IMX. */
+	void fft(T *REX, T *IMX, unsigned int numLanes) const
+	{
+		switch (getFFTInstructionSet()) {
+#if RTCONVOLVE_FFT_SIMD
+		case kFFTAVX512: fft_avx512::batchFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTAVX2: fft_avx2::batchFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTSSE2: fft_sse2::batchFFT(REX, IMX, numLanes, mTables); break;
+#endif
+		default: fft_scalar::batchFFT(REX, IMX, numLanes, mTables); break;
+		}
+	}
+
+	/* Real-input FFTs of numLanes signals, as FFTPlan::rfft() for each lane.
+	 * On input REX holds N interleaved rows of samples (IMX is used as scratch
+	 * space). On output REX and IMX hold the N/2+1 rows of bins X(0) ... X(N/2).
+	 * Both arrays must hold at least (N/2+1) * numLanes elements. */
+	void rfft(T *REX, T *IMX, unsigned int numLanes) const
+	{
+		switch (getFFTInstructionSet()) {
+#if RTCONVOLVE_FFT_SIMD
+		case kFFTAVX512: fft_avx512::batchRealFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTAVX2: fft_avx2::batchRealFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTSSE2: fft_sse2::batchRealFFT(REX, IMX, numLanes, mTables); break;
+#endif
+		default: fft_scalar::batchRealFFT(REX, IMX, numLanes, mTables); break;
+		}
+	}
+
+	/* Inverse of rfft(), as FFTPlan::irfft() for each lane.
+	 * On input REX and IMX hold the N/2+1 rows of bins. On output REX holds the
+	 * N rows of samples; the contents of IMX are undefined. */
+	void irfft(T *REX, T *IMX, unsigned int numLanes) const
+	{
+		switch (getFFTInstructionSet()) {
+#if RTCONVOLVE_FFT_SIMD
+		case kFFTAVX512: fft_avx512::batchInverseRealFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTAVX2: fft_avx2::batchInverseRealFFT(REX, IMX, numLanes, mTables); break;
+		case kFFTSSE2: fft_sse2::batchInverseRealFFT(REX, IMX, numLanes, mTables); break;
+#endif
+		default: fft_scalar::batchInverseRealFFT(REX, IMX, numLanes, mTables); break;
+		}
+	}
+
+private:
+	unsigned int mN;
+	std::vector<unsigned int> mBitReverse;
+	std::vector<T> mTwiddleReal;
+	std::vector<T> mTwiddleImag;
+	std::vector<T> mRealTwiddleReal;
+	std::vector<T> mRealTwiddleImag;
+	BatchFFTTables<T> mTables;
+};
+
+#endif
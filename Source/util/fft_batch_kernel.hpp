@@ -0,0 +1,248 @@
+/* Batched real and complex FFT kernels.
+ *
+ * Like fft_radix4.hpp, this file intentionally has no include guard. It is
+ * included once per instruction set by fft_batch.hpp, inside the namespaces
+ * of fft_simd.hpp that define Vec<float> and Vec<double>.
+ *
+ * The batch holds numLanes transforms interleaved point by point: point n of
+ * transform v is at n * numLanes + v. Every step applies the same twiddle to
+ * the same point of every transform, so the vectors span the lanes, and are
+ * full however short the transforms are. */
+
+/* Forward complex FFTs of the numLanes M-point transforms held in REX and IMX. */
+template <typename T>
+void batchFFT(T *REX, T *IMX, unsigned int numLanes, const BatchFFTTables<T> &tables)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	const unsigned int M = tables.M;
+	const T *TWR = tables.twiddleReal, *TWI = tables.twiddleImag;
+	unsigned int i, j, s, v, L;
+	T *ar, *ai, *br, *bi;
+
+	/* Bit reversal sorting, one row of lanes at a time */
+	for (s = 0; s < tables.numSwaps; s += 2) {
+		ar = REX + tables.swaps[s] * numLanes;
+		ai = IMX + tables.swaps[s] * numLanes;
+		br = REX + tables.swaps[s + 1] * numLanes;
+		bi = IMX + tables.swaps[s + 1] * numLanes;
+
+		for (v = 0; v + W <= numLanes; v += W) {
+			VT xr = V::load(ar + v), xi = V::load(ai + v);
+			V::store(ar + v, V::load(br + v));
+			V::store(ai + v, V::load(bi + v));
+			V::store(br + v, xr);
+			V::store(bi + v, xi);
+		}
+
+		for (; v < numLanes; ++v) {
+			T tr = ar[v], ti = ai[v];
+			ar[v] = br[v];
+			ai[v] = bi[v];
+			br[v] = tr;
+			bi[v] = ti;
+		}
+	}
+
+	/* Radix-2 passes, twiddles exp(-2 pi i k / M) */
+	for (L = 1; L < M; L *= 2) {
+		const unsigned int twiddleStep = M / (2 * L);
+		const unsigned int span = L * numLanes;
+
+		for (j = 0; j < L; ++j) {
+			const T wr = TWR[j * twiddleStep], wi = TWI[j * twiddleStep];
+			const VT vwr = V::set1(wr), vwi = V::set1(wi);
+
+			for (i = j; i < M; i += 2 * L) {
+				ar = REX + i * numLanes;
+				ai = IMX + i * numLanes;
+				br = ar + span;
+				bi = ai + span;
+
+				for (v = 0; v + W <= numLanes; v += W) {
+					VT xr = V::load(br + v), xi = V::load(bi + v);
+					VT yr = V::load(ar + v), yi = V::load(ai + v);
+					VT tr = V::mulsub(xr, vwr, V::mul(xi, vwi));
+					VT ti = V::muladd(xr, vwi, V::mul(xi, vwr));
+
+					V::store(br + v, V::sub(yr, tr));
+					V::store(bi + v, V::sub(yi, ti));
+					V::store(ar + v, V::add(yr, tr));
+					V::store(ai + v, V::add(yi, ti));
+				}
+
+				for (; v < numLanes; ++v) {
+					const T tr = br[v] * wr - bi[v] * wi;
+					const T ti = br[v] * wi + bi[v] * wr;
+
+					br[v] = ar[v] - tr;
+					bi[v] = ai[v] - ti;
+					ar[v] += tr;
+					ai[v] += ti;
+				}
+			}
+		}
+	}
+}
+
+/* Multiply the first 'size' elements of REX and IMX by 'scale'. */
+template <typename T>
+void batchScale(T *REX, T *IMX, unsigned int size, T scale)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	const VT vs = V::set1(scale);
+	unsigned int i;
+
+	for (i = 0; i + W <= size; i += W) {
+		V::store(REX + i, V::mul(V::load(REX + i), vs));
+		V::store(IMX + i, V::mul(V::load(IMX + i), vs));
+	}
+
+	for (; i < size; ++i) {
+		REX[i] *= scale;
+		IMX[i] *= scale;
+	}
+}
+
+/* Real-input FFTs of the numLanes signals of N = 2M samples held in REX,
+ * computed as complex M-point FFTs of their even and odd samples. On output
+ * REX and IMX hold the M+1 rows of bins X(0) ... X(M). */
+template <typename T>
+void batchRealFFT(T *REX, T *IMX, unsigned int numLanes, const BatchFFTTables<T> &tables)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	const unsigned int M = tables.M;
+	const T *cr = tables.realTwiddleReal, *ci = tables.realTwiddleImag;
+	const size_t rowSize = numLanes * sizeof(T);
+	const VT half = V::set1((T)0.5);
+	unsigned int k, m, v;
+
+	/* Pack the even samples into the real part and the odd samples into the imaginary part */
+	for (m = 0; m < M; ++m) {
+		memcpy(IMX + m * numLanes, REX + (2 * m + 1) * numLanes, rowSize);
+		if (m != 0)
+			memcpy(REX + m * numLanes, REX + 2 * m * numLanes, rowSize);
+	}
+
+	batchFFT(REX, IMX, numLanes, tables);
+
+	/* Separate the spectra of the even and odd samples and combine them */
+	for (v = 0; v < numLanes; ++v) {
+		const T zr = REX[v], zi = IMX[v];
+		REX[v] = zr + zi;
+		IMX[v] = 0;
+		REX[M * numLanes + v] = zr - zi;
+		IMX[M * numLanes + v] = 0;
+	}
+
+	for (k = 1; k <= M / 2; ++k) {
+		T *xr = REX + k * numLanes, *xi = IMX + k * numLanes;
+		T *yr = REX + (M - k) * numLanes, *yi = IMX + (M - k) * numLanes;
+		const VT vcr = V::set1(cr[k]), vci = V::set1(ci[k]);
+
+		for (v = 0; v + W <= numLanes; v += W) {
+			VT zr = V::load(xr + v), zi = V::load(xi + v);
+			VT wr = V::load(yr + v), wi = V::load(yi + v);
+			VT fer = V::mul(V::add(zr, wr), half);
+			VT fei = V::mul(V::sub(zi, wi), half);
+			VT For = V::mul(V::add(zi, wi), half);
+			VT foi = V::mul(V::sub(wr, zr), half);
+			VT tr = V::mulsub(For, vcr, V::mul(foi, vci));
+			VT ti = V::muladd(For, vci, V::mul(foi, vcr));
+
+			V::store(xr + v, V::add(fer, tr));
+			V::store(xi + v, V::add(fei, ti));
+			V::store(yr + v, V::sub(fer, tr));
+			V::store(yi + v, V::sub(ti, fei));
+		}
+
+		for (; v < numLanes; ++v) {
+			const T zr = xr[v], zi = xi[v], wr = yr[v], wi = yi[v];
+			const T fer = (zr + wr) * (T)0.5, fei = (zi - wi) * (T)0.5;
+			const T For = (zi + wi) * (T)0.5, foi = (wr - zr) * (T)0.5;
+			const T tr = For * cr[k] - foi * ci[k];
+			const T ti = For * ci[k] + foi * cr[k];
+
+			xr[v] = fer + tr;
+			xi[v] = fei + ti;
+			yr[v] = fer - tr;
+			yi[v] = ti - fei;
+		}
+	}
+}
+
+/* Inverse of batchRealFFT(). On output REX holds the N rows of samples, scaled
+ * by 1/N; the contents of IMX are undefined. */
+template <typename T>
+void batchInverseRealFFT(T *REX, T *IMX, unsigned int numLanes, const BatchFFTTables<T> &tables)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	const unsigned int M = tables.M;
+	const T *cr = tables.realTwiddleReal, *ci = tables.realTwiddleImag;
+	const size_t rowSize = numLanes * sizeof(T);
+	const VT half = V::set1((T)0.5);
+	unsigned int k, v;
+	int m;
+
+	/* Recombine the spectra of the even and odd samples */
+	for (v = 0; v < numLanes; ++v) {
+		const T xr = REX[v], yr = REX[M * numLanes + v];
+		REX[v] = (xr + yr) * (T)0.5;
+		IMX[v] = (xr - yr) * (T)0.5;
+	}
+
+	for (k = 1; k <= M / 2; ++k) {
+		T *ar = REX + k * numLanes, *ai = IMX + k * numLanes;
+		T *br = REX + (M - k) * numLanes, *bi = IMX + (M - k) * numLanes;
+		const VT vcr = V::set1(cr[k]), vci = V::set1(ci[k]);
+
+		for (v = 0; v + W <= numLanes; v += W) {
+			VT xr = V::load(ar + v), xi = V::load(ai + v);
+			VT yr = V::load(br + v), yi = V::load(bi + v);
+			VT fer = V::mul(V::add(xr, yr), half);
+			VT fei = V::mul(V::sub(xi, yi), half);
+			VT dr = V::mul(V::sub(xr, yr), half);
+			VT di = V::mul(V::add(xi, yi), half);
+
+			/* Fo = D * conj(W^k) */
+			VT For = V::muladd(dr, vcr, V::mul(di, vci));
+			VT foi = V::mulsub(di, vcr, V::mul(dr, vci));
+
+			V::store(ar + v, V::sub(fer, foi));
+			V::store(ai + v, V::add(fei, For));
+			V::store(br + v, V::add(fer, foi));
+			V::store(bi + v, V::sub(For, fei));
+		}
+
+		for (; v < numLanes; ++v) {
+			const T xr = ar[v], xi = ai[v], yr = br[v], yi = bi[v];
+			const T fer = (xr + yr) * (T)0.5, fei = (xi - yi) * (T)0.5;
+			const T dr = (xr - yr) * (T)0.5, di = (xi + yi) * (T)0.5;
+			const T For = dr * cr[k] + di * ci[k];
+			const T foi = di * cr[k] - dr * ci[k];
+
+			ar[v] = fer - foi;
+			ai[v] = fei + For;
+			br[v] = fer + foi;
+			bi[v] = For - fei;
+		}
+	}
+
+	/* Swapping the real and imaginary parts turns the forward transform into the inverse */
+	batchFFT(IMX, REX, numLanes, tables);
+	batchScale(REX, IMX, M * numLanes, (T)1 / M);
+
+	/* Unpack the even and odd samples */
+	for (m = (int)M - 1; m >= 0; --m) {
+		if (m != 0)
+			memcpy(REX + 2 * m * numLanes, REX + m * numLanes, rowSize);
+		memcpy(REX + (2 * m + 1) * numLanes, IMX + m * numLanes, rowSize);
+	}
+}
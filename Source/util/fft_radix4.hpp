@@ -0,0 +1,107 @@
+/* Radix-4 butterfly passes of the complex FFT.
+ *
+ * This file intentionally has no include guard. fft_simd.hpp includes it once
+ * per instruction set, inside a namespace that defines Vec<float> and
+ * Vec<double> for that instruction set and inside a region that is compiled
+ * for it. The passes are written once against the Vec<T> operations:
+ *
+ *   type, width, load(), store(), add(), sub(), mul(),
+ *   muladd(a, b, c) = a * b + c, mulsub(a, b, c) = a * b - c,
+ *   nmuladd(a, b, c) = c - a * b, zero(), set1(a) = a in every lane
+ *
+ * Butterflies whose quarter length is shorter than the vector width are
+ * computed by the scalar radix4Butterfly() from fft_simd.hpp. */
+
+/* Compute every butterfly pass of an M-point complex FFT whose input has
+ * already been put in bit reversed order. Two radix-2 passes are fused into
+ * one radix-4 pass, so the data is only read and written once for every two
+ * stages. When log2(M) is odd, one twiddle-free radix-2 pass comes first.
+ * TW holds the real and imaginary parts of the radix-4 twiddles w1, w2 and w3
+ * of every pass, laid out as described in Radix4FFTBackend. A non-zero FIXED_M replaces
+ * M with a compile-time constant, so that every pass and loop bound is known
+ * to the compiler and the short passes can be fully unrolled. */
+template <unsigned int FIXED_M, typename T>
+void radix4Passes(T *REX, T *IMX, unsigned int M, const T *const *TW)
+{
+	typedef Vec<T> V;
+	typedef typename V::type VT;
+	const unsigned int W = V::width;
+	unsigned int i, j, g, L, log2M, offset;
+	T TR, TI;
+
+	if (FIXED_M != 0)
+		M = FIXED_M;
+
+	log2M = 0;
+	while ((1u << log2M) < M)
+		++log2M;
+
+	L = 1;
+	if (log2M & 1) {
+		for (i = 0; i < M; i += 2) {
+			TR = REX[i + 1];
+			TI = IMX[i + 1];
+			REX[i + 1] = REX[i] - TR;
+			IMX[i + 1] = IMX[i] - TI;
+			REX[i] = REX[i] + TR;
+			IMX[i] = IMX[i] + TI;
+		}
+		L = 2;
+	}
+
+	for (offset = 0; 4 * L <= M; offset += L, L *= 4) {
+		const T *w1r = TW[0] + offset;
+		const T *w1i = TW[1] + offset;
+		const T *w2r = TW[2] + offset;
+		const T *w2i = TW[3] + offset;
+		const T *w3r = TW[4] + offset;
+		const T *w3i = TW[5] + offset;
+
+		for (g = 0; g < M; g += 4 * L) {
+			T *r0 = REX + g;
+			T *i0 = IMX + g;
+			T *r1 = r0 + L;
+			T *i1 = i0 + L;
+			T *r2 = r1 + L;
+			T *i2 = i1 + L;
+			T *r3 = r2 + L;
+			T *i3 = i2 + L;
+
+			for (j = 0; j + W <= L; j += W) {
+				VT x0r = V::load(r0 + j), x0i = V::load(i0 + j);
+				VT x1r = V::load(r1 + j), x1i = V::load(i1 + j);
+				VT x2r = V::load(r2 + j), x2i = V::load(i2 + j);
+				VT x3r = V::load(r3 + j), x3i = V::load(i3 + j);
+				VT ar = V::load(w1r + j), ai = V::load(w1i + j);
+				VT br = V::load(w2r + j), bi = V::load(w2i + j);
+				VT cr = V::load(w3r + j), ci = V::load(w3i + j);
+
+				/* p = w1 x1, q = w2 x2, r = w3 x3 */
+				VT pr = V::mulsub(x1r, ar, V::mul(x1i, ai));
+				VT pi = V::muladd(x1r, ai, V::mul(x1i, ar));
+				VT qr = V::mulsub(x2r, br, V::mul(x2i, bi));
+				VT qi = V::muladd(x2r, bi, V::mul(x2i, br));
+				VT sr = V::mulsub(x3r, cr, V::mul(x3i, ci));
+				VT si = V::muladd(x3r, ci, V::mul(x3i, cr));
+
+				VT a0r = V::add(x0r, pr), a0i = V::add(x0i, pi);
+				VT a1r = V::sub(x0r, pr), a1i = V::sub(x0i, pi);
+				VT tr = V::add(qr, sr), ti = V::add(qi, si);
+				VT dr = V::sub(qr, sr), di = V::sub(qi, si);
+
+				V::store(r0 + j, V::add(a0r, tr));
+				V::store(i0 + j, V::add(a0i, ti));
+				V::store(r2 + j, V::sub(a0r, tr));
+				V::store(i2 + j, V::sub(a0i, ti));
+				V::store(r1 + j, V::add(a1r, di));
+				V::store(i1 + j, V::sub(a1i, dr));
+				V::store(r3 + j, V::sub(a1r, di));
+				V::store(i3 + j, V::add(a1i, dr));
+			}
+
+			for (; j < L; ++j) {
+				radix4Butterfly(r0 + j, i0 + j, L, w1r[j], w1i[j], w2r[j], w2i[j], w3r[j], w3i[j]);
+			}
+		}
+	}
+}
@@ -0,0 +1,116 @@
+/* Reduced precision storage formats for spectra.
+ *
+ * Long impulse responses are held as thousands of partition spectra, and the
+ * multiply-accumulate over them is limited by memory bandwidth rather than by
+ * arithmetic. Storing the spectra in one of the 16-bit formats below halves
+ * both their footprint and the memory traffic of the multiply-accumulate. The
+ * values are only ever widened to float in registers, so every product and sum
+ * is still computed in single precision.
+ *
+ *   Half      IEEE 754 binary16: 11 bit significand, relative error 2^-11,
+ *             largest finite value 65504. Values beyond are saturated.
+ *   BFloat16  The upper half of a float: 8 bit significand, relative error
+ *             2^-8, and the full exponent range of float.
+ *
+ * Conversions round to nearest even. Infinities and NaNs are not preserved:
+ * spectra of finite signals never contain them. */
+
+#ifndef __REDUCED_PRECISION__
+#define __REDUCED_PRECISION__
+
+#include <stdint.h>
+#include <string.h>
+
+enum SpectrumPrecision
+{
+	kSpectrumFloat = 0,
+	kSpectrumHalf,
+	kSpectrumBFloat16
+};
+
+inline uint32_t floatToBits(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	return u;
+}
+
+inline float bitsToFloat(uint32_t u)
+{
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+struct Half
+{
+	uint16_t bits;
+
+	Half() : bits(0) {}
+	Half(float f) : bits(fromFloat(f)) {}
+
+	/* Shifting the exponent and significand into place and rescaling by 2^112
+	 * converts both normal and subnormal values. The vector kernels use the
+	 * same sequence. */
+	operator float() const
+	{
+		const uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+		const float magnitude = bitsToFloat((uint32_t)(bits & 0x7fff) << 13) * bitsToFloat(0x77800000);
+		return bitsToFloat(floatToBits(magnitude) | sign);
+	}
+
+	static uint16_t fromFloat(float f)
+	{
+		const uint32_t u = floatToBits(f);
+		const uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+		const float magnitude = bitsToFloat(u & 0x7fffffff);
+
+		if (! (magnitude < 65520.0f))
+			return sign | 0x7bff;	/* Saturate, also for values that would round up to infinity */
+
+		if (magnitude < bitsToFloat(0x38800000)) {
+			/* Subnormal: adding 0.5 aligns the significand so that the hardware
+			 * rounds it to a multiple of 2^-24 */
+			return sign | (uint16_t)(floatToBits(magnitude + 0.5f) - floatToBits(0.5f));
+		}
+
+		const uint32_t m = floatToBits(magnitude);
+		const uint32_t rounded = m + 0xfff + ((m >> 13) & 1);
+		return sign | (uint16_t)((rounded - ((uint32_t)112 << 23)) >> 13);
+	}
+};
+
+struct BFloat16
+{
+	uint16_t bits;
+
+	BFloat16() : bits(0) {}
+	BFloat16(float f) : bits(fromFloat(f)) {}
+
+	operator float() const
+	{
+		return bitsToFloat((uint32_t)bits << 16);
+	}
+
+	static uint16_t fromFloat(float f)
+	{
+		const uint32_t u = floatToBits(f);
+		return (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+	}
+};
+
+/* Convert n values from float (or double) to the storage type S. */
+template <typename S, typename T>
+inline void convertSpectrum(S *dst, const T *src, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; ++i)
+		dst[i] = S((float)src[i]);
+}
+
+template <typename T>
+inline void convertSpectrum(T *dst, const T *src, unsigned int n)
+{
+	memcpy(dst, src, n * sizeof(T));
+}
+
+#endif
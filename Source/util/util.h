@@ -67,6 +67,21 @@ void normalizeStereoImpulseResponse(FLOAT_TYPE *left, FLOAT_TYPE* right, int num
     scaleArray(right, numSamples, scale);
 }
 
+template <typename FLOAT_TYPE>
+void normalizeTrueStereoImpulseResponse(FLOAT_TYPE *const *paths, int numSamples)
+{
+    /* The paths LL, LR, RL and RR: LL and RL add up to the left output, LR and RR to the right */
+    FLOAT_TYPE sumL = summation(paths[0], numSamples) + summation(paths[2], numSamples);
+    FLOAT_TYPE sumR = summation(paths[1], numSamples) + summation(paths[3], numSamples);
+    
+    FLOAT_TYPE scale = fabs(20.0f/std::max(sumL, sumR));
+    
+    for (int path = 0; path < 4; ++path)
+    {
+        scaleArray(paths[path], numSamples, scale);
+    }
+}
+
 template <typename FLOAT_TYPE>
 void normalizeMonoImpulseResponse(FLOAT_TYPE *x, int numSamples)
 {